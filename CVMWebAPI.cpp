@@ -163,6 +163,32 @@ bool CVMWebAPI::hasHypervisor() {
     CRASH_REPORT_END;
 };
 
+/**
+ * Return the telemetry of the hypervisor commands executed by the plugin
+ */
+FB::variant CVMWebAPI::getExecStats() {
+    CRASH_REPORT_BEGIN;
+    if (!hasHypervisor()) return CVME_UNSUPPORTED;
+    CVMWebPtr p = this->getPlugin();
+    std::map<std::string, HVINFO_EXEC> stats;
+    p->hv->getExecStats( &stats );
+    return execStatsToVariant( stats );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the metrics of the hypervisor command queue of the plugin
+ */
+FB::variant CVMWebAPI::getQueueStats() {
+    CRASH_REPORT_BEGIN;
+    if (!hasHypervisor()) return CVME_UNSUPPORTED;
+    CVMWebPtr p = this->getPlugin();
+    HVINFO_QUEUE stats;
+    p->hv->getQueueStats( &stats );
+    return queueStatsToVariant( stats );
+    CRASH_REPORT_END;
+}
+
 // Read-only property version
 std::string CVMWebAPI::get_version() {
     CRASH_REPORT_BEGIN;
@@ -298,6 +324,9 @@ void CVMWebAPI::requestSafeSession_thread( const FB::variant& vmcpURL, const FB:
         /* Wait for delaied hypervisor initiation */
         p->hv->waitTillReady( FBSTRING_PLUGIN_VERSION, onProgress.getFunction(), 2, 25, 50 );
 
+        /* Keep VMs pre-created for the configurations the sessions use (see VBoxSession::open) */
+        p->hv->setPoolSize( this->config.getNumDef<int>( "pool-size", HV_POOL_SIZE ) );
+
         /* Fetch domain info */
         std::string domain = this->getDomainName();
 
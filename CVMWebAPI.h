@@ -75,6 +75,8 @@ public:
         
 //        registerMethod("authenticate",        make_method(this, &CVMWebAPI::authenticate));
         registerMethod("installHypervisor",   make_method(this, &CVMWebAPI::installHV));
+        registerMethod("getExecStats",        make_method(this, &CVMWebAPI::getExecStats));
+        registerMethod("getQueueStats",       make_method(this, &CVMWebAPI::getQueueStats));
 
         // Read-only property
         registerProperty("version",           make_property(this, &CVMWebAPI::get_version));
@@ -94,6 +96,9 @@ public:
         this->throttleBlock = false;
         this->shuttingDown = false;
         
+        // Minimum delay between mutating commands on the same VM
+        setNamedMutexSpacing( this->config.getNumDef<int>( "command-spacing", NAMED_MUTEX_SPACING ) );
+        
     }
 
     ///////////////////////////////////////////////////////////////////////////////
@@ -155,6 +160,8 @@ public:
     FB::variant requestSafeSession( const FB::variant& vmcpURL, const FB::variant &successCb, const FB::variant &failureCb, const FB::variant &progressCB );
     FB::variant requestDaemonAccess( const FB::variant &successCb, const FB::variant &failureCb );
     FB::variant requestControlAccess( const FB::variant &successCb, const FB::variant &failureCb );
+    FB::variant getExecStats();
+    FB::variant getQueueStats();
     std::string getDomainName();
     std::string toString();
     int         authenticate( const std::string& key );
@@ -147,6 +147,86 @@ int CVMWebAPIDaemon::stop() {
     CRASH_REPORT_END;
 }
 
+/**
+ * Query daemon to get the telemetry of the hypervisor commands it executed
+ */
+FB::variant CVMWebAPIDaemon::getExecStats() {
+    CRASH_REPORT_BEGIN;
+    std::map<std::string, HVINFO_EXEC> stats;
+    int ans = daemonGetExecStats( &stats );
+    if (ans != HVE_OK) return ans;
+    return execStatsToVariant( stats );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Query daemon to get the metrics of its hypervisor command queue
+ */
+FB::variant CVMWebAPIDaemon::getQueueStats() {
+    CRASH_REPORT_BEGIN;
+    HVINFO_QUEUE stats;
+    int ans = daemonGetQueueStats( &stats );
+    if (ans != HVE_OK) return ans;
+    return queueStatsToVariant( stats );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Convert the hypervisor command telemetry to a javascript object,
+ * indexed by command. The latency histogram is indexed by the upper
+ * limit (in ms) of each bucket.
+ */
+FB::VariantMap execStatsToVariant( const std::map<std::string, HVINFO_EXEC> & stats ) {
+    CRASH_REPORT_BEGIN;
+    FB::VariantMap ans;
+    for (std::map<std::string, HVINFO_EXEC>::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+        const HVINFO_EXEC * info = &(*it).second;
+        FB::VariantMap cmd, latency;
+        cmd["calls"] = info->calls;
+        cmd["failures"] = info->failures;
+        cmd["retries"] = info->retries;
+        cmd["timeouts"] = info->timeouts;
+        cmd["bytes"] = info->bytes;
+        cmd["totalTime"] = info->totalTime;
+        cmd["maxTime"] = info->maxTime;
+        cmd["coalesced"] = info->coalesced;
+        for (int i = 0; i < HV_EXEC_BUCKETS; i++) {
+            long limit = hypervisorLatencyLimit( i );
+            latency[ (limit == 0) ? "inf" : ntos<long>( limit ) ] = info->latency[i];
+        }
+        cmd["latency"] = latency;
+        ans[ (*it).first ] = cmd;
+    }
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Convert the hypervisor command queue metrics to a javascript object,
+ * with the metrics of each priority class indexed by its name and the
+ * time spent waiting for the named locks
+ */
+FB::VariantMap queueStatsToVariant( const HVINFO_QUEUE & stats ) {
+    CRASH_REPORT_BEGIN;
+    static const char * classNames[HVP_CLASSES] = { "interactive", "lifecycle", "background" };
+    FB::VariantMap ans;
+    ans["running"] = stats.running;
+    for (int i = 0; i < HVP_CLASSES; i++) {
+        FB::VariantMap cls;
+        cls["depth"] = stats.depth[i];
+        cls["maxDepth"] = stats.maxDepth[i];
+        cls["executed"] = stats.executed[i];
+        cls["waitTime"] = stats.waitTime[i];
+        cls["maxWaitTime"] = stats.maxWaitTime[i];
+        ans[ classNames[i] ] = cls;
+    }
+    ans["locks"] = stats.locks;
+    ans["lockWaitTime"] = stats.lockWaitTime;
+    ans["spacingWaitTime"] = stats.spacingWaitTime;
+    return ans;
+    CRASH_REPORT_END;
+}
+
 /**
  * Query daemon to get the current idle time settings
  */
@@ -51,6 +51,8 @@ public:
         registerMethod("start",             make_method(this, &CVMWebAPIDaemon::start));
         registerMethod("stop",              make_method(this, &CVMWebAPIDaemon::stop));
         registerMethod("check",             make_method(this, &CVMWebAPIDaemon::check));
+        registerMethod("getExecStats",      make_method(this, &CVMWebAPIDaemon::getExecStats));
+        registerMethod("getQueueStats",     make_method(this, &CVMWebAPIDaemon::getQueueStats));
 
         // Beautification
         registerMethod("toString",          make_method(this, &CVMWebAPIDaemon::toString));
@@ -70,6 +72,8 @@ public:
     int                     start();
     int                     check();
     void                    start_thread();
+    FB::variant             getExecStats();
+    FB::variant             getQueueStats();
     
     // Read-only properties
     std::string             getDaemonBin();
@@ -93,5 +97,15 @@ private:
 
 };
 
+/**
+ * Convert the hypervisor command telemetry to a javascript object
+ */
+FB::VariantMap              execStatsToVariant  ( const std::map<std::string, HVINFO_EXEC> & stats );
+
+/**
+ * Convert the hypervisor command queue metrics to a javascript object
+ */
+FB::VariantMap              queueStatsToVariant ( const HVINFO_QUEUE & stats );
+
 #endif // H_CVMWebAPIDaemon
 
@@ -447,15 +447,11 @@ int CVMWebAPISession::setProperty( const std::string& name, const std::string& v
     CRASH_REPORT_BEGIN;
     if (name.compare("/CVMWeb/secret") == 0) return HVE_NOT_ALLOWED;
     
-    boost::thread t(boost::bind(&CVMWebAPISession::thread_setProperty, this, name, value ));
-    return HVE_SCHEDULED;
+    /* The write is buffered and flushed in the background */
+    return this->session->setProperty( name, value );
     CRASH_REPORT_END;
 }
 
-void CVMWebAPISession::thread_setProperty( const std::string& name, const std::string& value ) {
-    this->session->setProperty( name, value );
-}
-
 std::string CVMWebAPISession::getProperty( const std::string& name ) {
     CRASH_REPORT_BEGIN;
     if (name.compare("/CVMWeb/secret") == 0) return "";
@@ -463,6 +459,28 @@ std::string CVMWebAPISession::getProperty( const std::string& name ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Return the collected resource usage samples of the VM (oldest first), each one
+ * as an object with the fields time, cpuUser, cpuKernel (percent of the host CPU)
+ * and ram (MBytes)
+ */
+FB::VariantList CVMWebAPISession::getMetrics() {
+    CRASH_REPORT_BEGIN;
+    std::vector<HVINFO_METRIC> samples;
+    this->session->metrics.samples( &samples );
+    FB::VariantList ans;
+    for (std::vector<HVINFO_METRIC>::iterator it = samples.begin(); it != samples.end(); ++it) {
+        FB::VariantMap sample;
+        sample["time"] = (*it).timestamp;
+        sample["cpuUser"] = (double)(*it).cpuUser;
+        sample["cpuKernel"] = (double)(*it).cpuKernel;
+        sample["ram"] = (int)((*it).ramUsed / 1024);
+        ans.push_back( sample );
+    }
+    return ans;
+    CRASH_REPORT_END;
+}
+
 // Read-only parameters
 int CVMWebAPISession::get_executionCap() {
     CRASH_REPORT_BEGIN;
@@ -606,6 +624,20 @@ void CVMWebAPISession::onStop() {
     CRASH_REPORT_END;
 }
 
+void CVMWebAPISession::onChange( const std::vector<std::string>& fields ) {
+    CRASH_REPORT_BEGIN;
+    NOT_ON_SHUTDOWN;
+    this->fire_change( FB::make_variant_list( fields ) );
+    CRASH_REPORT_END;
+}
+
+void CVMWebAPISession::onProperty( const std::string& name, const std::string& value ) {
+    CRASH_REPORT_BEGIN;
+    NOT_ON_SHUTDOWN;
+    this->fire_property( name, value );
+    CRASH_REPORT_END;
+}
+
 std::string CVMWebAPISession::toString() {
     CRASH_REPORT_BEGIN;
     return "[CVMWebAPISession]";
@@ -614,6 +646,7 @@ std::string CVMWebAPISession::toString() {
 
 void CVMWebAPISession::thread_cb_timer() {
     CRASH_REPORT_BEGIN;
+    HVExecPriority priority( HVP_BACKGROUND );
     if (!isAlive) {
         if (this->session->state == STATE_STARTED) {
             if (this->session->isAPIAlive( HSK_HTTP )) {
@@ -627,6 +660,16 @@ void CVMWebAPISession::thread_cb_timer() {
             fire_apiUnavailable();
         }
     }
+    
+    /* Sample the resource usage (a single query serves all the sessions) */
+    if (this->session->state == STATE_STARTED) {
+        try {
+            CVMWebPtr p = this->getPlugin();
+            if (p->hv != NULL) p->hv->updateMetrics();
+        } catch (...) {
+            // The plugin might be already unloaded
+        }
+    }
     CRASH_REPORT_END;
 }
 
@@ -636,6 +679,22 @@ void CVMWebAPISession::cb_timer() {
     CRASH_REPORT_END;
 }
 
+double CVMWebAPISession::get_cpuUsage() {
+    CRASH_REPORT_BEGIN;
+    HVINFO_METRIC sample;
+    if (!this->session->metrics.latest( &sample )) return 0;
+    return sample.cpuUser + sample.cpuKernel;
+    CRASH_REPORT_END;
+}
+
+int CVMWebAPISession::get_ramUsage() {
+    CRASH_REPORT_BEGIN;
+    HVINFO_METRIC sample;
+    if (!this->session->metrics.latest( &sample )) return 0;
+    return (int)(sample.ramUsed / 1024);
+    CRASH_REPORT_END;
+}
+
 bool CVMWebAPISession::get_live() {
     CRASH_REPORT_BEGIN;
     return this->isAlive;
@@ -713,6 +772,7 @@ int CVMWebAPISession::update() {
 }
 void CVMWebAPISession::thread_update() {
     CRASH_REPORT_BEGIN;
+    HVExecPriority priority( HVP_BACKGROUND );
 
     // Don't do anything if we are in the middle of something
     if ((this->session->state == STATE_OPPENING) || (this->session->state == STATE_STARTING)) {
@@ -57,6 +57,7 @@ public:
         registerMethod("setProperty",           make_method(this, &CVMWebAPISession::setProperty));
         registerMethod("getProperty",           make_method(this, &CVMWebAPISession::getProperty));
         registerMethod("setExecutionCap",       make_method(this, &CVMWebAPISession::setExecutionCap));
+        registerMethod("getMetrics",            make_method(this, &CVMWebAPISession::getMetrics));
 
         registerMethod("crash",                 make_method(this, &CVMWebAPISession::crash));
 
@@ -73,6 +74,8 @@ public:
         registerProperty("apiURL",              make_property(this, &CVMWebAPISession::get_apiEntryPoint));
         registerProperty("rdpURL",              make_property(this, &CVMWebAPISession::get_rdp));
         registerProperty("resolution",          make_property(this, &CVMWebAPISession::get_resolution));
+        registerProperty("cpuUsage",            make_property(this, &CVMWebAPISession::get_cpuUsage));
+        registerProperty("ramUsage",            make_property(this, &CVMWebAPISession::get_ramUsage));
 
         registerProperty("daemonControlled",    make_property(this, &CVMWebAPISession::get_daemonControlled,
                                                                     &CVMWebAPISession::set_daemonControlled));
@@ -108,6 +111,8 @@ public:
             this->session->onOpen = boost::bind(&CVMWebAPISession::onOpen, this);
             this->session->onStart = boost::bind(&CVMWebAPISession::onStart, this);
             this->session->onClose = boost::bind(&CVMWebAPISession::onClose, this);
+            this->session->onChange = boost::bind(&CVMWebAPISession::onChange, this, _1);
+            this->session->onProperty = boost::bind(&CVMWebAPISession::onProperty, this, _1, _2);
             
         }
     }
@@ -137,6 +142,8 @@ public:
     FB_JSAPI_EVENT(apiAvailable,2, ( const std::string&, const std::string& ));
     FB_JSAPI_EVENT(apiUnavailable,0, ());
     FB_JSAPI_EVENT(debug,       1, ( const std::string& ));
+    FB_JSAPI_EVENT(change,      1, ( const FB::VariantList& ));
+    FB_JSAPI_EVENT(property,    2, ( const std::string&, const std::string& ));
     
     // Threads
     void thread_close( );
@@ -148,7 +155,6 @@ public:
     void thread_update( );
     void thread_open( const FB::variant &o );
     void thread_start( const FB::variant& cfg );
-    void thread_setProperty( const std::string& name, const std::string& value );
     void thread_cb_timer ( );
     
     // Functions
@@ -164,6 +170,7 @@ public:
     int setExecutionCap(int cap);
     int setProperty( const std::string& name, const std::string& value );
     std::string getProperty( const std::string& name );
+    FB::VariantList getMetrics();
     void crash();
     
     // Property getters
@@ -176,6 +183,8 @@ public:
     int get_daemonMinCap();
     int get_daemonMaxCap();
     int get_daemonFlags();
+    int get_ramUsage();
+    double get_cpuUsage();
     bool get_daemonControlled();
     bool get_live();
     std::string get_name();
@@ -200,6 +209,8 @@ public:
     void onStart();
     void onClose();
     void onStop();
+    void onChange(const std::vector<std::string>&);
+    void onProperty(const std::string&, const std::string&);
     
     // Timer implementation
     FB::TimerPtr    probeTimer;
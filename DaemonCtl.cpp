@@ -221,6 +221,72 @@ short int daemonSet( short int action, short int value ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Fetch the hypervisor command telemetry of the daemon.
+ * (One command is transferred per message, to stay within MAX_MSG_SIZE. The counters
+ * are transferred as 64-bit integers, since the byte counts outgrow 32 bits)
+ */
+int daemonGetExecStats( std::map<std::string, HVINFO_EXEC> * stats ) {
+    CRASH_REPORT_BEGIN;
+    static ThinIPCMessage send, recv;
+    stats->clear();
+    
+    short int count = 1;
+    for (short int i = 0; i < count; i++) {
+        send.reset();
+        recv.reset();
+        send.writeShort( DIPC_GET_EXECSTATS );
+        send.writeShort( i );
+        int res = daemonIPC( &send, &recv );
+        if (res != 0) return HVE_IO_ERROR;
+        
+        /* The daemon replies with the number of commands, followed by the requested one */
+        count = recv.readShort();
+        if (i >= count) break;
+        HVINFO_EXEC * info = &(*stats)[ recv.readString() ];
+        info->calls = (long) recv.readLong();
+        info->failures = (long) recv.readLong();
+        info->retries = (long) recv.readLong();
+        info->timeouts = (long) recv.readLong();
+        info->bytes = (long) recv.readLong();
+        info->totalTime = (long) recv.readLong();
+        info->maxTime = (long) recv.readLong();
+        for (int j = 0; j < HV_EXEC_BUCKETS; j++)
+            info->latency[j] = (long) recv.readLong();
+        info->coalesced = (long) recv.readLong();
+    }
+    
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fetch the hypervisor command queue metrics of the daemon
+ */
+int daemonGetQueueStats( HVINFO_QUEUE * stats ) {
+    CRASH_REPORT_BEGIN;
+    static ThinIPCMessage send, recv;
+    send.reset();
+    recv.reset();
+    send.writeShort( DIPC_GET_QUEUESTATS );
+    int res = daemonIPC( &send, &recv );
+    if (res != 0) return HVE_IO_ERROR;
+    
+    stats->running = recv.readInt();
+    for (int i = 0; i < HVP_CLASSES; i++) {
+        stats->depth[i] = recv.readInt();
+        stats->maxDepth[i] = recv.readInt();
+        stats->executed[i] = (long) recv.readLong();
+        stats->waitTime[i] = (long) recv.readLong();
+        stats->maxWaitTime[i] = (long) recv.readLong();
+    }
+    stats->locks = (long) recv.readLong();
+    stats->lockWaitTime = (long) recv.readLong();
+    stats->spacingWaitTime = (long) recv.readLong();
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
 /**
  * Cross-platform way to start the daemon process in the background
  */
@@ -3,8 +3,10 @@
 #define DAEMONCTL_H_4LFX6MZT
 
 #include "ThinIPC.h"
+#include "Hypervisor.h"
 #include "CrashReport.h"
 #include <string>
+#include <map>
 
 /* Used by daemonLock/~Unlock */
 typedef struct {
@@ -17,6 +19,8 @@ typedef struct {
 #define DIPC_SET_IDLETIME   0x0003
 #define DIPC_GET_IDLETIME   0x0004
 #define DIPC_RELOAD         0x0008
+#define DIPC_GET_EXECSTATS  0x0009
+#define DIPC_GET_QUEUESTATS 0x000A
 
 /* Daemon IPC Responses */
 #define DIPC_ANS_OK         0x0001
@@ -36,6 +40,8 @@ bool                    isDaemonRunning     ( );
 short int               daemonIPC           ( ThinIPCMessage * send, ThinIPCMessage * recv );
 short int               daemonGet           ( short int action );
 short int               daemonSet           ( short int action, short int value );
+int                     daemonGetExecStats  ( std::map<std::string, HVINFO_EXEC> * stats );
+int                     daemonGetQueueStats ( HVINFO_QUEUE * stats );
 int                     daemonStart         ( std::string path_to_bin );
 int                     daemonStop          ( );
 
@@ -102,6 +102,29 @@ bool HVSession::isAPIAlive( unsigned char handshake ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Refresh the state of the given sessions. Hypervisors that can sample the
+ * state of all their VMs at once should override this.
+ */
+int Hypervisor::updateStates( const std::vector<HVSession*> & sessions ) {
+    CRASH_REPORT_BEGIN;
+    int ans = HVE_OK;
+    for (vector<HVSession*>::const_iterator i = sessions.begin(); i != sessions.end(); i++) {
+        int res = (*i)->updateFast();
+        if (res != HVE_OK) ans = res;
+    }
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Collect the resource usage of the host and of the sessions in their metrics
+ * buffers. Not supported by hypervisors without a metrics collector.
+ */
+int Hypervisor::updateMetrics( ) {
+    return HVE_NOT_SUPPORTED;
+}
+
 /**
  * Measure the resources from the sessions
  */
@@ -110,7 +133,8 @@ int Hypervisor::getUsage( HVINFO_RES * resCount ) {
     resCount->memory = 0;
     resCount->cpus = 0;
     resCount->disk = 0;
-    for (vector<HVSession*>::iterator i = this->sessions.begin(); i != this->sessions.end(); i++) {
+    vector<HVSession*> sessions = this->sessions.list();
+    for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
         HVSession* sess = *i;
         resCount->memory += sess->memory;
         resCount->cpus += sess->cpus;
@@ -322,10 +346,77 @@ int Hypervisor::diskImageDownload( std::string url, std::string checksum, std::s
     CRASH_REPORT_END;
 };
 
+/**
+ * Return the command name (ex. "showvminfo" or "guestproperty enumerate")
+ * of the given hypervisor command-line. Used for grouping statistics.
+ */
+std::string hypervisorCommand( const std::string & args ) {
+    CRASH_REPORT_BEGIN;
+    
+    /* Get the first word */
+    size_t pos = args.find(' ');
+    string cmd = args.substr(0, pos);
+    if (pos == string::npos) return cmd;
+    
+    /* Commands that take a sub-command as second argument */
+    if ((cmd == "guestproperty") || (cmd == "list") || (cmd == "metrics") ||
+        (cmd == "hostonlyif") || (cmd == "dhcpserver") || (cmd == "extpack")) {
+        size_t end = args.find(' ', pos+1);
+        cmd += " " + args.substr(pos+1, (end == string::npos) ? string::npos : end - pos - 1);
+    }
+    
+    return cmd;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the given hypervisor command-line has no side-effects, so that
+ * identical concurrent invocations can share the same result
+ */
+bool hypervisorReadOnly( const std::string & args ) {
+    CRASH_REPORT_BEGIN;
+    string cmd = hypervisorCommand( args );
+    return (cmd == "showvminfo") || (cmd == "showhdinfo") ||
+           (cmd == "guestproperty enumerate") || (cmd == "guestproperty get") ||
+           (cmd == "metrics query") || (cmd.substr(0,5) == "list ");
+    CRASH_REPORT_END;
+}
+
+/**
+ * Upper latency limits (ms) of the telemetry histogram buckets.
+ * The last bucket collects everything slower.
+ */
+static const long execBucketLimits[HV_EXEC_BUCKETS - 1] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000
+};
+
+/**
+ * Return the upper latency limit (ms) of the given histogram bucket,
+ * or 0 if the bucket has no upper limit
+ */
+long hypervisorLatencyLimit( int bucket ) {
+    CRASH_REPORT_BEGIN;
+    if ((bucket < 0) || (bucket >= HV_EXEC_BUCKETS - 1)) return 0;
+    return execBucketLimits[bucket];
+    CRASH_REPORT_END;
+}
+
 /**
  * Cross-platform exec and return for the hypervisor control binary
  */
 int Hypervisor::exec( string args, vector<string> * stdoutList, string * stderrMsg, int retries, int timeout ) {
+    CRASH_REPORT_BEGIN;
+    OutputParser output;
+    int execRes = this->execParsed( args, (stdoutList != NULL) ? &output : NULL, stderrMsg, retries, timeout );
+    if (stdoutList != NULL) output.getLines( stdoutList );
+    return execRes;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Exec the hypervisor control binary, streaming its output to the given parser
+ */
+int Hypervisor::execParsed( string args, OutputParser * output, string * stderrMsg, int retries, int timeout ) {
     CRASH_REPORT_BEGIN;
     int execRes = 0;
 
@@ -335,11 +426,71 @@ int Hypervisor::exec( string args, vector<string> * stdoutList, string * stderrM
         /* Execute asynchronously */
         execRes = sysExecAsync( this->hvBinary, args );
 
+    } else if (hypervisorReadOnly( args )) {
+        
+        /* Join an identical query if it's already in flight */
+        HVExecFuturePtr flight;
+        bool leader = false;
+        {
+            boost::unique_lock<boost::mutex> lock( this->execFlightMutex );
+            std::map< std::string, HVExecFuturePtr >::iterator it = this->execFlights.find( args );
+            if (it != this->execFlights.end()) {
+                flight = (*it).second;
+                this->execFlightHits[ hypervisorCommand(args) ]++;
+            } else {
+                flight = boost::make_shared< HVExecFuture >();
+                this->execFlights[ args ] = flight;
+                leader = true;
+            }
+        }
+        
+        if (leader) {
+            
+            /* Execute */
+            string execError;
+            OutputParser execOut;
+            int attempts;
+            this->execEnter();
+            long tStart = getMillis();
+            execRes = sysExecParsed( this->hvBinary, args, &execOut, &execError, retries, timeout, &attempts );
+            this->execRecord( args, getMillis() - tStart, attempts, execRes, execOut.buffer.length() + execError.length() );
+            this->execLeave();
+            
+            /* Store the last error occured */
+            if (!execError.empty())
+                this->lastExecError = execError;
+            
+            /* Retire the flight so that new callers run a fresh query */
+            {
+                boost::unique_lock<boost::mutex> lock( this->execFlightMutex );
+                this->execFlights.erase( args );
+            }
+            
+            /* Publish the results to the waiting callers */
+            flight->resolve( execRes, execOut, execError );
+            
+        } else {
+            
+            /* Wait for the leader to complete */
+            CVMWA_LOG( "Debug", "Sharing the result of in-flight '" << args << "'" );
+            execRes = flight->wait();
+            
+        }
+        
+        /* Return the shared results (indexed with the delimiter the caller expects) */
+        if (output != NULL) flight->getOutput( output );
+        if (stderrMsg != NULL) *stderrMsg = flight->stderrMsg;
+        
     } else {
     
         /* Execute */
         string execError;
-        execRes = sysExec( this->hvBinary, args, stdoutList, &execError, retries, timeout );
+        int attempts;
+        this->execEnter();
+        long tStart = getMillis();
+        execRes = sysExecParsed( this->hvBinary, args, output, &execError, retries, timeout, &attempts );
+        this->execRecord( args, getMillis() - tStart, attempts, execRes, ((output != NULL) ? output->buffer.length() : 0) + execError.length() );
+        this->execLeave();
         if (stderrMsg != NULL) *stderrMsg = execError;
 
         /* Store the last error occured */
@@ -352,13 +503,315 @@ int Hypervisor::exec( string args, vector<string> * stdoutList, string * stderrM
     CRASH_REPORT_END;
 }
 
+/**
+ * Run the given hypervisor command on a worker thread, returning
+ * a future with its results. If lockName is specified, the respective
+ * named mutex is locked (shared for queries) while the command runs.
+ */
+HVExecFuturePtr Hypervisor::execAsync( std::string args, std::string lockName, int retries, int timeout ) {
+    CRASH_REPORT_BEGIN;
+    HVEXEC_JOB job;
+    job.args = args;
+    job.lock = lockName;
+    job.retries = (retries < 0) ? 0 : retries;
+    job.timeout = timeout;
+    job.priority = getExecPriority();
+    job.future = boost::make_shared< HVExecFuture >();
+    
+    /* Schedule job, starting the workers if needed */
+    boost::unique_lock<boost::mutex> lock( this->execJobsMutex );
+    while (this->execWorkersCount < HV_EXEC_WORKERS) {
+        this->execWorkers.create_thread( boost::bind( &Hypervisor::execWorker, this ) );
+        this->execWorkersCount++;
+    }
+    this->execJobs.push_back( job );
+    this->execJobsCond.notify_one();
+    return job.future;
+    
+    CRASH_REPORT_END;
+}
+
+/**
+ * Worker thread serving the execAsync() requests
+ */
+void Hypervisor::execWorker() {
+    CRASH_REPORT_BEGIN;
+    for (;;) {
+        
+        /* Wait for a job */
+        HVEXEC_JOB job;
+        {
+            boost::unique_lock<boost::mutex> lock( this->execJobsMutex );
+            while (this->execJobs.empty() && !this->execWorkersStop)
+                this->execJobsCond.wait( lock );
+            if (this->execWorkersStop) return;
+            job = this->execJobs.front();
+            this->execJobs.pop_front();
+        }
+        
+        /* Run it with the priority of the thread that requested it */
+        int ans;
+        OutputParser output;
+        string err;
+        setExecPriority( job.priority );
+        if (job.lock.empty()) {
+            ans = this->execParsed( job.args, &output, &err, job.retries, job.timeout );
+        } else {
+            NAMED_MUTEX_LOCK_MODE( job.lock, hypervisorReadOnly(job.args) ? NMUTEX_SHARED : NMUTEX_MUTATION );
+            ans = this->execParsed( job.args, &output, &err, job.retries, job.timeout );
+            NAMED_MUTEX_UNLOCK;
+        }
+        
+        /* Resolve future */
+        job.future->resolve( ans, output, err );
+        
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait for the command to complete and return its exit code
+ */
+int HVExecFuture::wait( std::vector<std::string> * stdoutList, std::string * stderrMsg ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->mutex );
+    while (!this->done) this->cond.wait( lock );
+    if (stdoutList != NULL) this->output.getLines( stdoutList );
+    if (stderrMsg != NULL) *stderrMsg = this->stderrMsg;
+    return this->result;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Copy the output of the completed command to the given parser,
+ * re-indexing it if the parser uses a different delimiter
+ */
+void HVExecFuture::getOutput( OutputParser * output ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->mutex );
+    OutputParser ans = this->output;
+    ans.setDelimiter( output->getDelimiter() );
+    *output = ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the command has completed
+ */
+bool HVExecFuture::ready() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->mutex );
+    return this->done;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Store the results of the command and wake up the waiting threads
+ */
+void HVExecFuture::resolve( int result, const OutputParser & output, const std::string & stderrMsg ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock( this->mutex );
+        this->result = result;
+        this->output = output;
+        this->stderrMsg = stderrMsg;
+        this->done = true;
+    }
+    this->cond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return how many executions were saved by sharing in-flight queries,
+ * grouped by command
+ */
+void Hypervisor::getCoalescingStats( std::map<std::string, long> * hits ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->execFlightMutex );
+    *hits = this->execFlightHits;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Priority class of the commands issued by each thread
+ */
+boost::thread_specific_ptr<int> execPriority;
+
+/**
+ * Return the priority class of the commands issued by the current thread
+ */
+int getExecPriority() {
+    CRASH_REPORT_BEGIN;
+    if (execPriority.get() == NULL) return HVP_INTERACTIVE;
+    return *execPriority;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the priority class of the commands issued by the current thread
+ */
+void setExecPriority( int priority ) {
+    CRASH_REPORT_BEGIN;
+    if (priority < 0) priority = 0;
+    if (priority >= HVP_CLASSES) priority = HVP_CLASSES - 1;
+    execPriority.reset( new int(priority) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Switch to the given priority class until the end of the scope
+ */
+HVExecPriority::HVExecPriority( int priority ) {
+    this->previous = getExecPriority();
+    setExecPriority( priority );
+}
+HVExecPriority::~HVExecPriority() {
+    setExecPriority( this->previous );
+}
+
+/**
+ * Wait for an execution slot. The commands with the highest
+ * priority class go first, in the order they arrived.
+ */
+void Hypervisor::execEnter() {
+    CRASH_REPORT_BEGIN;
+    int priority = getExecPriority();
+    long tStart = getMillis();
+    boost::unique_lock<boost::mutex> lock( this->execQueueMutex );
+    
+    /* Get in line */
+    std::pair<int, long> ticket( priority, this->execQueueSeq++ );
+    this->execQueue.insert( ticket );
+    int depth = ++this->execQueueStats.depth[priority];
+    if (depth > this->execQueueStats.maxDepth[priority])
+        this->execQueueStats.maxDepth[priority] = depth;
+    
+    /* Wait for our turn */
+    while ((this->execQueueStats.running >= this->execConcurrency) || (*this->execQueue.begin() != ticket))
+        this->execQueueCond.wait( lock );
+    
+    /* Take the slot */
+    this->execQueue.erase( ticket );
+    this->execQueueStats.depth[priority]--;
+    this->execQueueStats.running++;
+    this->execQueueStats.executed[priority]++;
+    long tWait = getMillis() - tStart;
+    this->execQueueStats.waitTime[priority] += tWait;
+    if (tWait > this->execQueueStats.maxWaitTime[priority])
+        this->execQueueStats.maxWaitTime[priority] = tWait;
+    
+    /* The next in line might be able to run too */
+    this->execQueueCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the execution slot
+ */
+void Hypervisor::execLeave() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->execQueueMutex );
+    this->execQueueStats.running--;
+    this->execQueueCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the command queue metrics, and the time spent waiting for the named locks
+ */
+void Hypervisor::getQueueStats( HVINFO_QUEUE * stats ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock( this->execQueueMutex );
+        *stats = this->execQueueStats;
+    }
+    getNamedMutexStats( &stats->locks, &stats->lockWaitTime, &stats->spacingWaitTime );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Update the telemetry of the given command after it was executed
+ */
+void Hypervisor::execRecord( const std::string & args, long time, int attempts, int result, long bytes ) {
+    CRASH_REPORT_BEGIN;
+    string cmd = hypervisorCommand( args );
+    
+    /* Find the latency bucket */
+    int bucket = 0;
+    while ((bucket < HV_EXEC_BUCKETS - 1) && (time >= execBucketLimits[bucket]))
+        bucket++;
+    
+    boost::unique_lock<boost::mutex> lock( this->execStatsMutex );
+    std::map< std::string, HVINFO_EXEC >::iterator it = this->execStats.find( cmd );
+    if (it == this->execStats.end()) {
+        HVINFO_EXEC empty;
+        memset( &empty, 0, sizeof(HVINFO_EXEC) );
+        it = this->execStats.insert( std::make_pair( cmd, empty ) ).first;
+    }
+    HVINFO_EXEC * stats = &(*it).second;
+    
+    stats->calls++;
+    if (result != 0) stats->failures++;
+    if (attempts > 1) stats->retries += attempts - 1;
+    if (result == 255) stats->timeouts++;
+    stats->bytes += bytes;
+    stats->totalTime += time;
+    if (time > stats->maxTime) stats->maxTime = time;
+    stats->latency[bucket]++;
+    
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the execution telemetry, grouped by command, including how many
+ * executions were saved by sharing in-flight queries
+ */
+void Hypervisor::getExecStats( std::map<std::string, HVINFO_EXEC> * stats ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock( this->execStatsMutex );
+        *stats = this->execStats;
+    }
+    std::map<std::string, long> hits;
+    this->getCoalescingStats( &hits );
+    for (std::map<std::string, long>::iterator it = hits.begin(); it != hits.end(); ++it) {
+        std::map< std::string, HVINFO_EXEC >::iterator cmd = stats->find( (*it).first );
+        if (cmd == stats->end()) {
+            HVINFO_EXEC empty;
+            memset( &empty, 0, sizeof(HVINFO_EXEC) );
+            cmd = stats->insert( std::make_pair( (*it).first, empty ) ).first;
+        }
+        (*cmd).second.coalesced = (*it).second;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the maximum number of hypervisor commands running at the same time
+ */
+void Hypervisor::setExecConcurrency( int concurrency ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->execQueueMutex );
+    this->execConcurrency = (concurrency < 1) ? 1 : concurrency;
+    this->execQueueCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the number of pre-created VMs the hypervisor keeps ready for each
+ * session configuration in use. Hypervisors without a VM pool ignore it.
+ */
+void Hypervisor::setPoolSize( int size ) {
+    CRASH_REPORT_BEGIN;
+    this->poolSize = (size < 0) ? 0 : size;
+    CRASH_REPORT_END;
+}
+
 /**
  * Initialize hypervisor 
  */
 Hypervisor::Hypervisor() {
     CRASH_REPORT_BEGIN;
-    this->sessionID = 1;
-    
     /* Pick a system folder to store persistent information  */
     this->dirData = getAppDataPath();
     this->dirDataCache = this->dirData + "/cache";
@@ -370,10 +823,38 @@ Hypervisor::Hypervisor() {
     this->verMajor = 0;
     this->verMinor = 0;
     this->type = 0;
+    this->poolSize = 0;
+    
+    /* Reset command queue and workers */
+    this->execWorkersCount = 0;
+    this->execWorkersStop = false;
+    this->execQueueSeq = 0;
+    this->execConcurrency = HV_EXEC_CONCURRENCY;
+    memset( &this->execQueueStats, 0, sizeof(HVINFO_QUEUE) );
 
     CRASH_REPORT_END;
 };
 
+/**
+ * Stop the asynchronous execution workers
+ */
+Hypervisor::~Hypervisor() {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock( this->execJobsMutex );
+        this->execWorkersStop = true;
+        this->execJobsCond.notify_all();
+    }
+    this->execWorkers.join_all();
+    
+    /* Abort the jobs that never run */
+    OutputParser noOutput;
+    for (std::deque< HVEXEC_JOB >::iterator it = this->execJobs.begin(); it != this->execJobs.end(); ++it)
+        (*it).future->resolve( 255, noOutput, "ERROR: Aborted" );
+    this->execJobs.clear();
+    CRASH_REPORT_END;
+}
+
 /**
  * Exec version and parse version
  */
@@ -444,17 +925,13 @@ int Hypervisor::freeSession ( HVSession * session ) {
  */
 int Hypervisor::sessionValidate ( std::string name, std::string key ) {
     CRASH_REPORT_BEGIN;
-    for (vector<HVSession*>::iterator i = this->sessions.begin(); i != this->sessions.end(); i++) {
-        HVSession* sess = *i;
-        if (sess->name.compare(name) == 0) {
-            if (sess->key.compare(key) == 0) { /* Check secret key */
-                return 1;
-            } else {
-                return 2;
-            }
-        }
+    HVSession* sess = this->sessions.getByName( name );
+    if (sess == NULL) return 0;
+    if (sess->key.compare(key) == 0) { /* Check secret key */
+        return 1;
+    } else {
+        return 2;
     }
-    return 0;
     CRASH_REPORT_END;
 }
 
@@ -463,18 +940,7 @@ int Hypervisor::sessionValidate ( std::string name, std::string key ) {
  */
 HVSession * Hypervisor::sessionLocate( std::string uuid ) {
     CRASH_REPORT_BEGIN;
-    
-    /* Check for running sessions with the given uuid */
-    for (vector<HVSession*>::iterator i = this->sessions.begin(); i != this->sessions.end(); i++) {
-        HVSession* sess = *i;
-        if (sess->uuid.compare(uuid) == 0) {
-            return sess;
-        }
-    }
-    
-    /* Not found */
-    return NULL;
-    
+    return this->sessions.getByUUID( uuid );
     CRASH_REPORT_END;
 }
 
@@ -486,23 +952,25 @@ HVSession * Hypervisor::sessionOpen( const std::string & name, const std::string
     
     /* Check for running sessions with the given credentials */
     CVMWA_LOG( "Info", "Checking sessions (" << this->sessions.size() << ")");
-    for (vector<HVSession*>::iterator i = this->sessions.begin(); i != this->sessions.end(); i++) {
-        HVSession* sess = *i;
-        CVMWA_LOG( "Info", "Checking session name=" << sess->name << ", key=" << sess->key << ", uuid=" << sess->uuid << ", state=" << sess->state  );
-        
-        if (sess->name.compare(name) == 0) {
-            if (sess->key.compare(key) == 0) { /* Check secret key */
-                return sess;
-            } else {
-                return NULL;
-            }
+    HVSession* sess = this->sessions.getByName( name );
+    if (sess == NULL) {
+    
+        /* Allocate and register a new session (unless another thread registered
+           one with the same name meanwhile) */
+        HVSession* newSess = this->allocateSession( name, key );
+        if (newSess == NULL) return NULL;
+        sess = this->sessions.addUnique( newSess );
+        if (sess != newSess) {
+            this->freeSession( newSess );
+        } else {
+            CVMWA_LOG( "Info", "Updated sessions (" << this->sessions.size() << ")" );
         }
+        
     }
+    CVMWA_LOG( "Info", "Checking session name=" << sess->name << ", key=" << sess->key << ", uuid=" << sess->uuid << ", state=" << sess->state  );
     
-    /* Allocate and register a new session */
-    HVSession* sess = this->allocateSession( name, key );
-    if (sess == NULL) return NULL;
-    this->registerSession( sess );
+    /* Check secret key */
+    if (sess->key.compare(key) != 0) return NULL;
     
     /* Return the handler */
     return sess;
@@ -515,9 +983,8 @@ HVSession * Hypervisor::sessionOpen( const std::string & name, const std::string
  */
 int Hypervisor::registerSession( HVSession * sess ) {
     CRASH_REPORT_BEGIN;
-    sess->internalID = this->sessionID++;
-    this->sessions.push_back(sess);
-    CVMWA_LOG( "Info", "Updated sessions (" << this->sessions.size()  );
+    this->sessions.add( sess );
+    CVMWA_LOG( "Info", "Updated sessions (" << this->sessions.size() << ")" );
     return HVE_OK;
     CRASH_REPORT_END;
 }
@@ -527,15 +994,10 @@ int Hypervisor::registerSession( HVSession * sess ) {
  */
 int Hypervisor::sessionFree( int id ) {
     CRASH_REPORT_BEGIN;
-    for (vector<HVSession*>::iterator i = this->sessions.begin(); i != this->sessions.end(); i++) {
-        HVSession* sess = *i;
-        if (sess->internalID == id) {
-            this->sessions.erase(i);
-            delete sess;
-            return HVE_OK;
-        }
-    }
-    return HVE_NOT_FOUND;
+    HVSession* sess = this->sessions.remove( id );
+    if (sess == NULL) return HVE_NOT_FOUND;
+    delete sess;
+    return HVE_OK;
     CRASH_REPORT_END;
 }
 
@@ -544,11 +1006,245 @@ int Hypervisor::sessionFree( int id ) {
  */
 HVSession * Hypervisor::sessionGet( int id ) {
     CRASH_REPORT_BEGIN;
-    for (vector<HVSession*>::iterator i = this->sessions.begin(); i != this->sessions.end(); i++) {
-        HVSession* sess = *i;
-        if (sess->internalID == id) return sess;
+    return this->sessions.getByID( id );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Index a session, allocating a new ID unless keepID is true (the caller must hold the exclusive lock)
+ */
+void HVSessionRegistry::insert( HVSession * sess, bool keepID ) {
+    CRASH_REPORT_BEGIN;
+    if (!keepID) sess->internalID = this->nextID++;
+    this->sessions.push_back( sess );
+    this->idIndex[ sess->internalID ] = sess;
+    this->nameIndex[ sess->name ] = sess;
+    if (!sess->uuid.empty()) this->uuidIndex[ sess->uuid ] = sess;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Register a session and allocate a new unique ID for it
+ */
+int HVSessionRegistry::add( HVSession * sess ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::shared_mutex> lock( this->mutex );
+    this->insert( sess );
+    return sess->internalID;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Register a session, unless there is already one with the same name.
+ * Returns the registered session.
+ */
+HVSession * HVSessionRegistry::addUnique( HVSession * sess ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::shared_mutex> lock( this->mutex );
+    boost::unordered_map< string, HVSession* >::iterator it = this->nameIndex.find( sess->name );
+    if (it != this->nameIndex.end()) return (*it).second;
+    this->insert( sess );
+    return sess;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Unregister the session with the given ID. Returns the session or NULL if not found.
+ */
+HVSession * HVSessionRegistry::remove( int id ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::shared_mutex> lock( this->mutex );
+    boost::unordered_map< int, HVSession* >::iterator it = this->idIndex.find( id );
+    if (it == this->idIndex.end()) return NULL;
+    HVSession * sess = (*it).second;
+    
+    /* Drop it from the indices */
+    this->idIndex.erase( it );
+    boost::unordered_map< string, HVSession* >::iterator jt = this->nameIndex.find( sess->name );
+    if ((jt != this->nameIndex.end()) && ((*jt).second == sess)) this->nameIndex.erase( jt );
+    jt = this->uuidIndex.find( sess->uuid );
+    if ((jt != this->uuidIndex.end()) && ((*jt).second == sess)) this->uuidIndex.erase( jt );
+    this->sessions.erase( std::find( this->sessions.begin(), this->sessions.end(), sess ) );
+    
+    return sess;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Replace all the registered sessions with the given ones, in one go. The sessions
+ * that were already registered keep their ID. If dropped is not NULL, it receives
+ * the previously registered sessions that are not in the given ones.
+ */
+void HVSessionRegistry::replace( const std::vector<HVSession*> & sessions, std::vector<HVSession*> * dropped ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::shared_mutex> lock( this->mutex );
+    boost::unordered_map< int, HVSession* > previous;
+    previous.swap( this->idIndex );
+    this->sessions.clear();
+    this->nameIndex.clear();
+    this->uuidIndex.clear();
+    for (vector<HVSession*>::const_iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        boost::unordered_map< int, HVSession* >::iterator prev = previous.find( (*it)->internalID );
+        bool keepID = (prev != previous.end()) && ((*prev).second == *it);
+        if (keepID) previous.erase( prev );
+        this->insert( *it, keepID );
     }
-    return NULL;
+    if (dropped != NULL) {
+        dropped->clear();
+        for (boost::unordered_map< int, HVSession* >::iterator it = previous.begin(); it != previous.end(); ++it)
+            dropped->push_back( (*it).second );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Update the UUID index after the UUID of the session has changed
+ */
+void HVSessionRegistry::reindex( HVSession * sess ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::shared_mutex> lock( this->mutex );
+    if (this->idIndex.find( sess->internalID ) == this->idIndex.end()) return;
+    for (boost::unordered_map< string, HVSession* >::iterator it = this->uuidIndex.begin(); it != this->uuidIndex.end(); ) {
+        if ((*it).second == sess) {
+            it = this->uuidIndex.erase( it );
+        } else {
+            ++it;
+        }
+    }
+    if (!sess->uuid.empty()) this->uuidIndex[ sess->uuid ] = sess;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the session with the given ID or NULL if not found
+ */
+HVSession * HVSessionRegistry::getByID( int id ) {
+    CRASH_REPORT_BEGIN;
+    boost::shared_lock<boost::shared_mutex> lock( this->mutex );
+    boost::unordered_map< int, HVSession* >::iterator it = this->idIndex.find( id );
+    if (it == this->idIndex.end()) return NULL;
+    return (*it).second;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the session with the given name or NULL if not found
+ */
+HVSession * HVSessionRegistry::getByName( const std::string & name ) {
+    CRASH_REPORT_BEGIN;
+    boost::shared_lock<boost::shared_mutex> lock( this->mutex );
+    boost::unordered_map< string, HVSession* >::iterator it = this->nameIndex.find( name );
+    if (it == this->nameIndex.end()) return NULL;
+    return (*it).second;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the session with the given UUID or NULL if not found
+ */
+HVSession * HVSessionRegistry::getByUUID( const std::string & uuid ) {
+    CRASH_REPORT_BEGIN;
+    boost::shared_lock<boost::shared_mutex> lock( this->mutex );
+    boost::unordered_map< string, HVSession* >::iterator it = this->uuidIndex.find( uuid );
+    if (it == this->uuidIndex.end()) return NULL;
+    return (*it).second;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a snapshot of the registered sessions (in registration order)
+ */
+std::vector<HVSession*> HVSessionRegistry::list( ) {
+    CRASH_REPORT_BEGIN;
+    boost::shared_lock<boost::shared_mutex> lock( this->mutex );
+    return this->sessions;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the number of registered sessions
+ */
+size_t HVSessionRegistry::size( ) {
+    CRASH_REPORT_BEGIN;
+    boost::shared_lock<boost::shared_mutex> lock( this->mutex );
+    return this->sessions.size();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Store a sample, replacing the oldest one when the buffer is full
+ */
+void HVMetricsBuffer::push( const HVINFO_METRIC & sample ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock( this->mutex );
+    this->buffer[this->head] = sample;
+    this->head = (this->head + 1) % HV_METRICS_SAMPLES;
+    if (this->count < HV_METRICS_SAMPLES) this->count++;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get the most recent sample. Returns false if there are no samples.
+ */
+bool HVMetricsBuffer::latest( HVINFO_METRIC * sample ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock( this->mutex );
+    if (this->count == 0) return false;
+    *sample = this->buffer[(this->head + HV_METRICS_SAMPLES - 1) % HV_METRICS_SAMPLES];
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Average the samples of the last 'window' milliseconds (counting from the most recent
+ * sample). The timestamp of the result is the one of the most recent sample.
+ * Returns false if there are no samples.
+ */
+bool HVMetricsBuffer::average( long window, HVINFO_METRIC * sample ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock( this->mutex );
+    if (this->count == 0) return false;
+    
+    size_t last = (this->head + HV_METRICS_SAMPLES - 1) % HV_METRICS_SAMPLES;
+    long since = this->buffer[last].timestamp - window;
+    double cpuUser = 0, cpuKernel = 0, ramUsed = 0;
+    size_t n = 0;
+    for (; n < this->count; n++) {
+        HVINFO_METRIC * s = &this->buffer[(last + HV_METRICS_SAMPLES - n) % HV_METRICS_SAMPLES];
+        if ((n > 0) && (s->timestamp < since)) break;
+        cpuUser += s->cpuUser;
+        cpuKernel += s->cpuKernel;
+        ramUsed += s->ramUsed;
+    }
+    
+    sample->timestamp = this->buffer[last].timestamp;
+    sample->cpuUser = (float)(cpuUser / n);
+    sample->cpuKernel = (float)(cpuKernel / n);
+    sample->ramUsed = (long)(ramUsed / n);
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get a copy of all the samples, oldest first
+ */
+void HVMetricsBuffer::samples( std::vector<HVINFO_METRIC> * samples ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock( this->mutex );
+    samples->clear();
+    for (size_t i = 0; i < this->count; i++)
+        samples->push_back( this->buffer[(this->head + HV_METRICS_SAMPLES - this->count + i) % HV_METRICS_SAMPLES] );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Drop all the samples
+ */
+void HVMetricsBuffer::clear( ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock( this->mutex );
+    this->head = 0;
+    this->count = 0;
     CRASH_REPORT_END;
 }
 
@@ -566,7 +1262,8 @@ int Hypervisor::checkDaemonNeed() {
     
     // Check if at least one session uses daemon
     bool daemonNeeded = false;
-    for (vector<HVSession*>::iterator i = this->sessions.begin(); i != this->sessions.end(); i++) {
+    vector<HVSession*> sessions = this->sessions.list();
+    for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
         HVSession* sess = *i;
         CVMWA_LOG( "Info", "Session " << sess->uuid << ", daemonControlled=" << sess->daemonControlled << ", state=" << sess->state );
         if ( sess->daemonControlled && ((sess->state == STATE_OPEN) || (sess->state == STATE_STARTED) || (sess->state == STATE_PAUSED)) ) {
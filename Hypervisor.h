@@ -21,6 +21,10 @@
 #ifndef HVENV_H
 #define HVENV_H
 
+#include <set>
+#include <deque>
+#include <boost/unordered_map.hpp>
+
 #include "DownloadProvider.h"
 #include "Utilities.h"
 #include "CrashReport.h"
@@ -71,10 +75,63 @@
 #define HVF_GRAPHICAL          32       // Enable graphical extension (like drag-n-drop)
 #define HVF_DUAL_NIC           64       // Use secondary adapter instead of creating a NAT rule on the first one
 
+/* Hypervisor command priority classes (lower runs first) */
+#define HVP_INTERACTIVE         0       // Requested by the user through the JS API
+#define HVP_LIFECYCLE           1       // VM lifecycle management (ex. by the daemon)
+#define HVP_BACKGROUND          2       // Periodic status polling
+#define HVP_CLASSES             3
+
+/* Default maximum number of hypervisor commands running at the same time */
+#define HV_EXEC_CONCURRENCY     4
+
+/* Number of worker threads serving execAsync() */
+#define HV_EXEC_WORKERS         4
+
+/* Number of latency buckets in the command telemetry (see hypervisorLatencyLimit) */
+#define HV_EXEC_BUCKETS         12
+
+/* Number of resource usage samples kept per session (see HVMetricsBuffer) */
+#define HV_METRICS_SAMPLES      60
+
+/* Default number of pre-created VMs kept for each common session configuration (0 disables the pool, see setPoolSize) */
+#define HV_POOL_SIZE            0
+
 /* Default CernVM Version */
 #define DEFAULT_CERNVM_VERSION  "1.13-12"
 #define DEFAULT_API_PORT        80
 
+/**
+ * Resource usage sample of a VM (or of the host)
+ */
+typedef struct {
+    
+    long        timestamp;  // When the sample was collected (getMillis)
+    float       cpuUser;    // Processor time spent in user mode (% of the host CPU)
+    float       cpuKernel;  // Processor time spent in kernel mode (% of the host CPU)
+    long        ramUsed;    // Used memory (KBytes)
+    
+} HVINFO_METRIC;
+
+/**
+ * Thread-safe ring buffer of the last HV_METRICS_SAMPLES resource usage samples
+ */
+class HVMetricsBuffer {
+public:
+    HVMetricsBuffer() : head(0), count(0) { };
+    
+    void                        push        ( const HVINFO_METRIC & sample );
+    bool                        latest      ( HVINFO_METRIC * sample );
+    bool                        average     ( long window, HVINFO_METRIC * sample );
+    void                        samples     ( std::vector<HVINFO_METRIC> * samples );
+    void                        clear       ( );
+    
+private:
+    boost::mutex                mutex;
+    HVINFO_METRIC               buffer[HV_METRICS_SAMPLES];
+    size_t                      head;       // Where the next sample goes
+    size_t                      count;
+};
+
 /**
  * A hypervisor session is actually a VM instance.
  * This is where the actual I/O happens
@@ -82,7 +139,7 @@
 class HVSession {
 public:
     
-    HVSession() : onDebug(), onOpen(), onStart(), onStop(), onClose(), onError(), onProgress() {
+    HVSession() : onDebug(), onOpen(), onStart(), onStop(), onClose(), onError(), onProgress(), onChange(), onProperty() {
         
         this->cpus = 1;
         this->memory = 256;
@@ -109,6 +166,8 @@ public:
         
     };
     
+    virtual ~HVSession() { };
+    
     std::string             uuid;
     std::string             ip;
     std::string             key;
@@ -135,6 +194,8 @@ public:
     int                     daemonFlags;
 
     int                     internalID;
+    
+    HVMetricsBuffer         metrics;        // Resource usage samples, collected by Hypervisor::updateMetrics()
         
     virtual int             pause();
     virtual int             close( bool unmonitored = false );
@@ -164,6 +225,8 @@ public:
     callbackVoid            onClose;
     callbackError           onError;
     callbackProgress        onProgress;
+    callbackList            onChange;       // Fired with the names of the fields an update changed
+    callbackProperty        onProperty;     // Fired with the name and the new value of a changed guest property
 
 };
 
@@ -207,11 +270,126 @@ typedef struct {
 typedef struct {
     
     HVINFO_RES          max;        // Maximum available resources
+    HVINFO_RES          host;       // Physical resources of the host (0 if unknown)
     HVINFO_CPUID        cpu;        // CPU information
     bool                isReady;    // Current configuration allows VMs to start without problems
     
 } HVINFO_CAPS;
 
+/**
+ * Command queue metrics
+ */
+typedef struct {
+    
+    int         running;                    // Commands currently running
+    int         depth[HVP_CLASSES];         // Commands currently waiting, per priority class
+    int         maxDepth[HVP_CLASSES];      // Maximum number of commands ever waiting
+    long        executed[HVP_CLASSES];      // Commands executed
+    long        waitTime[HVP_CLASSES];      // Total time (ms) spent waiting in the queue
+    long        maxWaitTime[HVP_CLASSES];   // Maximum time (ms) a command waited in the queue
+    long        locks;                      // Named locks acquired (by the whole process)
+    long        lockWaitTime;               // Total time (ms) spent waiting for a named lock
+    long        spacingWaitTime;            // Total time (ms) spent waiting for the mutation spacing
+    
+} HVINFO_QUEUE;
+
+/**
+ * Execution telemetry of a hypervisor command
+ */
+typedef struct {
+    
+    long        calls;                      // Times the command was executed
+    long        failures;                   // Executions with non-zero exit code
+    long        retries;                    // Additional attempts made after a failure
+    long        timeouts;                   // Executions that timed out or were aborted
+    long        bytes;                      // Total output (stdout & stderr) in bytes
+    long        totalTime;                  // Total time (ms) spent executing
+    long        maxTime;                    // Maximum time (ms) an execution took
+    long        latency[HV_EXEC_BUCKETS];   // Latency histogram
+    long        coalesced;                  // Executions saved by joining an identical in-flight query
+    
+} HVINFO_EXEC;
+
+/**
+ * Scoped priority class of the hypervisor commands issued by the current thread
+ */
+class HVExecPriority {
+public:
+    HVExecPriority( int priority );
+    ~HVExecPriority();
+private:
+    int                         previous;
+};
+
+/**
+ * The (future) result of a hypervisor command. Used by execAsync() and for
+ * sharing the result of a read-only command in flight with identical invocations.
+ */
+class HVExecFuture {
+public:
+    HVExecFuture() : done(false), result(252) { };
+    
+    int                         wait        ( std::vector<std::string> * stdoutList = NULL, std::string * stderrMsg = NULL );
+    void                        getOutput   ( OutputParser * output );
+    bool                        ready       ( );
+    void                        resolve     ( int result, const OutputParser & output, const std::string & stderrMsg );
+    
+    bool                        done;
+    int                         result;
+    OutputParser                output;
+    std::string                 stderrMsg;
+    
+    boost::mutex                mutex;
+    boost::condition_variable   cond;
+};
+typedef boost::shared_ptr< HVExecFuture >   HVExecFuturePtr;
+
+/**
+ * A command waiting for an execAsync() worker
+ */
+typedef struct {
+    
+    std::string         args;       // The command-line arguments
+    std::string         lock;       // The named mutex to lock while running (if any)
+    int                 retries;
+    int                 timeout;
+    int                 priority;   // The priority class of the thread that issued it
+    HVExecFuturePtr     future;
+    
+} HVEXEC_JOB;
+
+/**
+ * Thread-safe registry of the hypervisor sessions, indexed by internal ID, name and UUID.
+ * Lookups take a shared lock, while registrations take an exclusive one. The sessions
+ * are referred to by pointers that remain valid until they are explicitly freed.
+ */
+class HVSessionRegistry {
+public:
+    HVSessionRegistry() : nextID(1) { };
+    
+    int                         add         ( HVSession * sess );
+    HVSession *                 addUnique   ( HVSession * sess );
+    HVSession *                 remove      ( int id );
+    void                        replace     ( const std::vector<HVSession*> & sessions, std::vector<HVSession*> * dropped = NULL );
+    void                        reindex     ( HVSession * sess );
+    
+    HVSession *                 getByID     ( int id );
+    HVSession *                 getByName   ( const std::string & name );
+    HVSession *                 getByUUID   ( const std::string & uuid );
+    std::vector<HVSession*>     list        ( );
+    size_t                      size        ( );
+    
+private:
+    void                        insert      ( HVSession * sess, bool keepID = false );
+    
+    boost::shared_mutex                                 mutex;
+    int                                                 nextID;
+    std::vector<HVSession*>                             sessions;   // In registration order
+    boost::unordered_map< int, HVSession* >             idIndex;
+    boost::unordered_map< std::string, HVSession* >     nameIndex;
+    boost::unordered_map< std::string, HVSession* >     uuidIndex;
+};
+
 /**
  * Overloadable base hypervisor class
  */
@@ -219,6 +397,7 @@ class Hypervisor {
 public:
     
     Hypervisor();
+    virtual ~Hypervisor();
     int                     type;
     
     int                     verMajor;
@@ -230,8 +409,11 @@ public:
     std::string             dirDataCache;
     std::string             lastExecError;
         
+    /* Resource usage of the host, collected by updateMetrics() */
+    HVMetricsBuffer         hostMetrics;
+    
     /* Session management commands */
-    std::vector<HVSession*> sessions;
+    HVSessionRegistry       sessions;
     HVSession *             sessionLocate       ( std::string uuid );
     HVSession *             sessionOpen         ( const std::string & name, const std::string & key );
     HVSession *             sessionGet          ( int id );
@@ -241,15 +423,24 @@ public:
     /* Overridable functions */
     virtual int             loadSessions        ( );
     virtual int             updateSession       ( HVSession * session );
+    virtual int             updateStates        ( const std::vector<HVSession*> & sessions );
+    virtual int             updateMetrics       ( );
     virtual HVSession *     allocateSession     ( std::string name, std::string key );
     virtual int             freeSession         ( HVSession * sess );
     virtual int             registerSession     ( HVSession * sess );
     virtual int             getUsage            ( HVINFO_RES * usage);
     virtual int             getCapabilities     ( HVINFO_CAPS * caps );
     virtual bool            waitTillReady       ( std::string pluginVersion, callbackProgress progress = 0, int progressMin = 0, int progressMax = 100, int progressTotal = 100 );
+    virtual void            setPoolSize         ( int size );
     
     /* Tool functions (used internally or from session objects) */
     int                     exec                ( std::string args, std::vector<std::string> * stdoutList, std::string * stderrMsg, int retries = 2, int timeout = SYSEXEC_TIMEOUT );
+    int                     execParsed          ( std::string args, OutputParser * output, std::string * stderrMsg, int retries = 2, int timeout = SYSEXEC_TIMEOUT );
+    HVExecFuturePtr         execAsync           ( std::string args, std::string lockName = "", int retries = 2, int timeout = SYSEXEC_TIMEOUT );
+    void                    getCoalescingStats  ( std::map<std::string, long> * hits );
+    void                    getQueueStats       ( HVINFO_QUEUE * stats );
+    void                    getExecStats        ( std::map<std::string, HVINFO_EXEC> * stats );
+    void                    setExecConcurrency  ( int concurrency );
     void                    detectVersion       ( );
     int                     cernVMDownload      ( std::string version, std::string * filename, ProgressFeedback * feedback, std::string flavor = "prod", std::string arch = "x86_64" );
     int                     cernVMCached        ( std::string version, std::string * filename );
@@ -268,8 +459,39 @@ public:
     std::string             daemonBinPath;
      
 protected:
-    int                                         sessionID;
     DownloadProviderPtr                         downloadProvider;
+    
+    /* Maximum number of pre-created VMs per session configuration (0 disables the pool) */
+    int                                         poolSize;
+    
+    /* Single-flight state of the read-only commands */
+    boost::mutex                                execFlightMutex;
+    std::map< std::string, HVExecFuturePtr >    execFlights;
+    std::map< std::string, long >               execFlightHits;
+    
+    /* Priority command queue */
+    void                                        execEnter           ( );
+    void                                        execLeave           ( );
+    boost::mutex                                execQueueMutex;
+    boost::condition_variable                   execQueueCond;
+    std::set< std::pair<int, long> >            execQueue;
+    long                                        execQueueSeq;
+    int                                         execConcurrency;
+    HVINFO_QUEUE                                execQueueStats;
+    
+    /* Execution telemetry */
+    void                                        execRecord          ( const std::string & args, long time, int attempts, int result, long bytes );
+    boost::mutex                                execStatsMutex;
+    std::map< std::string, HVINFO_EXEC >        execStats;
+    
+    /* Asynchronous execution workers */
+    void                                        execWorker          ( );
+    boost::thread_group                         execWorkers;
+    int                                         execWorkersCount;
+    bool                                        execWorkersStop;
+    std::deque< HVEXEC_JOB >                    execJobs;
+    boost::mutex                                execJobsMutex;
+    boost::condition_variable                   execJobsCond;
 };
 
 /**
@@ -279,6 +501,11 @@ Hypervisor *                    detectHypervisor    ( );
 void                            freeHypervisor      ( Hypervisor * );
 int                             installHypervisor   ( std::string clientVersion, callbackProgress progress, DownloadProviderPtr downloadProvider, int retries = 4 );
 std::string                     hypervisorErrorStr  ( int error );
+std::string                     hypervisorCommand   ( const std::string & args );
+bool                            hypervisorReadOnly  ( const std::string & args );
+long                            hypervisorLatencyLimit( int bucket );
+int                             getExecPriority     ( );
+void                            setExecPriority     ( int priority );
 
 
 #endif /* end of include guard: HVENV_H */
@@ -19,6 +19,7 @@
  */
 
 #include "LocalConfig.h"
+#include <boost/filesystem.hpp>
 
 /**
  * Create platform configuration file
@@ -76,14 +77,19 @@ bool LocalConfig::saveBuffer ( std::string name, std::string * buffer ) {
 }
 /**
  * Save string map to the given config file
+ *
+ * The map is written to a temporary file which then replaces the config file,
+ * so other processes reading it never see it truncated or half-written.
  */
 bool LocalConfig::saveMap ( std::string name, std::map<std::string, std::string> * map ) {
     CRASH_REPORT_BEGIN;
     
-    // Truncate file
+    // Create a temporary file next to it
     std::string file = this->configDir + "/" + name + ".conf";
+    std::string tmpFile = getTmpFile( ".tmp", this->configDir );
+    if (tmpFile.empty()) return false;
     CVMWA_LOG("Config", "Saving" << file );
-    std::ofstream ofs ( file.c_str() , std::ofstream::out | std::ofstream::trunc);
+    std::ofstream ofs ( tmpFile.c_str() , std::ofstream::out | std::ofstream::trunc);
     if (ofs.fail()) return false;
     
     // Dump the contents
@@ -96,6 +102,19 @@ bool LocalConfig::saveMap ( std::string name, std::map<std::string, std::string>
     
     // Close
     ofs.close();
+    if (ofs.fail()) {
+        remove( tmpFile.c_str() );
+        return false;
+    }
+    
+    // Replace the config file
+    boost::system::error_code ec;
+    boost::filesystem::rename( tmpFile, file, ec );
+    if (ec) {
+        CVMWA_LOG("Config", "Unable to replace " << file << ": " << ec.message() );
+        remove( tmpFile.c_str() );
+        return false;
+    }
     return true;
     
     CRASH_REPORT_END;
@@ -135,7 +135,7 @@ long int ThinIPCMessage::readInt() {
     if (__ioPos+4 > size) return 0;
 
     // Read int
-    memset( &v, 0, 4 );
+    memset( &v, 0, sizeof(v) );
     memcpy( &v, &this->data[__ioPos], 4 );
     __ioPos += 4;
 
@@ -143,6 +143,17 @@ long int ThinIPCMessage::readInt() {
     CRASH_REPORT_END;
 };
 
+/**
+ * Read 64-bit integer from input stream (sent as two 32-bit halves, low first)
+ */
+boost::int64_t ThinIPCMessage::readLong() {
+    CRASH_REPORT_BEGIN;
+    boost::uint64_t low = (boost::uint32_t) this->readInt();
+    boost::uint64_t high = (boost::uint32_t) this->readInt();
+    return (boost::int64_t)( (high << 32) | low );
+    CRASH_REPORT_END;
+};
+
 /**
  * Read integer from input stream
  */
@@ -216,6 +227,18 @@ short ThinIPCMessage::writeInt( long int v ) {
     CRASH_REPORT_END;
 };
 
+/**
+ * Write 64-bit integer to output stream (as two 32-bit halves, low first)
+ */
+short ThinIPCMessage::writeLong( boost::int64_t v ) {
+    CRASH_REPORT_BEGIN;
+    boost::uint64_t u = (boost::uint64_t) v;
+    short len = this->writeInt( (long int)(boost::uint32_t)( u & 0xFFFFFFFFUL ) );
+    len += this->writeInt( (long int)(boost::uint32_t)( u >> 32 ) );
+    return len;
+    CRASH_REPORT_END;
+};
+
 /**
  * Write short integer to output stream
  */
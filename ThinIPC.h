@@ -23,6 +23,7 @@
 
 #include "Utilities.h"  // It also contains the common global headers
 #include "CrashReport.h"
+#include <boost/cstdint.hpp>
 
 #define MAX_MSG_SIZE    1024
 
@@ -54,10 +55,12 @@ public:
     
     /* Object I/O */
     long int                    readInt();
+    boost::int64_t              readLong();
     short int                   readShort();
     std::string                 readString();
     template <typename T> short readPtr( T * ptr );
     short                       writeInt( long int v );
+    short                       writeLong( boost::int64_t v );
     short                       writeShort( short int v );
     short                       writeString( std::string v );
     template <typename T> short writePtr( T * ptr );
@@ -31,14 +31,24 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <cerrno>
 
 #include <openssl/sha.h>
 #include <openssl/md5.h>
 #include "zlib.h"
 
+#include <boost/functional/hash.hpp>
+
 #include "Utilities.h"
 #include "Hypervisor.h"
 
+#if defined(__APPLE__) && defined(__MACH__)
+#include <crt_externs.h>
+#define environ (*_NSGetEnviron())
+#else
+extern char **environ;
+#endif
+
 using namespace std;
 
 /* Base64 Helper */
@@ -57,8 +67,26 @@ static const char reverse_table[128] = {
 /* Singleton optimization for AppData folder */
 std::string appDataDir = "";
 
-/* A list of named mutexes in this process (static) */
-std::map< std::string, sharedMutex >    namedMutexStack;
+/* A list of named mutexes in this process (static), split in
+   shards with their own lock in order to reduce the contention */
+typedef struct {
+    boost::mutex                            lock;
+    std::map< std::string, sharedMutex >    entries;
+} NAMED_MUTEX_SHARD;
+NAMED_MUTEX_SHARD                       namedMutexStack[ NAMED_MUTEX_SHARDS ];
+
+/* Named mutex spacing and instrumentation */
+int                                     namedMutexSpacing = NAMED_MUTEX_SPACING;
+boost::mutex                            namedMutexStatsLock;
+long                                    namedMutexLocks = 0;
+long                                    namedMutexLockWait = 0;
+long                                    namedMutexSpacingWait = 0;
+
+/* Local ports handed out or known to be used by our VMs (one flag
+   per port in the LOCAL_PORT_MIN-LOCAL_PORT_MAX range) */
+boost::mutex                            localPortsLock;
+std::vector<bool>                       localPortsUsed;
+int                                     localPortsNext = LOCAL_PORT_MIN;
 
 /**
  * Convert an std::string to a number
@@ -92,31 +120,180 @@ template std::string ntos<size_t>( size_t &value );
 
 
 /**
- * Alloc/get a boost::mutex with the given name
+ * Return the registry shard responsible for the given name
+ */
+NAMED_MUTEX_SHARD & __nmutex_shard( const std::string & name ) {
+    boost::hash<std::string> hasher;
+    return namedMutexStack[ hasher(name) % NAMED_MUTEX_SHARDS ];
+}
+
+/**
+ * Check if the given named mutex is not used and has no
+ * pending mutation spacing, so it can be evicted
+ */
+bool __nmutex_idle( const sharedMutex & m ) {
+    return (m->refs == 0) && ((getMillis() - m->lastMutation) >= namedMutexSpacing);
+}
+
+/**
+ * Alloc/get a boost::mutex with the given name and take a reference to it
  */
 sharedMutex __nmutex_get( std::string name ) {
+    NAMED_MUTEX_SHARD & shard = __nmutex_shard( name );
+    boost::unique_lock<boost::mutex> lock( shard.lock );
     
     // If we don't have a mutex under this name, allocate it now
-    if (namedMutexStack.find(name) == namedMutexStack.end()) {
-        sharedMutex m = boost::make_shared<boost::mutex>();
-        namedMutexStack[name] = m;
+    std::map< std::string, sharedMutex >::iterator it = shard.entries.find(name);
+    if (it == shard.entries.end()) {
+        
+        // Reclaim the idle entries of this shard (like the ones
+        // left behind by the mutations that were spaced)
+        for (it = shard.entries.begin(); it != shard.entries.end(); ) {
+            if (__nmutex_idle( (*it).second )) {
+                shard.entries.erase( it++ );
+            } else {
+                ++it;
+            }
+        }
+        
+        sharedMutex m = boost::make_shared<NamedMutex>();
+        m->name = name;
+        m->refs = 1;
+        shard.entries[name] = m;
         return m;
     } 
     
     // Otherwise return the existing pointer
     else {
-        return namedMutexStack[name];
+        (*it).second->refs++;
+        return (*it).second;
     }
 
 }
 
+/**
+ * Release a reference to the named mutex, evicting it if it's no longer used
+ */
+void __nmutex_release( sharedMutex m ) {
+    NAMED_MUTEX_SHARD & shard = __nmutex_shard( m->name );
+    boost::unique_lock<boost::mutex> lock( shard.lock );
+    m->refs--;
+    
+    // Remove it from the registry, unless it was flushed
+    // or replaced in the meantime
+    if (__nmutex_idle( m )) {
+        std::map< std::string, sharedMutex >::iterator it = shard.entries.find( m->name );
+        if ((it != shard.entries.end()) && ((*it).second == m))
+            shard.entries.erase( it );
+    }
+}
+
+/**
+ * Acquire the named mutex, waiting for the mutation spacing if requested
+ */
+NamedMutexLock::NamedMutexLock( const std::string & name, int mode ) : entry( __nmutex_get(name) ), mode( mode ) {
+    CRASH_REPORT_BEGIN;
+    long tStart = getMillis(), tSpacing = 0, tDelay;
+    
+    /* Wait for the lock */
+    this->acquire();
+    
+    /* Mutations must be spaced. Don't keep the lock while sleeping,
+       so the queries on the same resource can proceed meanwhile. */
+    if (mode == NMUTEX_MUTATION) {
+        while ((tDelay = entry->lastMutation + namedMutexSpacing - getMillis()) > 0) {
+            this->release();
+            sleepMs( tDelay );
+            tSpacing += tDelay;
+            this->acquire();
+        }
+    }
+    
+    /* Update instrumentation */
+    boost::unique_lock<boost::mutex> statsLock( namedMutexStatsLock );
+    namedMutexLocks++;
+    namedMutexLockWait += getMillis() - tStart - tSpacing;
+    namedMutexSpacingWait += tSpacing;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the named mutex, marking the time of the mutation
+ */
+NamedMutexLock::~NamedMutexLock() {
+    if (mode == NMUTEX_MUTATION) entry->lastMutation = getMillis();
+    this->release();
+    __nmutex_release( entry );
+}
+
+/**
+ * Lock the mutex in the requested mode
+ */
+void NamedMutexLock::acquire() {
+    if (mode == NMUTEX_SHARED) {
+        entry->mutex.lock_shared();
+    } else {
+        entry->mutex.lock();
+    }
+}
+
+/**
+ * Unlock the mutex in the requested mode
+ */
+void NamedMutexLock::release() {
+    if (mode == NMUTEX_SHARED) {
+        entry->mutex.unlock_shared();
+    } else {
+        entry->mutex.unlock();
+    }
+}
+
+/**
+ * Change the minimum delay between mutating commands on the same resource
+ */
+void setNamedMutexSpacing( int spacing ) {
+    CRASH_REPORT_BEGIN;
+    CVMWA_LOG("Debug", "Setting named mutex spacing to " << spacing << "ms");
+    namedMutexSpacing = spacing;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get the named mutex instrumentation counters
+ */
+void getNamedMutexStats( long * locks, long * lockWait, long * spacingWait ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> statsLock( namedMutexStatsLock );
+    *locks = namedMutexLocks;
+    *lockWait = namedMutexLockWait;
+    *spacingWait = namedMutexSpacingWait;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get the number of named mutexes currently kept in the registry
+ */
+size_t getNamedMutexCount() {
+    CRASH_REPORT_BEGIN;
+    size_t count = 0;
+    for (int i=0; i<NAMED_MUTEX_SHARDS; i++) {
+        boost::unique_lock<boost::mutex> lock( namedMutexStack[i].lock );
+        count += namedMutexStack[i].entries.size();
+    }
+    return count;
+    CRASH_REPORT_END;
+}
+
 /**
  * Release memory from the named mutexes already acquired
  */
 void flushNamedMutexes() {
 
-    // Clear map (objects are shared_ptrs, so they are disposed now)
-    namedMutexStack.clear();
+    // Clear maps (objects are shared_ptrs, so the ones not in use are disposed now)
+    for (int i=0; i<NAMED_MUTEX_SHARDS; i++) {
+        boost::unique_lock<boost::mutex> lock( namedMutexStack[i].lock );
+        namedMutexStack[i].entries.clear();
+    }
 
 };
 
@@ -361,18 +538,252 @@ void splitLines( string rawString, vector<string> * out ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Create an output parser that indexes the lines containing the given key/value delimiter
+ */
+OutputParser::OutputParser( char delim ) : delim(delim), parsed(0) {
+}
+
+/**
+ * Append a chunk of raw output and index the lines it completed
+ */
+void OutputParser::feed( const char * data, size_t length ) {
+    CRASH_REPORT_BEGIN;
+    this->buffer.append( data, length );
+    this->parse();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Index the lines completed since the last call
+ * (Used when the raw output is appended directly to the buffer)
+ */
+void OutputParser::parse() {
+    CRASH_REPORT_BEGIN;
+    size_t eol;
+    while ((eol = this->buffer.find( '\n', this->parsed )) != string::npos) {
+        this->index( this->parsed, eol );
+        this->parsed = eol + 1;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Index the last line, even if it's not terminated by a new line
+ */
+void OutputParser::finish() {
+    CRASH_REPORT_BEGIN;
+    this->parse();
+    if (this->parsed < this->buffer.length()) {
+        this->index( this->parsed, this->buffer.length() );
+        this->parsed = this->buffer.length();
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Discard the buffer and the indices
+ */
+void OutputParser::reset() {
+    CRASH_REPORT_BEGIN;
+    this->buffer.clear();
+    this->lines.clear();
+    this->pairs.clear();
+    this->parsed = 0;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the key/value delimiter, re-indexing the output collected so far
+ */
+void OutputParser::setDelimiter( char delim ) {
+    CRASH_REPORT_BEGIN;
+    if (delim == this->delim) return;
+    this->delim = delim;
+    this->pairs.clear();
+    for (vector<OUTPUT_SPAN>::iterator it = this->lines.begin(); it != this->lines.end(); ++it)
+        this->indexPair( *it );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the key/value delimiter
+ */
+char OutputParser::getDelimiter() const {
+    return this->delim;
+}
+
+/**
+ * Index the line in the buffer region [begin, end)
+ */
+void OutputParser::index( size_t begin, size_t end ) {
+    CRASH_REPORT_BEGIN;
+    
+    /* Trim junk (like splitLines) */
+    const char * data = this->buffer.data();
+    const char * cr = (const char *) memchr( data + begin, '\r', end - begin );
+    if (cr != NULL) end = cr - data;
+    
+    /* Index line */
+    OUTPUT_SPAN line;
+    line.begin = begin;
+    line.length = end - begin;
+    this->lines.push_back( line );
+    this->indexPair( line );
+    
+    CRASH_REPORT_END;
+}
+
+/**
+ * Index the key/value pair in the given line, if it has one (like getKV)
+ */
+void OutputParser::indexPair( const OUTPUT_SPAN & line ) {
+    CRASH_REPORT_BEGIN;
+    const char * data = this->buffer.data();
+    const char * delim = (const char *) memchr( data + line.begin, this->delim, line.length );
+    if (delim == NULL) return;
+    size_t end = line.begin + line.length, d = delim - data;
+    
+    /* Split key and value, skipping the whitespace after the delimiter */
+    OUTPUT_KV kv;
+    kv.key.begin = line.begin;
+    kv.key.length = d - line.begin;
+    for (d++; (d < end) && ((this->buffer[d] == ' ') || (this->buffer[d] == '\t')); d++) ;
+    kv.value.begin = d;
+    kv.value.length = end - d;
+    this->pairs.push_back( kv );
+    
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the number of lines indexed
+ */
+size_t OutputParser::lineCount() const {
+    return this->lines.size();
+}
+
+/**
+ * Return the location of the given line in the buffer
+ */
+const OUTPUT_SPAN & OutputParser::lineSpan( size_t index ) const {
+    return this->lines[index];
+}
+
+/**
+ * Return a copy of the given line
+ */
+std::string OutputParser::line( size_t index ) const {
+    CRASH_REPORT_BEGIN;
+    return this->str( this->lines[index] );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the number of key/value pairs indexed
+ */
+size_t OutputParser::size() const {
+    return this->pairs.size();
+}
+
+/**
+ * Return a copy of the key of the given pair
+ */
+std::string OutputParser::key( size_t index ) const {
+    CRASH_REPORT_BEGIN;
+    return this->str( this->pairs[index].key );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a copy of the value of the given pair
+ */
+std::string OutputParser::value( size_t index ) const {
+    CRASH_REPORT_BEGIN;
+    return this->str( this->pairs[index].value );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Look-up the value of the first pair with the given key
+ */
+bool OutputParser::get( const std::string & key, std::string * value ) const {
+    CRASH_REPORT_BEGIN;
+    for (vector<OUTPUT_KV>::const_iterator it = this->pairs.begin(); it != this->pairs.end(); ++it) {
+        if (this->buffer.compare( (*it).key.begin, (*it).key.length, key ) == 0) {
+            if (value != NULL) *value = this->str( (*it).value );
+            return true;
+        }
+    }
+    return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a copy of the given region of the buffer
+ */
+std::string OutputParser::str( const OUTPUT_SPAN & span ) const {
+    CRASH_REPORT_BEGIN;
+    return this->buffer.substr( span.begin, span.length );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the needle within the given region of the buffer, starting from the given offset
+ * in that region. Returns the offset of the match in the region, or string::npos.
+ */
+size_t OutputParser::find( const OUTPUT_SPAN & span, const char * needle, size_t offset ) const {
+    CRASH_REPORT_BEGIN;
+    size_t length = strlen( needle );
+    if ((offset > span.length) || (length > span.length - offset)) return string::npos;
+    if (length == 0) return offset;
+    
+    /* Jump between the occurances of the first character with memchr */
+    const char * begin = this->buffer.data() + span.begin;
+    const char * last = begin + span.length - length;
+    const char * pos = begin + offset;
+    while ((pos = (const char *) memchr( pos, needle[0], last - pos + 1 )) != NULL) {
+        if (memcmp( pos + 1, needle + 1, length - 1 ) == 0) return pos - begin;
+        if (++pos > last) break;
+    }
+    return string::npos;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Copy the lines to the given vector (compatible with splitLines)
+ */
+void OutputParser::getLines( std::vector<std::string> * lines ) const {
+    CRASH_REPORT_BEGIN;
+    lines->clear();
+    lines->reserve( this->lines.size() );
+    for (vector<OUTPUT_SPAN>::const_iterator it = this->lines.begin(); it != this->lines.end(); ++it)
+        lines->push_back( this->str( *it ) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Copy the key/value pairs to a map, keeping the first occurance of every key
+ * (compatible with tokenize)
+ */
+std::map<std::string, std::string> OutputParser::getMap() const {
+    CRASH_REPORT_BEGIN;
+    map<string, string> ans;
+    for (vector<OUTPUT_KV>::const_iterator it = this->pairs.begin(); it != this->pairs.end(); ++it)
+        ans.insert( std::pair<string, string>( this->str( (*it).key ), this->str( (*it).value ) ) );
+    return ans;
+    CRASH_REPORT_END;
+}
+
 /**
  * Split the given string into a vector of strings using white space as delimiter, while preserving
- * strin contents found in double quotes.
+ * strin contents found in double quotes. A quote without its closing pair extends to the end of the string.
  */
-int splitArguments( std::string source, char ** charBuffer, int bufferSize, int bufferOffset ) {
+int splitArguments( std::string source, std::vector< std::string > * args ) {
     CRASH_REPORT_BEGIN;
-    static vector<string> args;
     size_t wsPos=0, sqPos=0, dqPos=0, qPos=0, iPos=0;
-    string chunk; char nextChar = ' ';
-
-    // Clear static args array
-    args.clear();
+    string chunk, prefix; char nextChar = ' ';
+    size_t initialSize = args->size();
 
     // Start analyzer
     while (iPos < source.length()) {
@@ -381,17 +792,17 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
         dqPos = source.find('\'', iPos);
 
         // Nothing found? We ran out of string
-        if ((wsPos == string::npos) && (sqPos == string::npos) && (dqPos == string::npos)) {
+        if ((nextChar == ' ') && (wsPos == string::npos) && (sqPos == string::npos) && (dqPos == string::npos)) {
 
             // Stack all the remains
             chunk = source.substr( iPos, source.length() - iPos );
-            args.push_back( chunk );
+            args->push_back( chunk );
             break;
         
         // State 1: Checking for whitespace
-        } else if ((nextChar == ' ') && (wsPos < sqPos) && (wsPos < sqPos)) {
+        } else if ((nextChar == ' ') && (wsPos < sqPos) && (wsPos < dqPos)) {
             chunk = source.substr( iPos, wsPos - iPos );
-            args.push_back( chunk );
+            args->push_back( chunk );
             iPos = wsPos+1;
 
         // State 2: Starting quote
@@ -410,6 +821,9 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
                 qPos = dqPos;
             }
 
+            // Keep what precedes the quote in the same argument
+            prefix = source.substr( iPos, qPos - iPos );
+
             // Mark beginning
             iPos = qPos+1;
 
@@ -417,8 +831,8 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
         } else if ((nextChar == '\'') && (sqPos != string::npos)) {
 
             // Stack the string contents
-            chunk = source.substr( iPos, sqPos - iPos );
-            args.push_back( chunk );
+            chunk = prefix + source.substr( iPos, sqPos - iPos );
+            args->push_back( chunk );
             iPos = sqPos+2;
 
             // Exit quote maching mode
@@ -428,8 +842,8 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
         } else if ((nextChar == '"') && (dqPos != string::npos)) {
 
             // Stack the string contents
-            chunk = source.substr( iPos, dqPos - iPos );
-            args.push_back( chunk );
+            chunk = prefix + source.substr( iPos, dqPos - iPos );
+            args->push_back( chunk );
             iPos = dqPos+2;
 
             // Exit quote maching mode
@@ -437,36 +851,17 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
 
         } else {
 
-            // We should NEVER reach this point
-            CVMWA_LOG("Error", "Unhandled case");
-
-        }
-
-    }
-
-    // Cast back to the charBuffer
-    int i = bufferOffset;
-    for (vector<string>::iterator it = args.begin(); it < args.end(); it++) {
-
-        // Check if we filled the buffer
-        if ((i+1) >= bufferSize) {
-            charBuffer[i] = (char*)NULL;
+            // Unterminated quote: The rest of the string is its contents
+            chunk = prefix + source.substr( iPos, source.length() - iPos );
+            args->push_back( chunk );
             break;
-        }
 
-        /* CHECK: My guess is that since 'args' is static, the
-                  pointer to the buffer within the string will 
-                  be preserved even when the function exit. 
-                  Is it true? */
-        charBuffer[i++] = (char *)(*it).c_str();
+        }
 
     }
 
-    // Put a null char on the end
-    charBuffer[i] = (char*)NULL;
-
-    // Return how many components were placed in the charBuffer
-    return i;
+    // Return how many components were appended
+    return (int)(args->size() - initialSize);
 
     CRASH_REPORT_END;
 }
@@ -611,6 +1006,62 @@ std::string getTmpFile( string suffix, string folder ) {
  */
 bool    sysExecAborted = false;
 
+#ifndef _WIN32
+/**
+ * Wake-up pipe that becomes readable when abortSysExec() is called,
+ * so every __sysExec() blocked in poll() returns immediately.
+ */
+int                 sysExecWakeFd[2] = { -1, -1 };
+boost::once_flag    sysExecWakeOnce = BOOST_ONCE_INIT;
+
+/**
+ * Create the non-blocking wake-up pipe (called once)
+ */
+void __sysExecWakeInit() {
+    if (pipe(sysExecWakeFd) < 0) {
+        sysExecWakeFd[0] = -1; sysExecWakeFd[1] = -1;
+        return;
+    }
+    for (int i=0; i<2; i++) {
+        fcntl(sysExecWakeFd[i], F_SETFL, fcntl(sysExecWakeFd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(sysExecWakeFd[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/**
+ * Open a descriptor that becomes readable when the given child exits.
+ * Returns -1 if the platform does not support it.
+ */
+int __sysExecPidFd( pid_t pid ) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return (int)syscall( SYS_pidfd_open, pid, 0 );
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Read everything currently available on the given (non-blocking) fd.
+ * Returns false when the other end has hung-up.
+ */
+bool __sysExecDrain( int fd, string * buffer ) {
+    char data[4096];
+    ssize_t dataLen;
+    for (;;) {
+        dataLen = read(fd, data, sizeof(data));
+        if (dataLen > 0) {
+            buffer->append(data, dataLen);
+        } else if ((dataLen < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((dataLen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            return true;
+        } else {
+            return false;
+        }
+    }
+}
+#endif
+
 /**
  * Global initialization to sysExec
  */
@@ -618,6 +1069,14 @@ void initSysExec() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Initializing sysExec()");
     sysExecAborted = false;
+#ifndef _WIN32
+    /* Consume any pending wake-up from a previous abort */
+    boost::call_once( __sysExecWakeInit, sysExecWakeOnce );
+    if (sysExecWakeFd[0] >= 0) {
+        string discard;
+        __sysExecDrain( sysExecWakeFd[0], &discard );
+    }
+#endif
     CRASH_REPORT_END;
 }
 
@@ -628,14 +1087,99 @@ void abortSysExec() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Aborting sysExec()");
     sysExecAborted = true;
+#ifndef _WIN32
+    /* Wake up all the pending poll() calls. The byte is left in the pipe
+       so it stays readable (level-triggered) until initSysExec() */
+    boost::call_once( __sysExecWakeInit, sysExecWakeOnce );
+    if (sysExecWakeFd[1] >= 0) {
+        char c = 1;
+        if (write( sysExecWakeFd[1], &c, 1 ) < 0) { /* Already signaled */ }
+    }
+#endif
     CRASH_REPORT_END;
 }
 
+/**
+ * Create an abort trigger of a single command
+ */
+SysExecAbort::SysExecAbort( ) : triggered( false ) {
+    CRASH_REPORT_BEGIN;
+    this->fd[0] = -1; this->fd[1] = -1;
+#ifndef _WIN32
+    if (pipe(this->fd) < 0) {
+        this->fd[0] = -1; this->fd[1] = -1;
+        return;
+    }
+    for (int i=0; i<2; i++) {
+        fcntl(this->fd[i], F_SETFL, fcntl(this->fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(this->fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the wake-up pipe
+ */
+SysExecAbort::~SysExecAbort( ) {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+    if (this->fd[0] >= 0) close(this->fd[0]);
+    if (this->fd[1] >= 0) close(this->fd[1]);
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Abort the commands using this trigger, waking-up the ones blocked in poll()
+ */
+void SysExecAbort::abort( ) {
+    CRASH_REPORT_BEGIN;
+    this->triggered = true;
+#ifndef _WIN32
+    if (this->fd[1] >= 0) {
+        char c = 1;
+        if (write( this->fd[1], &c, 1 ) < 0) { /* Already signaled */ }
+    }
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Re-arm the trigger (no command must be using it)
+ */
+void SysExecAbort::reset( ) {
+    CRASH_REPORT_BEGIN;
+    this->triggered = false;
+#ifndef _WIN32
+    if (this->fd[0] >= 0) {
+        string discard;
+        __sysExecDrain( this->fd[0], &discard );
+    }
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the trigger was fired
+ */
+bool SysExecAbort::aborted( ) const {
+    return this->triggered;
+}
+
+/**
+ * Return the descriptor that becomes readable when the trigger is fired (-1 if not available)
+ */
+int SysExecAbort::wakeFd( ) const {
+    return this->fd[0];
+}
+
 /**
  * Cross-platform exec and return function (called by sysExec())
  */
-int __sysExec( string app, string cmdline, vector<string> * stdoutList, string * rawStderr, int timeout ) {
+int __sysExec( string app, string cmdline, OutputParser * output, string * rawStderr, int timeout, SysExecAbort * abort ) {
     CRASH_REPORT_BEGIN;
+    if (output != NULL) output->reset();
     try {
 #ifndef _WIN32
     
@@ -644,123 +1188,94 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
     string item;
     string rawStdout = "";
     *rawStderr = "";
+
+    /* Stream stdout directly into the parser buffer (if we are interested in it) */
+    string * outBuffer = (output != NULL) ? &output->buffer : &rawStdout;
     bool pipeHUP[2];
 
-    /* Prepare the two pipes */
+    /* Build the complete argument vector in the parent */
+    vector<string> args;
+    args.push_back( app );
+    splitArguments( cmdline, &args );
+    vector<char *> argv;
+    for (vector<string>::iterator it = args.begin(); it != args.end(); ++it)
+        argv.push_back( (char *)(*it).c_str() );
+    argv.push_back( (char *)NULL );
+
+    /* Prepare the two pipes (close-on-exec, so that commands
+       spawned concurrently from other threads don't inherit them) */
     int outfd[2]; if (pipe(outfd) < 0) return HVE_IO_ERROR;
-    int errfd[2]; if (pipe(errfd) < 0) return HVE_IO_ERROR;
+    int errfd[2]; if (pipe(errfd) < 0) { close(outfd[0]); close(outfd[1]); return HVE_IO_ERROR; }
+    for (int i=0; i<2; i++) {
+        fcntl(outfd[i], F_SETFD, FD_CLOEXEC);
+        fcntl(errfd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* Wire the writing ends to the child's stdout/stderr */
+    posix_spawn_file_actions_t fileActions;
+    posix_spawn_file_actions_init( &fileActions );
+    posix_spawn_file_actions_adddup2( &fileActions, outfd[1], 1 );
+    posix_spawn_file_actions_adddup2( &fileActions, errfd[1], 2 );
 
-    /* Fork to create child instance */
-    pidChild = fork();
-    if (pidChild == -1) {
+    /* Spawn the child without copying our (possibly huge) address space */
+    int spawnErr = posix_spawn( &pidChild, app.c_str(), &fileActions, NULL, &argv[0], environ );
+    posix_spawn_file_actions_destroy( &fileActions );
+    if (spawnErr != 0) {
 
         /* Close pipes */
         close(outfd[0]); close(outfd[1]);
         close(errfd[0]); close(errfd[1]);
 
         /* Return error code if something went wrong */
-        return 254;
-
-    } else if(!pidChild) {
-
-        /* Close unused read end */
-        close(outfd[0]); close(errfd[0]);
-
-        /* Close standard outs */
-        close(1); close(2);
-
-        /* Replace standard outs */
-        if (dup2(outfd[1], 1) < 0) {
-            close(outfd[1]); close(errfd[1]);
-            return HVE_IO_ERROR;
-        }
-        if (dup2(errfd[1], 2) < 0) {
-            close(outfd[1]); close(errfd[1]);
-            return HVE_IO_ERROR;
-        }
-
-        /* Release the writing end */
-        close(outfd[1]); close(errfd[1]);
-
-        /* Split cmdline into string components */
-        char *parts[512];
-        parts[0] = (char *)app.c_str();
-        splitArguments( cmdline, parts, 512, 1 );
-        
-        /* Launch given process */
-        execv(app.c_str(), parts);
-
-        /* We reach this point if execv fails */
+        CVMWA_LOG("Debug", "Unable to spawn " << app << " (error " << spawnErr << ")");
         return 254;
 
     } else {
 
-        char data[1024];
-        ssize_t dataLen;
-
         /* Close unused write end */
         close(outfd[1]); close(errfd[1]);
 
-        /* Prepare the poll fd list */
-        struct pollfd fds[2];
-        fds[0].fd = outfd[0]; fds[0].events = POLLIN;
-        fds[1].fd = errfd[0]; fds[1].events = POLLIN;
-
-        /* Start reading stdin/err */
+        /* Make the read ends non-blocking so we can drain them */
+        fcntl(outfd[0], F_SETFL, fcntl(outfd[0], F_GETFL) | O_NONBLOCK);
+        fcntl(errfd[0], F_SETFL, fcntl(errfd[0], F_GETFL) | O_NONBLOCK);
+
+        /* Get notified on child exit (if supported) and on abort */
+        boost::call_once( __sysExecWakeInit, sysExecWakeOnce );
+        int pidFd = __sysExecPidFd( pidChild );
+
+        /* Prepare the poll fd list: stdout, stderr, wake-up pipe, child pidfd, abort trigger */
+        struct pollfd fds[5];
+        fds[0].fd = outfd[0];         fds[0].events = POLLIN;
+        fds[1].fd = errfd[0];         fds[1].events = POLLIN;
+        fds[2].fd = sysExecWakeFd[0]; fds[2].events = POLLIN;
+        fds[3].fd = pidFd;            fds[3].events = POLLIN;
+        fds[4].fd = (abort != NULL) ? abort->wakeFd() : -1;
+        fds[4].events = POLLIN;
+        pipeHUP[0] = false; pipeHUP[1] = false;
+
+        /* Block until something happens */
         long startTime = getMillis();
+        bool childReaped = false;
+        int status = 0;
         for (;;) {
 
-            /* Poll descriptors */
-            ret = poll(fds, 2, 50);
-            if (ret > 0) {
-                /* An event on one of the fds has occurred. */
-                for (int i=0; i<2; i++) {
-                    pipeHUP[i] = false;
-                    if (fds[i].revents & POLLIN) {
-                        // Data is available on fds[i]
-                        dataLen = read(fds[i].fd, data, sizeof(data)-1);
-                        if (dataLen > 0) {
-                            if (i == 0) {
-                                rawStdout.append(data, dataLen);
-                            } else {
-                                rawStderr->append(data, dataLen);
-
-#if defined(DEBUG) || defined(LOGGING) || defined(CRASH_REPORTING)
-                                /* Debug log stderror */
-                                CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
-#endif
-                            }
-                        } else {
-                            // Error while reading
-                            pipeHUP[i] = true;
-                        }
-                    } else if (fds[i].revents & POLLHUP) {
-                        // pipe hung-up.
-                        // Set ret to -1 to flag termination
-                        pipeHUP[i] = true;
-                    }
-                }
-                
-                // Wait all FDs to hung-up
-                if (pipeHUP[0] && pipeHUP[1])
-                    ret = -1;
-                
-            }
-
             /* Abort if it takes way too long */
-            if ( sysExecAborted || ((getMillis() - startTime) > timeout) ) {
+            long remaining = timeout - (getMillis() - startTime);
+            bool aborted = sysExecAborted || ((abort != NULL) && abort->aborted());
+            if ( aborted || (remaining < 0) ) {
 
                 // Close pipes
                 close(outfd[0]); close(errfd[0]);
+                if (pidFd >= 0) close(pidFd);
 
-                // Kill process
-                kill( pidChild, SIGKILL );
-
-                // Reap process
-                waitpid(pidChild, &ret, 0);
+                // Kill and reap process
+                if (!childReaped) {
+                    kill( pidChild, SIGKILL );
+                    waitpid(pidChild, &ret, 0);
+                }
 
                 // Set stderror (just for the heck of it)
-                if (sysExecAborted) {
+                if (aborted) {
                     CVMWA_LOG("Debug", "Aborting execution");
                     *rawStderr = "ERROR: Aborted";
                     return 254;
@@ -772,28 +1287,67 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
 
             }
 
-            /* Exit on error */
-            if (ret < 0) 
+            /* Without a pidfd we cannot wait on the child exit, so
+               wake-up periodically in order to check it with WNOHANG */
+            int waitTime = (int)remaining;
+            if ((pidFd < 0) && (waitTime > SYSEXEC_SLEEP_DELAY))
+                waitTime = SYSEXEC_SLEEP_DELAY;
+
+            /* Wait for the pipes, the child or an abort */
+            ret = poll(fds, 5, waitTime);
+            if ((ret < 0) && (errno != EINTR)) 
                 break;
-                
-            /* CPU Idle delay */
-            sleepMs( SYSEXEC_SLEEP_DELAY - 50 );
 
-            CVMWA_LOG("Debug", "Idle loop");
+            /* Collect the available output */
+            for (int i=0; i<2; i++) {
+                if (!pipeHUP[i] && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    if (i == 0) {
+                        pipeHUP[i] = !__sysExecDrain( fds[i].fd, outBuffer );
+                        if (output != NULL) output->parse();
+                        rawStdout.clear();
+                    } else {
+                        pipeHUP[i] = !__sysExecDrain( fds[i].fd, rawStderr );
+#if defined(DEBUG) || defined(LOGGING) || defined(CRASH_REPORTING)
+                        /* Debug log stderror */
+                        CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
+#endif
+                    }
+                    /* Do not poll hung-up descriptors again */
+                    if (pipeHUP[i]) fds[i].fd = -1;
+                }
+            }
+
+            /* Check if the child has exited */
+            if (!childReaped && ((pidFd < 0) || (fds[3].revents & POLLIN))) {
+                if (waitpid(pidChild, &status, WNOHANG) == pidChild) {
+                    childReaped = true;
+
+                    /* Collect whatever is left in the pipes and stop. Any
+                       still-open write ends belong to detached grandchildren. */
+                    if (!pipeHUP[0]) __sysExecDrain( outfd[0], outBuffer );
+                    if (!pipeHUP[1]) __sysExecDrain( errfd[0], rawStderr );
+                    break;
+                }
+            }
+
+            /* Both pipes hung-up, the child is about to exit */
+            if (pipeHUP[0] && pipeHUP[1])
+                break;
 
         }
 
-        /* Split stdout lines */
-        splitLines( rawStdout, stdoutList );
+        /* Index the remaining stdout lines */
+        if (output != NULL) output->finish();
 
         /* Close pipes */
         close(outfd[0]); close(errfd[0]);
+        if (pidFd >= 0) close(pidFd);
 
         /* Wait forked pid to exit */
-        waitpid(pidChild, &ret, 0);
+        if (!childReaped) waitpid(pidChild, &status, 0);
 
         /* Otherwise, return the error code */
-        return ret;
+        return status;
     }
 
      /* Should not reach this point, but what the heck */
@@ -808,7 +1362,6 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
 	PROCESS_INFORMATION piProcInfo;
 	STARTUPINFOA siStartInfo;
 	BOOL bSuccess = FALSE;
-	string rawStdout = "";
     *rawStderr = "";
 
 	SECURITY_ATTRIBUTES sAttr;
@@ -861,6 +1414,7 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
 	    
 	/* Read to buffers */
     long startTime = getMillis();
+    bool procExited = false;
     for (;;) {
 
         /* Check for STDERR data (Never break on errors here) */
@@ -878,8 +1432,8 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
         if (dwAvailable > 0) {
     		bSuccess = ReadFile( g_hChildStdOut_Rd, chBuf, 4096, &dwRead, NULL);
     		if ( !bSuccess || dwRead == 0 ) break;
-        	if ( stdoutList != NULL )
-    	    	rawStdout.append( chBuf, dwRead );
+        	if ( output != NULL )
+    	    	output->feed( chBuf, dwRead );
         }
         
         /* Check for timeout */
@@ -891,16 +1445,23 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
         }
         
         /* Check for abort */
-        if (sysExecAborted) {
+        if (sysExecAborted || ((abort != NULL) && abort->aborted())) {
             CVMWA_LOG("Debug", "Aborting execution");
             *rawStderr = "ERROR: Aborted";
+            TerminateProcess( piProcInfo.hProcess, 255 );
             ret = 255;
             break;
         }
         
-        /* Sleep a teensy bit not to eat-up the CPU on the
-            * infinite loop we are currently in */
-        sleepMs( SYSEXEC_SLEEP_DELAY );
+        /* Nothing to read: block on the process handle instead of sleeping,
+           so we return as soon as the process exits. Once it has exited
+           and the pipes are empty there is nothing more to wait for. */
+        if (dwAvailable == 0) {
+            if (WaitForSingleObject( piProcInfo.hProcess, SYSEXEC_SLEEP_DELAY ) == WAIT_OBJECT_0) {
+                if (procExited) break;
+                procExited = true;
+            }
+        }
 
     }
     
@@ -917,8 +1478,9 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
             CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
 #endif
 
-    	/* Split lines into stdout */
-        splitLines( rawStdout, stdoutList );
+    	/* Index the remaining stdout lines */
+        if ( output != NULL )
+            output->finish();
         
         /* Wait for completion */
         DWORD ans;
@@ -936,7 +1498,7 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
             }
         
             /* Check for abort */
-            if (sysExecAborted) {
+            if (sysExecAborted || ((abort != NULL) && abort->aborted())) {
                 CVMWA_LOG("Debug", "Aborting execution");
                 *rawStderr = "ERROR: Aborted";
                 ret = 255;
@@ -1002,13 +1564,14 @@ int sysExecAsync( string app, string cmdline ) {
 /**
  * Cross-platform exec function with retry functionality
  */
-int sysExec( string app, string cmdline, vector<string> * stdoutList, string * rawStderrAns, int retries, int timeout ) {
+int sysExecParsed( string app, string cmdline, OutputParser * output, string * rawStderrAns, int retries, int timeout, int * attempts, SysExecAbort * abort ) {
     CRASH_REPORT_BEGIN;
     string stdError;
     int res = 252;
+    if (attempts != NULL) *attempts = 0;
 
     // If we have already aborted, return
-    if (sysExecAborted) {
+    if (sysExecAborted || ((abort != NULL) && abort->aborted())) {
         CVMWA_LOG("Debug", "Aborted request to run: " << app << " " << cmdline);
         return 255;
     }
@@ -1018,7 +1581,8 @@ int sysExec( string app, string cmdline, vector<string> * stdoutList, string * r
         
         // Call the wrapper function
         CVMWA_LOG("Debug", "Executing: " << app << " " << cmdline);
-        res = __sysExec( app, cmdline, stdoutList, &stdError, timeout );
+        if (attempts != NULL) (*attempts)++;
+        res = __sysExec( app, cmdline, output, &stdError, timeout, abort );
         CVMWA_LOG("Debug", "Exec EXIT_CODE: " << res);
 
         // Check for "Error" in the stderr
@@ -1030,7 +1594,7 @@ int sysExec( string app, string cmdline, vector<string> * stdoutList, string * r
         }
 
         // If it was successful, or we were aborted, return now. No retries.
-        if ((res == 0) || (res == 255)) {
+        if ((res == 0) || (res == 255) || ((abort != NULL) && abort->aborted())) {
             break;
         } else {
             // Wait and retry
@@ -1043,6 +1607,35 @@ int sysExec( string app, string cmdline, vector<string> * stdoutList, string * r
     CRASH_REPORT_END;
 }
 
+/**
+ * Platform-independant function to execute the given command-line and return the
+ * STDOUT lines to the string vector in *stdoutList.
+ */
+int sysExec( string app, string cmdline, vector<string> * stdoutList, string * rawStderrAns, int retries, int timeout, int * attempts ) {
+    CRASH_REPORT_BEGIN;
+    OutputParser output;
+    int res = sysExecParsed( app, cmdline, (stdoutList != NULL) ? &output : NULL, rawStderrAns, retries, timeout, attempts );
+    if (stdoutList != NULL) output.getLines( stdoutList );
+    return res;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the last modification time of the given file, or 0 if it does not exist
+ */
+time_t getFileModified( std::string path ) {
+    CRASH_REPORT_BEGIN;
+    #ifdef _WIN32
+    struct _stat attrib;
+    if (_stat( path.c_str(), &attrib ) != 0) return 0;
+    #else
+    struct stat attrib;
+    if (stat( path.c_str(), &attrib ) != 0) return 0;
+    #endif
+    return attrib.st_mtime;
+    CRASH_REPORT_END;
+}
+
 /**
  * Compare two paths for eqality (ignoring different kinds of slashes)
  */
@@ -1363,6 +1956,100 @@ bool isPortOpen( const char * host, int port, unsigned char handshake ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Check if the given port is free, by binding a socket on it
+ */
+bool isPortFree( const char * host, int port ) {
+    CRASH_REPORT_BEGIN;
+    SOCKET sock;
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(struct sockaddr_in));
+    server.sin_family = AF_INET;
+    server.sin_port = htons( port );
+    server.sin_addr.s_addr = inet_addr( host );
+    
+    // Try to bind (it fails immediately if somebody listens there)
+    sock = (SOCKET) socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return false;
+    #ifdef _WIN32
+        // Without it, Windows lets us bind next to a listener on the wildcard address
+        BOOL exclusive = TRUE;
+        setsockopt(sock, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char *) &exclusive, sizeof(exclusive));
+    #endif
+    int result = bind(sock, (struct sockaddr *) &server, sizeof(server));
+    
+    #ifdef _WIN32
+        closesocket(sock);
+    #else
+        ::close(sock);
+    #endif
+    return (result == 0);
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Prepare the local port flags on first use (the caller must hold localPortsLock). The
+ * cursor starts at a random port, so that the processes allocating ports at the same
+ * time (the plugin instances and the daemon) don't all race for the same ones.
+ */
+void __localPortsInit( ) {
+    if (!localPortsUsed.empty()) return;
+    localPortsUsed.resize( LOCAL_PORT_MAX - LOCAL_PORT_MIN + 1, false );
+    #ifdef _WIN32
+    unsigned long seed = (unsigned long)getMillis() + 7919 * (unsigned long)GetCurrentProcessId();
+    #else
+    unsigned long seed = (unsigned long)getMillis() + 7919 * (unsigned long)getpid();
+    #endif
+    localPortsNext = LOCAL_PORT_MIN + (int)(seed % localPortsUsed.size());
+}
+
+/**
+ * Allocate a free local port, not used by anybody else and not handed out before
+ * (unless released). Ports are handed out in sequence, so that a port released
+ * by a closed VM is not immediately reused. Returns 0 if the range is exhausted.
+ */
+int allocateLocalPort( ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock( localPortsLock );
+    __localPortsInit();
+    for (size_t i = 0; i < localPortsUsed.size(); i++) {
+        int port = localPortsNext;
+        localPortsNext = (localPortsNext >= LOCAL_PORT_MAX) ? LOCAL_PORT_MIN : localPortsNext + 1;
+        if (localPortsUsed[port - LOCAL_PORT_MIN]) continue;
+        if (!isPortFree( "127.0.0.1", port )) continue;
+        localPortsUsed[port - LOCAL_PORT_MIN] = true;
+        return port;
+    }
+    return 0;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark a local port as used by one of our VMs (ex. when it's found in their configuration)
+ */
+void reserveLocalPort( int port ) {
+    CRASH_REPORT_BEGIN;
+    if ((port < LOCAL_PORT_MIN) || (port > LOCAL_PORT_MAX)) return;
+    boost::mutex::scoped_lock lock( localPortsLock );
+    __localPortsInit();
+    localPortsUsed[port - LOCAL_PORT_MIN] = true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a local port that is no longer used by our VMs
+ */
+void releaseLocalPort( int port ) {
+    CRASH_REPORT_BEGIN;
+    if ((port < LOCAL_PORT_MIN) || (port > LOCAL_PORT_MAX)) return;
+    boost::mutex::scoped_lock lock( localPortsLock );
+    if (localPortsUsed.empty()) return;
+    localPortsUsed[port - LOCAL_PORT_MIN] = false;
+    CRASH_REPORT_END;
+}
+
 /**
  * Get current date/time as a string
  */
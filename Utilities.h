@@ -67,6 +67,7 @@
 // Common on *NIX platforms
 #ifndef _WIN32
 #define SOCKET          int
+#define INVALID_SOCKET  -1
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/wait.h>
@@ -77,6 +78,7 @@
 
 #include <signal.h>
 #include <poll.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <stdio.h>
@@ -85,6 +87,7 @@
 
 // only for linux
 #ifdef __linux__
+#include <sys/syscall.h>
 #endif
 
 // Only for apple
@@ -130,12 +133,18 @@
 #define HSK_SIMPLE      1   // Just send a space and a newline and check if it's still connected
 #define HSK_HTTP        2   // Send a basic HTTP GET / request and expect some data as response
 
+/* Range of the local ports handed out by allocateLocalPort() (below the ephemeral ports) */
+#define LOCAL_PORT_MIN  20000
+#define LOCAL_PORT_MAX  32767
+
 /* Callback function definitions */
 typedef boost::function< void () >                                                   callbackVoid;
 typedef boost::function< void (const std::string&) >                                 callbackDebug;
 typedef boost::function< void (const std::string&, const int, const std::string&) >  callbackError;
 typedef boost::function<void ( const boost::shared_array<uint8_t>&, const size_t)>   callbackData;
 typedef boost::function<void ( const size_t, const size_t, const std::string& )>     callbackProgress;
+typedef boost::function< void (const std::vector<std::string>&) >                   callbackList;
+typedef boost::function< void (const std::string&, const std::string&) >             callbackProperty;
 
 /**
  * Get the location of the application's AppData folder
@@ -184,15 +193,111 @@ int                                                 sha256_bin      ( std::strin
  */
 int                                                 md5_bin         ( std::string path, unsigned char * checksum );
 
+/**
+ * Location of a string in the buffer of an OutputParser
+ */
+typedef struct {
+    size_t          begin;
+    size_t          length;
+} OUTPUT_SPAN;
+
+/**
+ * A key/value pair in the buffer of an OutputParser
+ */
+typedef struct {
+    OUTPUT_SPAN     key;
+    OUTPUT_SPAN     value;
+} OUTPUT_KV;
+
+/**
+ * Incremental parser of command output. The raw output is collected in a single buffer
+ * while the command is running and every completed line is indexed in-place, as a line
+ * and -if it contains the delimiter- as a key/value pair. Strings are only copied out
+ * of the buffer when requested.
+ */
+class OutputParser {
+public:
+    OutputParser( char delim = ':' );
+    
+    /* Streaming input */
+    void                        feed        ( const char * data, size_t length );
+    void                        parse       ( );
+    void                        finish      ( );
+    void                        reset       ( );
+    void                        setDelimiter( char delim );
+    char                        getDelimiter( ) const;
+    
+    /* Lines */
+    size_t                      lineCount   ( ) const;
+    const OUTPUT_SPAN &         lineSpan    ( size_t index ) const;
+    std::string                 line        ( size_t index ) const;
+    
+    /* Key/value pairs */
+    size_t                      size        ( ) const;
+    std::string                 key         ( size_t index ) const;
+    std::string                 value       ( size_t index ) const;
+    bool                        get         ( const std::string & key, std::string * value ) const;
+    
+    /* Span utilities */
+    std::string                 str         ( const OUTPUT_SPAN & span ) const;
+    size_t                      find        ( const OUTPUT_SPAN & span, const char * needle, size_t offset = 0 ) const;
+    
+    /* Adapters for the callers of splitLines() and tokenize() */
+    void                        getLines    ( std::vector<std::string> * lines ) const;
+    std::map<std::string, std::string> getMap ( ) const;
+    
+    std::string                 buffer;
+    
+private:
+    void                        index       ( size_t begin, size_t end );
+    void                        indexPair   ( const OUTPUT_SPAN & line );
+    char                        delim;
+    size_t                      parsed;
+    std::vector< OUTPUT_SPAN >  lines;
+    std::vector< OUTPUT_KV >    pairs;
+    
+};
+
+/**
+ * Trigger for aborting the sysExecParsed() calls it's given to, without affecting
+ * any other command (unlike abortSysExec). It remains triggered until reset().
+ */
+class SysExecAbort {
+public:
+    SysExecAbort( );
+    ~SysExecAbort( );
+    
+    void                        abort       ( );
+    void                        reset       ( );
+    bool                        aborted     ( ) const;
+    int                         wakeFd      ( ) const;
+    
+private:
+    bool                        triggered;
+    int                         fd[2];      // Wake-up pipe, readable while triggered (POSIX)
+    
+};
+
+/**
+ * Platform-independant function to execute the given command-line and stream its
+ * STDOUT to the given parser, which can be NULL if you are not interested in the output.
+ *
+ * This function will wait for the command to finish and it will return it's exit code.
+ * If attempts is not NULL, it receives the number of times the command was run.
+ * If abort is not NULL, triggering it kills the command (see SysExecAbort).
+ */
+int                                                 sysExecParsed   ( std::string app, std::string cmdline, OutputParser * output, std::string * rawStderr, int retries = 1, int timeout = SYSEXEC_TIMEOUT, int * attempts = NULL, SysExecAbort * abort = NULL );
+
 /**
  * Platform-independant function to execute the given command-line and return the
  * STDOUT lines to the string vector in *stdoutList.
  *
  * stdoutList can be NULL if you are not interested in collecting the output.
  * 
- * This function will wait for the command to finish and it will return it's exit code
+ * This function will wait for the command to finish and it will return it's exit code.
+ * If attempts is not NULL, it receives the number of times the command was run.
  */
-int                                                 sysExec         ( std::string app, std::string cmdline, std::vector<std::string> * stdoutList, std::string * rawStderr, int retries = 1, int timeout = SYSEXEC_TIMEOUT );
+int                                                 sysExec         ( std::string app, std::string cmdline, std::vector<std::string> * stdoutList, std::string * rawStderr, int retries = 1, int timeout = SYSEXEC_TIMEOUT, int * attempts = NULL );
 
 /**
  * Platform-independant function to execute the given command-line without
@@ -225,6 +330,11 @@ std::string                                         getTmpFile      ( std::strin
  */
 bool                                                samePath        ( std::string pathA, std::string pathB );
 
+/**
+ * Return the last modification time of the given file, or 0 if it does not exist
+ */
+time_t                                              getFileModified ( std::string path );
+
 /**
  * Convert a hexadecimal int, short or long from string to it's numeric representation
  */
@@ -263,6 +373,18 @@ int                                                 splitArguments  ( std::strin
  */
 bool                                                isPortOpen      ( const char * host, int port, unsigned char handshake = HSK_NONE );
 
+/**
+ * Check if the specified port can be bound (nobody is listening on it)
+ */
+bool                                                isPortFree      ( const char * host, int port );
+
+/**
+ * Allocate, reserve and release the local ports used by the VMs (see LOCAL_PORT_MIN)
+ */
+int                                                 allocateLocalPort   ( );
+void                                                reserveLocalPort    ( int port );
+void                                                releaseLocalPort    ( int port );
+
 /**
  * Visualize the dump of a string:string hash map
  */
@@ -393,12 +515,74 @@ inline void sleepMs(int sleepMs) {
 }
 
 /**
- * Named mutex context lock mechanisms
+ * Default minimum delay (in ms) between two mutating commands on the same resource
+ */
+#define NAMED_MUTEX_SPACING     500
+
+/**
+ * How many independently-locked shards the named mutex registry has
+ */
+#define NAMED_MUTEX_SHARDS      16
+
+/**
+ * Named mutex lock modes
+ */
+#define NMUTEX_SHARED           0   // Shared access (queries)
+#define NMUTEX_EXCLUSIVE        1   // Exclusive access
+#define NMUTEX_MUTATION         2   // Exclusive access, spaced from the previous mutation
+
+/**
+ * A named reader/writer mutex, with the time the last mutating command released it.
+ * The reference count is protected by the registry shard lock.
  */
-typedef boost::shared_ptr< boost::mutex >   sharedMutex;
+class NamedMutex {
+public:
+    NamedMutex() : lastMutation(0), refs(0) { };
+    boost::shared_mutex                 mutex;
+    long                                lastMutation;
+    std::string                         name;
+    int                                 refs;
+};
+typedef boost::shared_ptr< NamedMutex >     sharedMutex;
 sharedMutex                                 __nmutex_get( std::string name );
-#define NAMED_MUTEX_LOCK(x)                 { sharedMutex __mutex = __nmutex_get(x); boost::unique_lock<boost::mutex> __mLock( *__mutex.get() );
-#define NAMED_MUTEX_UNLOCK                  sleepMs(500); }; 
+void                                        __nmutex_release( sharedMutex m );
+
+/**
+ * Scoped lock on a named mutex. Shared locks (used for queries) can overlap, while
+ * mutation locks are additionally delayed until NAMED_MUTEX_SPACING ms passed since
+ * the previous mutation.
+ */
+class NamedMutexLock {
+public:
+    NamedMutexLock( const std::string & name, int mode = NMUTEX_EXCLUSIVE );
+    ~NamedMutexLock();
+private:
+    void                                acquire();
+    void                                release();
+    sharedMutex                         entry;
+    int                                 mode;
+};
+
+/**
+ * Change the minimum delay between mutating commands on the same resource
+ */
+void                                        setNamedMutexSpacing    ( int spacing );
+
+/**
+ * Get the number of named locks acquired and the time (in ms) spent waiting
+ * for the lock itself and for the mutation spacing
+ */
+void                                        getNamedMutexStats      ( long * locks, long * lockWait, long * spacingWait );
+
+/**
+ * Get the number of named mutexes currently kept in the registry
+ */
+size_t                                      getNamedMutexCount      ( );
+
+#define NAMED_MUTEX_LOCK(x)                 { NamedMutexLock __mLock( x, NMUTEX_EXCLUSIVE );
+#define NAMED_MUTEX_LOCK_SHARED(x)          { NamedMutexLock __mLock( x, NMUTEX_SHARED );
+#define NAMED_MUTEX_LOCK_MODE(x,mode)       { NamedMutexLock __mLock( x, mode );
+#define NAMED_MUTEX_UNLOCK                  }; 
 
 /**
  * Convert to lowercase the given string
@@ -25,6 +25,9 @@
 #include <sstream>
 #include <map>
 #include <algorithm>
+#include <fstream>
+
+#include <boost/interprocess/sync/file_lock.hpp>
 
 #include "Hypervisor.h"
 #include "Virtualbox.h"
@@ -54,8 +57,6 @@ using namespace std;
 #define GUESTADD_DEVICE     "0"
 
 // Where the floppyIO floppy is placed
-#define FLOPPYIO_ENUM_NAME  "Storage Controller Name (2)"
-    // ^^ The first controller is IDE, second is SATA, third is Floppy
 #define FLOPPYIO_CONTROLLER "Floppy"
 #define FLOPPYIO_PORT       "0"
 #define FLOPPYIO_DEVICE     "0"
@@ -65,11 +66,12 @@ using namespace std;
 \** =========================================== **/
 
 // Create some condensed strings using the above parameters
-#define BOOT_DSK            BOOT_CONTROLLER " (" BOOT_PORT ", " BOOT_DEVICE ")"
-#define SCRATCH_DSK         SCRATCH_CONTROLLER " (" SCRATCH_PORT ", " SCRATCH_DEVICE ")"
-#define CONTEXT_DSK         CONTEXT_CONTROLLER " (" CONTEXT_PORT ", " CONTEXT_DEVICE ")"
-#define GUESTADD_DSK        GUESTADD_CONTROLLER " (" GUESTADD_PORT ", " GUESTADD_DEVICE ")"
-#define FLOPPYIO_DSK        FLOPPYIO_CONTROLLER " (" FLOPPYIO_PORT ", " FLOPPYIO_DEVICE ")"
+// (They are the keys of the VBOX_VMINFO media map)
+#define BOOT_DSK            BOOT_CONTROLLER "-" BOOT_PORT "-" BOOT_DEVICE
+#define SCRATCH_DSK         SCRATCH_CONTROLLER "-" SCRATCH_PORT "-" SCRATCH_DEVICE
+#define CONTEXT_DSK         CONTEXT_CONTROLLER "-" CONTEXT_PORT "-" CONTEXT_DEVICE
+#define GUESTADD_DSK        GUESTADD_CONTROLLER "-" GUESTADD_PORT "-" GUESTADD_DEVICE
+#define FLOPPYIO_DSK        FLOPPYIO_CONTROLLER "-" FLOPPYIO_PORT "-" FLOPPYIO_DEVICE
 
 /**
  * Extract the mac address of the VM from the NIC line definition
@@ -108,6 +110,181 @@ std::string changeUpperIP( std::string baseIP, int value ) {
     CRASH_REPORT_END;
 };
 
+/**
+ * Strip the double quotes that enclose the keys and values of the machine-readable output
+ */
+std::string __unquote( const std::string & str ) {
+    CRASH_REPORT_BEGIN;
+    if (str.empty() || (str[0] != '"')) return str;
+    size_t end = str.find( '"', 1 );
+    if (end == string::npos) return str.substr( 1 );
+    return str.substr( 1, end - 1 );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Parse the output of 'guestproperty enumerate' (or 'guestproperty wait') into a key/value map
+ */
+map<string, string> __parseGuestProperties( const OutputParser & output ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string> ans;
+    for (size_t i = 0; i < output.lineCount(); i++) {
+        const OUTPUT_SPAN & line = output.lineSpan( i );
+
+        /* Find the anchor locations */
+        size_t kBegin = output.find( line, "Name: " );
+        if (kBegin == string::npos) continue;
+        size_t kEnd = output.find( line, ", value:", kBegin );
+        if (kEnd == string::npos) continue;
+        size_t vEnd = output.find( line, ", timestamp:", kEnd );
+        if (vEnd == string::npos) vEnd = output.find( line, ", flags:", kEnd ); // 'guestproperty wait' has no timestamp
+        if (vEnd == string::npos) continue;
+
+        /* Get key */
+        kBegin += 6;
+        string vKey = output.buffer.substr( line.begin + kBegin, kEnd - kBegin );
+
+        /* Get value */
+        size_t vBegin = kEnd + 9;
+        string vValue = output.buffer.substr( line.begin + vBegin, vEnd - vBegin );
+
+        /* Store values */
+        ans[vKey] = vValue;
+
+    }
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Locate the global VirtualBox.xml settings file (the registry of the VMs)
+ */
+std::string __virtualboxConfigFile() {
+    CRASH_REPORT_BEGIN;
+    vector<string> paths;
+    char * env;
+    
+    /* Overriden by the user */
+    if ((env = getenv("VBOX_USER_HOME")) != NULL)
+        paths.push_back( string(env) + "/VirtualBox.xml" );
+    
+    /* Platform defaults */
+    #ifdef _WIN32
+    if ((env = getenv("USERPROFILE")) != NULL)
+        paths.push_back( string(env) + "/.VirtualBox/VirtualBox.xml" );
+    #else
+    if ((env = getenv("HOME")) != NULL) {
+        #if defined(__APPLE__) && defined(__MACH__)
+        paths.push_back( string(env) + "/Library/VirtualBox/VirtualBox.xml" );
+        #else
+        paths.push_back( string(env) + "/.config/VirtualBox/VirtualBox.xml" );
+        #endif
+        paths.push_back( string(env) + "/.VirtualBox/VirtualBox.xml" );
+    }
+    #endif
+    
+    /* Use the first that exists */
+    for (vector<string>::iterator it = paths.begin(); it != paths.end(); ++it) {
+        if (file_exists( *it )) return *it;
+    }
+    return "";
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the value of the given attribute of the XML element starting at the given
+ * position (as VirtualBox writes them, with the entities of the special characters)
+ */
+std::string __xmlAttribute( const std::string & xml, size_t element, const std::string & name ) {
+    CRASH_REPORT_BEGIN;
+    size_t elementEnd = xml.find( '>', element );
+    string needle = " " + name + "=\"";
+    size_t vBegin = xml.find( needle, element );
+    if ((vBegin == string::npos) || (vBegin > elementEnd)) return "";
+    vBegin += needle.length();
+    size_t vEnd = xml.find( '"', vBegin );
+    if ((vEnd == string::npos) || (vEnd > elementEnd)) return "";
+    
+    /* Replace the entities */
+    string value = xml.substr( vBegin, vEnd - vBegin );
+    const char * entities[][2] = { {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {"&amp;", "&"} };
+    for (size_t i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+        size_t pos = 0;
+        while ((pos = value.find( entities[i][0], pos )) != string::npos) {
+            value.replace( pos, strlen( entities[i][0] ), entities[i][1] );
+            pos += strlen( entities[i][1] );
+        }
+    }
+    return value;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Reserve the local ports in the given list of ports and port ranges (ex. '5000,5010-5012')
+ */
+void __reservePortList( const std::string & ports ) {
+    CRASH_REPORT_BEGIN;
+    size_t begin = 0, end;
+    while (begin < ports.length()) {
+        end = ports.find( ',', begin );
+        if (end == string::npos) end = ports.length();
+        string item = ports.substr( begin, end - begin );
+        begin = end + 1;
+        
+        size_t dash = item.find( '-' );
+        int first = atoi( item.c_str() );
+        int last = (dash == string::npos) ? first : atoi( item.c_str() + dash + 1 );
+        if (first < LOCAL_PORT_MIN) first = LOCAL_PORT_MIN;
+        if (last > LOCAL_PORT_MAX) last = LOCAL_PORT_MAX;
+        for (int port = first; port <= last; port++) reserveLocalPort( port );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Parse the output of 'metrics query' into a sample per object (the host or the name of a VM).
+ * The object and metric columns are space-padded and the object can contain spaces, so the
+ * line is split around the name of the metric.
+ */
+map<string, HVINFO_METRIC> __parseMetrics( const vector<string> & lines, long timestamp ) {
+    CRASH_REPORT_BEGIN;
+    static const char * names[] = { " CPU/Load/User ", " CPU/Load/Kernel ", " RAM/Usage/Used " };
+    map<string, HVINFO_METRIC> ans;
+    for (vector<string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+        const string & line = *it;
+        for (int m = 0; m < 3; m++) {
+            
+            /* Find the metric (the trailing space skips aggregates, like 'CPU/Load/User:avg') */
+            size_t iName = line.find( names[m] );
+            if (iName == string::npos) continue;
+            size_t iEnd = line.find_last_not_of( ' ', iName );
+            if (iEnd == string::npos) break;
+            string object = line.substr( 0, iEnd + 1 );
+            
+            /* Keep the most recent of the values (ex. "1.00%, 2.00%") */
+            string value = line.substr( iName + strlen(names[m]) );
+            size_t iComma = value.rfind( ',' );
+            if (iComma != string::npos) value = value.substr( iComma + 1 );
+            size_t iValue = value.find_first_not_of( ' ' );
+            if (iValue == string::npos) break; // Not collected yet
+            double v = atof( value.c_str() + iValue );
+            
+            /* Store values */
+            if (ans.find( object ) == ans.end()) {
+                HVINFO_METRIC sample = { timestamp, 0, 0, 0 };
+                ans[object] = sample;
+            }
+            if (m == 0) ans[object].cpuUser = (float)v;
+            if (m == 1) ans[object].cpuKernel = (float)v;
+            if (m == 2) ans[object].ramUsed = (long)v;
+            break;
+            
+        }
+    }
+    return ans;
+    CRASH_REPORT_END;
+}
+
 
 /** =========================================== **\
             VBoxSession Implementation
@@ -125,17 +302,13 @@ std::string VBoxSession::getDataFolder() {
         return this->dataPath;
 
     // Get machine info
-    map<string, string> info = this->getMachineInfo( 2000 );
-    if (info.empty()) 
+    VBOX_VMINFO info;
+    if (this->getMachineInfo( &info, 2000 ) != HVE_OK) 
         return "";
 
     // Find configuration folder
-    if (info.find("Config file") != info.end()) {
-        string settingsFolder = info["Config file"];
-
-        // Strip quotation marks
-        if ((settingsFolder[0] == '"') || (settingsFolder[0] == '\''))
-            settingsFolder = settingsFolder.substr( 1, settingsFolder.length() - 2);
+    if (!info.configFile.empty()) {
+        string settingsFolder = info.configFile;
 
         // Strip the settings file (leave path) and store it on dataPath
         this->dataPath = stripComponent( settingsFolder );
@@ -160,11 +333,14 @@ int VBoxSession::wrapExec( std::string cmd, std::vector<std::string> * stdoutLis
     /* Debug log command */
     if (this->onDebug) (this->onDebug)("Executing '"+cmd+"'");
     
-    /* Run command */
-    NAMED_MUTEX_LOCK( this->uuid );
+    /* Run command (queries on the same VM can overlap, mutations are serialized and spaced apart) */
+    NAMED_MUTEX_LOCK_MODE( this->uuid, hypervisorReadOnly(cmd) ? NMUTEX_SHARED : NMUTEX_MUTATION );
     ans = this->host->exec( cmd, stdoutList, &stderrLocal, retries, timeout );
     NAMED_MUTEX_UNLOCK;
     
+    /* Drop the cached listings this command might have changed */
+    this->host->listInvalidateBy( cmd );
+    
     /* Debug log response */
     if (this->onDebug) {
 
@@ -220,9 +396,19 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
     this->memory = memory;
     this->flags = flags;
         
-    /* (1) Create slot */
+    /* (1) Create slot. New CernVM-Micro VMs are claimed from the pool of pre-created VMs or
+           else are linked clones of a template VM, which already have the disks attached,
+           unless the template can't be used. */
     if (this->onProgress) (this->onProgress)(5, 110, "Allocating VM slot");
-    ans = this->getMachineUUID( this->name, &uuid, flags );
+    ans = 0;
+    if (((flags & HVF_DEPLOYMENT_HDD) == 0) && (this->host->registryLookup( this->name, &uuid ) == HVE_NOT_FOUND)) {
+        if ((this->host->poolClaim( this->name, cvmVersion, disk, flags, memory, &uuid ) != HVE_OK) &&
+            (this->host->templateClone( this->name, cvmVersion, disk, flags, &uuid, this->onProgress ) != HVE_OK)) uuid = "";
+    }
+    
+    /* Replace the claimed VM (or create the first ones) in the background */
+    if ((flags & HVF_DEPLOYMENT_HDD) == 0) this->host->poolRefill();
+    if (uuid.empty()) ans = this->getMachineUUID( this->name, &uuid, flags );
     if (ans != 0) {
         this->state = STATE_ERROR;
         /* Release update lock */
@@ -230,12 +416,19 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
         return ans;
     } else {
         this->uuid = uuid;
+        this->host->sessions.reindex( this );
     }
     
-    /* Find a random free port for VRDE */
-    this->rdpPort = (rand() % 0xFBFF) + 1024;
-    while (isPortOpen( "127.0.0.1", this->rdpPort ))
-        this->rdpPort = (rand() % 0xFBFF) + 1024;
+    /* Allocate a free port for VRDE (and later for the API), not used by any other VM */
+    this->host->reserveRegisteredPorts();
+    releaseLocalPort( this->rdpPort );
+    this->rdpPort = allocateLocalPort();
+    if (this->rdpPort == 0) {
+        this->state = STATE_ERROR;
+        /* Release update lock */
+        this->updateLock = false;
+        return HVE_CREATE_ERROR;
+    }
 
     /* Pick the boot medium depending on the mount type */
     string bootMedium = "dvd";
@@ -282,7 +475,7 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
 
         /* Detect the host-only adapter */
         if (this->onProgress) (this->onProgress)(10, 110, "Setting up local network");
-        string ifHO = this->getHostOnlyAdapter();
+        string ifHO = this->host->hostOnlyAdapter();
         if (ifHO.empty()) {
             this->state = STATE_ERROR;
             /* Release update lock */
@@ -303,10 +496,15 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
         /*  since the guest IP does not need to be known.                                  */
         /* =============================================================================== */
 
-        /* Find a random free port for API */
-        this->localApiPort = (rand() % 0xFBFF) + 1024;
-        while (isPortOpen( "127.0.0.1", this->localApiPort ))
-            this->localApiPort = (rand() % 0xFBFF) + 1024;
+        /* Allocate a free port for API */
+        releaseLocalPort( this->localApiPort );
+        this->localApiPort = allocateLocalPort();
+        if (this->localApiPort == 0) {
+            this->state = STATE_ERROR;
+            /* Release update lock */
+            this->updateLock = false;
+            return HVE_CREATE_ERROR;
+        }
 
         /* Create a NAT rule to the API port */
         args << " --natpf1 "              << "guestapi,tcp,127.0.0.1," << this->localApiPort << ",," << this->apiPort;
@@ -318,6 +516,8 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
     ans = this->wrapExec(args.str(), NULL);
     CVMWA_LOG( "Info", "Modify VM=" << ans  );
     if (ans != 0) {
+        /* The host-only adapter might be gone */
+        if ((this->flags & HVF_DUAL_NIC) != 0) this->host->hostOnlyInvalidate();
         this->state = STATE_ERROR;
         /* Release update lock */
         this->updateLock = false;
@@ -326,7 +526,8 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
 
     /* Fetch information to validate disks */
     if (this->onProgress) (this->onProgress)(20, 110, "Fetching machine info");
-    map<string, string> machineInfo = this->getMachineInfo( 2000 );
+    VBOX_VMINFO machineInfo;
+    this->getMachineInfo( &machineInfo, 2000 );
 
     /* ============================================================================= */
     /*   MODE 1 : Regular Mode                                                       */
@@ -366,11 +567,10 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
         
         /* (4) Check if the VM actually has the image we need */
         needsUpdate = true;
-        if (machineInfo.find( BOOT_DSK ) != machineInfo.end()) {
+        if (machineInfo.media.find( BOOT_DSK ) != machineInfo.media.end()) {
             
             /* Get the filename of the disk */
-            getKV( machineInfo[ BOOT_DSK ], &kk, &kv, '(', 0 );
-            kk = kk.substr(0, kk.length()-1);
+            kk = machineInfo.media[ BOOT_DSK ];
             
             /* If they are the same, we are lucky */
             if (kk.compare( masterDisk ) == 0) {
@@ -495,7 +695,7 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
     else {
         
         /* Check for scratch disk */
-        if (machineInfo.find( SCRATCH_DSK ) == machineInfo.end()) {
+        if (machineInfo.media.find( SCRATCH_DSK ) == machineInfo.media.end()) {
 
             /* Create a hard disk for this VM */
             string vmDisk = getTmpFile(".vdi", this->getDataFolder());
@@ -541,11 +741,10 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
 
         /* Check if the CernVM Version the machine is using is the one we need */
         needsUpdate = true;
-        if (machineInfo.find( BOOT_DSK ) != machineInfo.end()) {
+        if (machineInfo.media.find( BOOT_DSK ) != machineInfo.media.end()) {
 
             /* Get the filename of the iso */
-            getKV( machineInfo[ BOOT_DSK ], &kk, &kv, '(', 0 );
-            kk = kk.substr(0, kk.length()-1);
+            kk = machineInfo.media[ BOOT_DSK ];
 
             /* Get the filename of the given version */
             this->host->cernVMCached( cvmVersion, &kv );
@@ -630,11 +829,10 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
         
         /* Check if they are already mounted the guest additions */
         needsUpdate = true;
-        if (machineInfo.find( GUESTADD_DSK ) != machineInfo.end()) {
+        if (machineInfo.media.find( GUESTADD_DSK ) != machineInfo.media.end()) {
 
             /* Get the filename of the iso */
-            getKV( machineInfo[ GUESTADD_DSK ], &kk, &kv, '(', 0 );
-            kk = kk.substr(0, kk.length()-1);
+            kk = machineInfo.media[ GUESTADD_DSK ];
 
             /* If they are the same, we are lucky */
             if (this->host->hvGuestAdditions.compare(kk) == 0) {
@@ -701,8 +899,10 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
     this->setProperty("/CVMWeb/daemon/cap/max", ntos<int>(this->daemonMaxCap));
     this->setProperty("/CVMWeb/daemon/flags", ntos<int>(this->daemonFlags));
     this->setProperty("/CVMWeb/userData", base64_encode(this->userData));
+    this->flushProperties();
 
     /* Also update the property cache */
+    boost::unique_lock<boost::mutex> propertiesLock( this->propertiesMutex );
     this->properties["/CVMWeb/secret"] = this->key;
     this->properties["/CVMWeb/localApiPort"] = ntos<int>(this->localApiPort);
     this->properties["/CVMWeb/daemon/controlled"] = (this->daemonControlled ? "1" : "0");
@@ -710,12 +910,22 @@ int VBoxSession::open( int cpus, int memory, int disk, std::string cvmVersion, i
     this->properties["/CVMWeb/daemon/cap/max"] = ntos<int>(this->daemonMaxCap);
     this->properties["/CVMWeb/daemon/flags"] = ntos<int>(this->daemonFlags);
     this->properties["/CVMWeb/userData"] = base64_encode(this->userData);
+    propertiesLock.unlock();
 
     /* Last callbacks */
     if (this->onProgress) (this->onProgress)(110, 110, "Completed");
 
     /* Notify OPEN state change */
     this->state = STATE_OPEN;
+    
+    /* Remember this session in the session index */
+    VBOX_VMINFO indexInfo;
+    if (this->getMachineInfo( &indexInfo, 2000 ) == HVE_OK) {
+        this->host->indexStore( this, &indexInfo );
+    } else {
+        this->host->indexStore( this );
+    }
+    
     if (this->onOpen) (this->onOpen)();
     
     /* Release update lock */
@@ -814,15 +1024,11 @@ int VBoxSession::start( std::map<std::string,std::string> *uData ) {
     this->state = STATE_STARTING;
 
     /* Fetch information to validate disks */
-    map<string, string> machineInfo = this->getMachineInfo( 2000 );
+    VBOX_VMINFO machineInfo;
+    this->getMachineInfo( &machineInfo, 2000 );
     
     /* Check if vm is in saved state */
-    bool inSavedState = false;
-    if (machineInfo.find( "State" ) != machineInfo.end()) {
-        if (machineInfo["State"].find("saved") != string::npos) {
-            inSavedState = true;
-        }
-    }
+    bool inSavedState = (machineInfo.state == "saved");
 
     CVMWA_LOG("Debug", "inSavedState : " << (inSavedState ? "true" : "false") );
     
@@ -838,11 +1044,10 @@ int VBoxSession::start( std::map<std::string,std::string> *uData ) {
             /* ========================== */
             
             /* Detach & Delete previous context ISO */
-            if (machineInfo.find( FLOPPYIO_DSK ) != machineInfo.end()) {
+            if (machineInfo.media.find( FLOPPYIO_DSK ) != machineInfo.media.end()) {
         
                 /* Get the filename of the iso */
-                getKV( machineInfo[ FLOPPYIO_DSK ], &kk, &kv, '(', 0 );
-                kk = kk.substr(0, kk.length()-1);
+                kk = machineInfo.media[ FLOPPYIO_DSK ];
 
                 CVMWA_LOG( "Info", "Detaching " << kk  );
 
@@ -921,11 +1126,10 @@ int VBoxSession::start( std::map<std::string,std::string> *uData ) {
             /* ========================== */
 
             /* Detach & Delete previous context ISO */
-            if (machineInfo.find( CONTEXT_DSK ) != machineInfo.end()) {
+            if (machineInfo.media.find( CONTEXT_DSK ) != machineInfo.media.end()) {
         
                 /* Get the filename of the iso */
-                getKV( machineInfo[ CONTEXT_DSK ], &kk, &kv, '(', 0 );
-                kk = kk.substr(0, kk.length()-1);
+                kk = machineInfo.media[ CONTEXT_DSK ];
 
                 CVMWA_LOG( "Info", "Detaching " << kk  );
 
@@ -1000,6 +1204,9 @@ int VBoxSession::start( std::map<std::string,std::string> *uData ) {
         }
     }
     
+    /* Apply the pending property writes before the VM boots */
+    this->flushProperties();
+    
     /* Start VM */
     if (this->onProgress) (this->onProgress)(6, 7, "Starting VM");
     if ((this->flags & HVF_HEADFUL) != 0) {
@@ -1023,6 +1230,9 @@ int VBoxSession::start( std::map<std::string,std::string> *uData ) {
        state the DHCP lease might have been released. */
     this->ip = "";
     
+    /* Watch the guest properties */
+    this->watchStart();
+    
     /* Check for daemon need */
     this->host->checkDaemonNeed();
     
@@ -1057,36 +1267,38 @@ int VBoxSession::close( bool unmonitored ) {
     /* Acquire update lock */
     this->updateLock = true;
 
+    /* Stop watching the guest properties and drop the pending writes */
+    this->watchStop();
+    this->discardProperties();
+
     /* Stop the VM if it's running (we don't care about the warnings) */
     if (this->onProgress) (this->onProgress)(1, 10, "Shutting down the VM");
     this->controlVM( "poweroff");
     
     /* Unmount, release and delete media */
-    map<string, string> machineInfo = this->getMachineInfo( 2000 );
+    VBOX_VMINFO machineInfo;
+    this->getMachineInfo( &machineInfo, 2000 );
     
     /* Check if vm is in saved state */
-    if (machineInfo.find( "State" ) != machineInfo.end()) {
-        if (machineInfo["State"].find("saved") != string::npos) {
-            
-            if (this->onProgress) (this->onProgress)(2, 10, "Discarding saved VM state");
-            ans = this->wrapExec("discardstate " + this->uuid, NULL, NULL, retries);
-            CVMWA_LOG( "Info", "Discarded VM state=" << ans  );
-            if (ans != 0) {
-                this->state = STATE_ERROR;
-                /* Release update lock */
-                this->updateLock = false;
-                return HVE_CONTROL_ERROR;
-            }
+    if (machineInfo.state == "saved") {
             
+        if (this->onProgress) (this->onProgress)(2, 10, "Discarding saved VM state");
+        ans = this->wrapExec("discardstate " + this->uuid, NULL, NULL, retries);
+        CVMWA_LOG( "Info", "Discarded VM state=" << ans  );
+        if (ans != 0) {
+            this->state = STATE_ERROR;
+            /* Release update lock */
+            this->updateLock = false;
+            return HVE_CONTROL_ERROR;
         }
+            
     }
     
     /* Detach & Delete context ISO */
-    if (machineInfo.find( CONTEXT_DSK ) != machineInfo.end()) {
+    if (machineInfo.media.find( CONTEXT_DSK ) != machineInfo.media.end()) {
         
         /* Get the filename of the iso */
-        getKV( machineInfo[ CONTEXT_DSK ], &kk, &kv, '(', 0 );
-        kk = kk.substr(0, kk.length()-1);
+        kk = machineInfo.media[ CONTEXT_DSK ];
 
         CVMWA_LOG( "Info", "Detaching " << kk  );
 
@@ -1129,11 +1341,10 @@ int VBoxSession::close( bool unmonitored ) {
     }
     
     /* Detach & Delete Disk */
-    if (machineInfo.find( SCRATCH_DSK ) != machineInfo.end()) {
+    if (machineInfo.media.find( SCRATCH_DSK ) != machineInfo.media.end()) {
         
         /* Get the filename of the iso */
-        getKV( machineInfo[ SCRATCH_DSK ], &kk, &kv, '(', 0 );
-        kk = kk.substr(0, kk.length()-1);
+        kk = machineInfo.media[ SCRATCH_DSK ];
 
         CVMWA_LOG( "Info", "Detaching " << kk  );
 
@@ -1177,9 +1388,16 @@ int VBoxSession::close( bool unmonitored ) {
     
     /* Unregister and delete VM */
     if (this->onProgress) (this->onProgress)(9, 10, "Deleting VM");
+    time_t registryTime = this->host->registryModified();
     ans = this->wrapExec("unregistervm " + this->uuid + " --delete", NULL, NULL, retries);
     CVMWA_LOG( "Info", "Unregister VM=" << ans  );
     /* We don't care for errors here */
+    this->host->registryRemove( this->uuid, registryTime );
+    releaseLocalPort( this->rdpPort );
+    releaseLocalPort( this->localApiPort );
+    
+    /* Forget it from the session index */
+    this->host->indexRemove( this->uuid );
     
     /* OK */
     if (this->onProgress) (this->onProgress)(10, 10, "Completed");
@@ -1200,28 +1418,12 @@ int VBoxSession::getMachineUUID( std::string mname, std::string * ans_uuid, int
     ostringstream args;
     vector<string> lines;
     map<string, string> toks;
-    string secret, name, uuid;
-    
-    /* List the running VMs in the system */
-    int ans = this->wrapExec("list vms", &lines);
-    if (ans != 0) {
-        return HVE_QUERY_ERROR;
-    }
+    string uuid;
     
-    /* Tokenize */
-    toks = tokenize( &lines, '{' );
-    for (std::map<string, string>::iterator it=toks.begin(); it!=toks.end(); ++it) {
-        name = (*it).first;
-        uuid = (*it).second;
-        name = name.substr(1, name.length()-3);
-        uuid = uuid.substr(0, uuid.length()-1);
-        
-        /* Compare name */
-        if (name.compare(mname) == 0)  {
-            *ans_uuid = "{" + uuid + "}";
-            return 0;
-        }
-    }
+    /* Look it up in the registered VMs */
+    int ans = this->host->registryLookup( mname, ans_uuid );
+    if (ans == HVE_OK) return 0;
+    if (ans != HVE_NOT_FOUND) return HVE_QUERY_ERROR;
     
     /* Check what kind of linux to create */
     string osType = "Linux26";
@@ -1234,12 +1436,18 @@ int VBoxSession::getMachineUUID( std::string mname, std::string * ans_uuid, int
         << " --ostype " << osType
         << " --register";
     
+    time_t registryTime = this->host->registryModified();
     ans = this->wrapExec(args.str(), &lines);
-    if (ans != 0) return HVE_CREATE_ERROR;
+    if (ans != 0) {
+        /* Maybe somebody else registered it meanwhile */
+        this->host->registryInvalidate();
+        return HVE_CREATE_ERROR;
+    }
     
     /* Parse output */
     toks = tokenize( &lines, ':' );
     uuid = toks["UUID"];
+    this->host->registryAdd( mname, "{" + uuid + "}", registryTime );
     
     /* (3a) Attach an IDE controller */
     args.str("");
@@ -1340,6 +1548,7 @@ int VBoxSession::stop() {
     if (this->state != STATE_STARTED) return HVE_INVALID_STATE;
     
     /* Stop VM */
+    this->watchStop();
     ans = this->controlVM( "poweroff" );
     this->state = STATE_OPEN;
     
@@ -1361,6 +1570,7 @@ int VBoxSession::hibernate() {
     if (this->state != STATE_STARTED) return HVE_INVALID_STATE;
     
     /* Stop VM */
+    this->watchStop();
     ans = this->controlVM( "savestate" );
     this->state = STATE_OPEN;
     
@@ -1416,224 +1626,154 @@ int VBoxSession::setExecutionCap(int cap) {
 }
 
 /**
- * Ensure the existance and return the name of the host-only adapter in the system
+ * Return a property from the VirtualBox guest
  */
-std::string VBoxSession::getHostOnlyAdapter() {
+std::string VBoxSession::getProperty( std::string name, bool forceUpdate ) { 
     CRASH_REPORT_BEGIN;
-
     vector<string> lines;
-    vector< map<string, string> > ifs;
-    vector< map<string, string> > dhcps;
-    string ifName = "", vboxName, ipServer, ipMin, ipMax;
-    
-    /* Check if we already have host-only interfaces */
-    int ans = this->wrapExec("list hostonlyifs", &lines);
-    if (ans != 0) return "";
-    
-    /* Check if there is really nothing */
-    if (lines.size() == 0) {
-        ans = this->wrapExec("hostonlyif create", NULL, NULL, 2);
-        if (ans != 0) return "";
+    string value;
     
-        /* Repeat check */
-        ans = this->wrapExec("list hostonlyifs", &lines, NULL, 2);
-        if (ans != 0) return "";
+    if (!forceUpdate) {
+        boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
         
-        /* Still couldn't pick anything? Error! */
-        if (lines.size() == 0) return "";
+        /* Pending writes are the most recent values */
+        if (this->unsyncedProperties.find(name) != this->unsyncedProperties.end())
+            return this->unsyncedProperties[name];
+        
+        /* If we have properties map populated, pick the entry from there */
+        if (!this->properties.empty()) {
+            if (this->properties.find(name) == this->properties.end()) {
+                return "";
+            } else {
+                return this->properties[name];
+            }
+        }
     }
-    ifs = tokenizeList( &lines, ':' );
     
-    /* Dump the DHCP server states */
-    ans = this->wrapExec("list dhcpservers", &lines);
+    /* Invoke property query */
+    int ans = this->wrapExec("guestproperty get "+this->uuid+" \""+name+"\"", &lines, NULL, 2, 2000);
     if (ans != 0) return "";
-    dhcps = tokenizeList( &lines, ':' );
+    if (lines.empty()) return "";
     
-    /* The name of the first network found and a flag
-       to check if we were able to find a DHCP server */
-    bool    foundDHCPServer = false;
-    string  foundIface      = "",
-            foundBaseIP     = "",
-            foundVBoxName   = "",
-            foundMask       = "";
+    /* Process response */
+    value = lines[0];
+    if (value.substr(0,6).compare("Value:") == 0) {
+        return value.substr(7);
+    } else {
+        return "";
+    }
+    
+    CRASH_REPORT_END;
+}
 
-    /* Process interfaces */
-    for (vector< map<string, string> >::iterator i = ifs.begin(); i != ifs.end(); i++) {
-        map<string, string> iface = *i;
+/**
+ * Set a property to the VirtualBox guest. The write is buffered and flushed
+ * in the background after VBOX_PROPERTY_FLUSH_DELAY ms, or before the VM starts.
+ */
+int VBoxSession::setProperty( std::string name, std::string value ) { 
+    CRASH_REPORT_BEGIN;
+    
+    /* Buffer the write (repeated writes to the same property are coalesced) */
+    boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+    this->unsyncedProperties[name] = value;
+    
+    /* Schedule a flush, unless one is already scheduled */
+    if (!this->flushActive) {
+        if (this->flushThread != NULL) {
+            this->flushThread->join();
+            delete this->flushThread;
+        }
+        this->flushActive = true;
+        this->flushThread = new boost::thread( boost::bind( &VBoxSession::flushLoop, this ) );
+    }
+    return HVE_SCHEDULED;
+    
+    CRASH_REPORT_END;
+}
 
-        CVMWA_LOG("log", "Checking interface");
-        mapDump(iface);
+/**
+ * Write the buffered guest properties to the VM. The flushes are serialized,
+ * so the writes are applied in the order they were flushed.
+ */
+int VBoxSession::flushProperties() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> flushLock( this->flushMutex );
+    
+    /* This is valid only in mutable state */
+    if (!this->editable) return HVE_INVALID_STATE;
+    
+    /* Take the pending writes */
+    map<string, string> pending;
+    {
+        boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+        pending.swap( this->unsyncedProperties );
+    }
+    
+    /* Perform property updates */
+    int ans = HVE_OK;
+    for (map<string, string>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        string name = (*it).first;
+        string value = (*it).second;
+        if (this->wrapExec("guestproperty set "+this->uuid+" \""+name+"\" \""+value+"\"", NULL, NULL, 4, 2000) != 0) {
+            
+            /* Put it back, unless it was overwritten meanwhile */
+            boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+            if (this->unsyncedProperties.find( name ) == this->unsyncedProperties.end())
+                this->unsyncedProperties[name] = value;
+            ans = HVE_MODIFY_ERROR;
+            
+        } else {
+            
+            /* Keep the property cache in sync */
+            boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+            if (!this->properties.empty()) this->properties[name] = value;
+            
+        }
+    }
+    return ans;
+    
+    CRASH_REPORT_END;
+}
 
-        /* Ensure proper environment */
-        if (iface.find("Name") == iface.end()) continue;
-        if (iface.find("VBoxNetworkName") == iface.end()) continue;
-        if (iface.find("IPAddress") == iface.end()) continue;
-        if (iface.find("NetworkMask") == iface.end()) continue;
-        
-        /* Fetch interface info */
-        ifName = iface["Name"];
-        vboxName = iface["VBoxNetworkName"];
+/**
+ * Drop the buffered guest properties and wait for a running flush to complete
+ */
+void VBoxSession::discardProperties() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> flushLock( this->flushMutex );
+    boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+    this->unsyncedProperties.clear();
+    boost::thread * thread = this->flushThread;
+    this->flushThread = NULL;
+    lock.unlock();
+    flushLock.unlock();
+    
+    /* The flusher exits without doing anything, since the buffer is empty */
+    if (thread != NULL) {
+        thread->join();
+        delete thread;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Background flusher: Let the writes accumulate for a while, then flush them
+ */
+void VBoxSession::flushLoop() {
+    CRASH_REPORT_BEGIN;
+    for (;;) {
+        sleepMs( VBOX_PROPERTY_FLUSH_DELAY );
+        int ans = this->flushProperties();
         
-        /* Check if we have DHCP enabled on this interface */
-        bool hasDHCP = false;
-        for (vector< map<string, string> >::iterator i = dhcps.begin(); i != dhcps.end(); i++) {
-            map<string, string> dhcp = *i;
-            if (dhcp.find("NetworkName") == dhcp.end()) continue;
-            if (dhcp.find("Enabled") == dhcp.end()) continue;
-
-            CVMWA_LOG("log", "Checking dhcp");
-            mapDump(dhcp);
-            
-            /* The network has a DHCP server, check if it's running */
-            if (vboxName.compare(dhcp["NetworkName"]) == 0) {
-                if (dhcp["Enabled"].compare("Yes") == 0) {
-                    hasDHCP = true;
-                    break;
-                    
-                } else {
-                    
-                    /* Make sure the server does not have an invalid IP address */
-                    bool updateIPInfo = false;
-                    if (dhcp["IP"].compare("0.0.0.0") == 0) updateIPInfo=true;
-                    if (dhcp["lowerIPAddress"].compare("0.0.0.0") == 0) updateIPInfo=true;
-                    if (dhcp["upperIPAddress"].compare("0.0.0.0") == 0) updateIPInfo=true;
-                    if (dhcp["NetworkMask"].compare("0.0.0.0") == 0) updateIPInfo=true;
-                    if (updateIPInfo) {
-                        
-                        /* Prepare IP addresses */
-                        ipServer = changeUpperIP( iface["IPAddress"], 100 );
-                        ipMin = changeUpperIP( iface["IPAddress"], 101 );
-                        ipMax = changeUpperIP( iface["IPAddress"], 254 );
-                    
-                        /* Modify server */
-                        ans = this->wrapExec(
-                            "dhcpserver modify --ifname \"" + ifName + "\"" +
-                            " --ip " + ipServer +
-                            " --netmask " + iface["NetworkMask"] +
-                            " --lowerip " + ipMin +
-                            " --upperip " + ipMax
-                             , NULL, NULL, 2);
-                        if (ans != 0) continue;
-                    
-                    }
-                    
-                    /* Check if we can enable the server */
-                    ans = this->wrapExec("dhcpserver modify --ifname \"" + ifName + "\" --enable", NULL);
-                    if (ans == 0) {
-                        hasDHCP = true;
-                        break;
-                    }
-                    
-                }
-            }
-        }
-        
-        /* Keep the information of the first interface found */
-        if (foundIface.empty()) {
-            foundIface = ifName;
-            foundVBoxName = vboxName;
-            foundBaseIP = iface["IPAddress"];
-            foundMask = iface["NetworkMask"];
-        }
-        
-        /* If we found DHCP we are done */
-        if (hasDHCP) {
-            foundDHCPServer = true;
-            break;
-        }
-        
-    }
-    
-    /* If there was no DHCP server, create one */
-    if (!foundDHCPServer) {
-        
-        /* Prepare IP addresses */
-        ipServer = changeUpperIP( foundBaseIP, 100 );
-        ipMin = changeUpperIP( foundBaseIP, 101 );
-        ipMax = changeUpperIP( foundBaseIP, 254 );
-        
-        /* Add and start server */
-        ans = this->wrapExec(
-            "dhcpserver add --ifname \"" + foundIface + "\"" +
-            " --ip " + ipServer +
-            " --netmask " + foundMask +
-            " --lowerip " + ipMin +
-            " --upperip " + ipMax +
-            " --enable"
-             , NULL);
-        if (ans != 0) return "";
-                
-    }
-    
-    /* Got my interface */
-    return foundIface;
-    CRASH_REPORT_END;
-};
-
-/**
- * Return a property from the VirtualBox guest
- */
-std::string VBoxSession::getProperty( std::string name, bool forceUpdate ) { 
-    CRASH_REPORT_BEGIN;
-    vector<string> lines;
-    string value;
-    
-    /* If we have properties map populated, pick the entry from there */
-    if (!this->properties.empty() && !forceUpdate) {
-        
-        /* Check for property in properties map */
-        if (this->properties.find(name) == this->properties.end()) {
-            
-            /* Check in unsyncedProperties too */
-            if (this->unsyncedProperties.find(name) == this->unsyncedProperties.end()) {
-                return "";
-            } else {
-                return this->unsyncedProperties[name];
-            }
-            
-        } else {
-            return this->properties[name];
-        }
-    }
-    
-    /* Invoke property query */
-    int ans = this->wrapExec("guestproperty get "+this->uuid+" \""+name+"\"", &lines, NULL, 2, 2000);
-    if (ans != 0) return "";
-    if (lines.empty()) return "";
-    
-    /* Process response */
-    value = lines[0];
-    if (value.substr(0,6).compare("Value:") == 0) {
-        return value.substr(7);
-    } else {
-        return "";
-    }
-    
-    CRASH_REPORT_END;
-}
-
-/**
- * Set a property to the VirtualBox guest
- */
-int VBoxSession::setProperty( std::string name, std::string value ) { 
-    CRASH_REPORT_BEGIN;
-    vector<string> lines;
-    
-    /* This is valid only in mutable state */
-    if (!this->editable) {
-        
-        /* Store to unsyncedProperties and hope it gets picked */
-        this->unsyncedProperties[name] = value;
-        return HVE_INVALID_STATE;
-    }
-    
-    /* Perform property update */
-    int ans = this->wrapExec("guestproperty set "+this->uuid+" \""+name+"\" \""+value+"\"", &lines, NULL, 4, 2000);
-    if (ans != 0) return HVE_MODIFY_ERROR;
-    return 0;
-    
-    CRASH_REPORT_END;
-}
+        /* Continue only if more writes arrived while flushing */
+        boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+        if ((ans != HVE_OK) || this->unsyncedProperties.empty()) {
+            this->flushActive = false;
+            return;
+        }
+    }
+    CRASH_REPORT_END;
+}
 
 /**
  * Send a controlVM something
@@ -1652,7 +1792,11 @@ int VBoxSession::controlVM( std::string how, int timeout ) {
 int VBoxSession::startVM() {
     CRASH_REPORT_BEGIN;
     int ans = this->wrapExec("startvm "+this->uuid+" --type headless", NULL, NULL, 4);
-    if (ans != 0) return HVE_CONTROL_ERROR;
+    if (ans != 0) {
+        /* The host-only adapter might be gone */
+        if ((this->flags & HVF_DUAL_NIC) != 0) this->host->hostOnlyInvalidate();
+        return HVE_CONTROL_ERROR;
+    }
 
     /* Check for daemon need */
     this->host->checkDaemonNeed();
@@ -1663,20 +1807,12 @@ int VBoxSession::startVM() {
 /** 
  * Return virtual machine information
  */
-map<string, string> VBoxSession::getMachineInfo(int timeout) {
+int VBoxSession::getMachineInfo( VBOX_VMINFO * info, int timeout ) {
     CRASH_REPORT_BEGIN;
-    vector<string> lines;
-    map<string, string> dat;
-    
-    /* Perform property update */
-    int ans = this->wrapExec("showvminfo "+this->uuid, &lines, NULL, 4, timeout);
-    if (ans != 0) {
-        dat[":ERROR:"] = ntos<int>( ans );
-        return dat;
-    }
-    
-    /* Tokenize response */
-    return tokenize( &lines, ':' );
+    if (this->onDebug) (this->onDebug)("Executing 'showvminfo "+this->uuid+" --machinereadable'");
+    int ans = this->host->getMachineInfo( this->uuid, info, timeout );
+    if (this->onDebug) (this->onDebug)("return = " + ntos<int>( ans ));
+    return ans;
     CRASH_REPORT_END;
 };
 
@@ -1721,7 +1857,7 @@ std::string VBoxSession::getAPIHost() {
 
         // (1) The API Host is on the second interface
         if (this->ip.empty()) {
-            std::string guestIP = this->getProperty("/VirtualBox/GuestInfo/Net/1/V4/IP", true);
+            std::string guestIP = this->getProperty("/VirtualBox/GuestInfo/Net/1/V4/IP", !this->isWatching());
             if (!guestIP.empty()) {
                 this->ip = guestIP;
                 return guestIP;
@@ -1772,22 +1908,180 @@ std::string VBoxSession::getExtraInfo( int extraInfo ) {
 
     if (extraInfo == EXIF_VIDEO_MODE) {
         CVMWA_LOG("Debug", "Getting video mode")
-        map<string, string> info = this->getMachineInfo( 2000 );
-        
-        for (std::map<string, string>::iterator it=info.begin(); it!=info.end(); ++it) {
-            string pname = (*it).first;
-            string pvalue = (*it).second;
-            CVMWA_LOG("Debug", "getMachineInfo(): '" << pname << "' = '" << pvalue << "'");
+        VBOX_VMINFO info;
+        if (this->getMachineInfo( &info, 2000 ) == HVE_OK) {
+            CVMWA_LOG("Debug", "getMachineInfo(): Video mode = '" << info.videoMode << "'");
+            return info.videoMode;
         }
-        
-        if (info.find("Video mode") != info.end())
-            return info["Video mode"];
     }
 
     return "";
     CRASH_REPORT_END;
 }
 
+/**
+ * Start watching the guest properties of the (running) VM, unless we already do
+ */
+void VBoxSession::watchStart() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->watchMutex );
+    if (this->watchActive) return;
+    
+    /* Release the previous (finished) watcher */
+    if (this->watchThread != NULL) {
+        this->watchThread->join();
+        delete this->watchThread;
+    }
+    
+    CVMWA_LOG("Debug", "Starting property watcher for " << this->uuid);
+    this->watchActive = true;
+    this->watchStopped = false;
+    this->watchAbort.reset();
+    this->watchThread = new boost::thread( boost::bind( &VBoxSession::watchLoop, this ) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the property watcher and wait for it to exit
+ */
+void VBoxSession::watchStop() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->watchMutex );
+    boost::thread * thread = this->watchThread;
+    if (thread == NULL) return;
+    this->watchStopped = true;
+    this->watchThread = NULL;
+    
+    /* Kill the pending 'guestproperty wait' */
+    this->watchAbort.abort();
+    lock.unlock();
+    
+    thread->join();
+    delete thread;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the property cache is kept up to date by the watcher
+ */
+bool VBoxSession::isWatching() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->watchMutex );
+    return this->watchActive && !this->watchStopped;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return a copy of the property cache
+ */
+std::map<std::string, std::string> VBoxSession::getProperties() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+    return this->properties;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Merge the given properties into the property cache and fire onProperty for
+ * the ones that changed. If complete is true, the properties missing from
+ * the given map are removed from the cache.
+ */
+void VBoxSession::applyProperties( const std::map<std::string, std::string> & props, bool complete ) {
+    CRASH_REPORT_BEGIN;
+    vector< pair<string, string> > changes;
+    
+    /* Update the cache */
+    boost::unique_lock<boost::mutex> lock( this->propertiesMutex );
+    for (map<string, string>::const_iterator it = props.begin(); it != props.end(); ++it) {
+        map<string, string>::iterator prev = this->properties.find( (*it).first );
+        if ((prev == this->properties.end()) || ((*prev).second != (*it).second)) {
+            this->properties[(*it).first] = (*it).second;
+            changes.push_back( *it );
+        }
+    }
+    if (complete) {
+        for (map<string, string>::iterator it = this->properties.begin(); it != this->properties.end(); ) {
+            if (props.find( (*it).first ) == props.end()) {
+                changes.push_back( pair<string, string>( (*it).first, "" ) );
+                this->properties.erase( it++ );
+            } else {
+                ++it;
+            }
+        }
+    }
+    lock.unlock();
+    
+    /* Notify */
+    for (vector< pair<string, string> >::iterator it = changes.begin(); it != changes.end(); ++it) {
+        CVMWA_LOG("Debug", "Property " << (*it).first << " of " << this->uuid << " changed to '" << (*it).second << "'");
+        
+        /* The guest IP of the dual-NIC mode */
+        if (((this->flags & HVF_DUAL_NIC) != 0) && ((*it).first == "/VirtualBox/GuestInfo/Net/1/V4/IP"))
+            this->ip = (*it).second;
+        
+        if (this->onProperty) (this->onProperty)( (*it).first, (*it).second );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Property watcher thread: Block on 'guestproperty wait' and apply the
+ * changes it reports. Since changes made between two waits are not reported,
+ * the cache is re-synchronized with 'guestproperty enumerate' after every wait.
+ */
+void VBoxSession::watchLoop() {
+    CRASH_REPORT_BEGIN;
+    string err;
+    int failures = 0;
+    int timeout = VBOX_WATCH_TIMEOUT;
+    
+    while (!this->watchStopped) {
+        
+        /* (Re-)synchronize the property cache */
+        OutputParser output;
+        if (this->host->execParsed( "guestproperty enumerate "+this->uuid, &output, &err, 1, 2000 ) == 0)
+            this->applyProperties( __parseGuestProperties( output ), true );
+        if (this->watchStopped) break;
+        
+        /* Wait for the next change. This is a long-lived command, so it doesn't
+           go through the exec queue of the hypervisor. */
+        output.reset();
+        int ans = sysExecParsed( this->host->hvBinary, "guestproperty wait "+this->uuid+" \"*\" --timeout "+ntos<int>( timeout ), 
+                                 &output, &err, 1, VBOX_WATCH_TIMEOUT + 5000, NULL, &this->watchAbort );
+        if (this->watchStopped) break;
+        
+        if (ans == 0) {
+            
+            /* Apply the change right away */
+            failures = 0;
+            this->applyProperties( __parseGuestProperties( output ), false );
+            
+        } else if ((output.size() == 0) && (err.find( VBOX_WATCH_TIMEDOUT ) != string::npos)) {
+            
+            /* Nothing changed within the timeout */
+            failures = 0;
+            
+        } else {
+            
+            /* Give up only if the VM is not running any more */
+            CVMWA_LOG("Debug", "Property watcher of " << this->uuid << " failed (" << ans << ")");
+            if (this->host->isRunning( this->uuid )) {
+                failures = 0;
+            } else if (++failures >= VBOX_WATCH_FAILURES) {
+                break;
+            }
+            sleepMs( 1000 );
+            
+        }
+        
+    }
+    
+    CVMWA_LOG("Debug", "Property watcher of " << this->uuid << " exited");
+    boost::unique_lock<boost::mutex> lock( this->watchMutex );
+    this->watchActive = false;
+    CRASH_REPORT_END;
+}
+
 /** =========================================== **\
             Virtualbox Implementation
 \** =========================================== **/
@@ -1795,24 +2089,83 @@ std::string VBoxSession::getExtraInfo( int extraInfo ) {
 /** 
  * Return virtual machine information
  */
-map<string, string> Virtualbox::getMachineInfo( std::string uuid, int timeout ) {
+int Virtualbox::getMachineInfo( std::string uuid, VBOX_VMINFO * info, int timeout ) {
     CRASH_REPORT_BEGIN;
-    vector<string> lines;
-    map<string, string> dat;
+    OutputParser output( '=' );
     string err;
     
+    /* Reset info */
+    info->name = "";
+    info->osType = "";
+    info->configFile = "";
+    info->logFolder = "";
+    info->state = "";
+    info->memory = 0;
+    info->cpus = 1;
+    info->executionCap = 100;
+    info->vrdeEnabled = false;
+    info->vrdePort = 0;
+    info->videoMode = "";
+    info->controllers.clear();
+    info->media.clear();
+    info->natRules.clear();
+    info->snapshot = "";
+    
     /* Perform property update */
     int ans;
-    NAMED_MUTEX_LOCK( uuid );
-    ans = this->exec("showvminfo "+uuid, &lines, &err, 4, timeout );
+    NAMED_MUTEX_LOCK_SHARED( uuid );
+    ans = this->execParsed("showvminfo "+uuid+" --machinereadable", &output, &err, 4, timeout );
     NAMED_MUTEX_UNLOCK;
-    if (ans != 0) {
-        dat[":ERROR:"] = ntos<int>( ans );
-        return dat;
+    if (ans != 0) return HVE_IO_ERROR;
+    if (output.size() == 0) return HVE_NOT_FOUND;
+    
+    /* Process the key="value" pairs */
+    string key, value, vrdePorts;
+    for (size_t i = 0; i < output.size(); i++) {
+        key = __unquote( output.key(i) );
+        value = __unquote( output.value(i) );
+        
+        if (key == "name") {
+            info->name = value;
+        } else if (key == "ostype") {
+            info->osType = value;
+        } else if (key == "CfgFile") {
+            info->configFile = value;
+        } else if (key == "LogFldr") {
+            info->logFolder = value;
+        } else if (key == "VMState") {
+            info->state = value;
+        } else if (key == "memory") {
+            info->memory = ston<int>( value );
+        } else if (key == "cpus") {
+            info->cpus = ston<int>( value );
+        } else if (key == "cpuexecutioncap") {
+            info->executionCap = ston<int>( value );
+        } else if (key == "vrde") {
+            info->vrdeEnabled = (value == "on");
+        } else if ((key == "vrdeports") || ((key == "vrdeport") && vrdePorts.empty())) {
+            vrdePorts = value;
+        } else if (key == "VideoMode") {
+            /* ex. VideoMode="1024,768,32"@0,0 1 */
+            info->videoMode = value;
+            std::replace( info->videoMode.begin(), info->videoMode.end(), ',', 'x' );
+        } else if (key.find("storagecontrollername") == 0) {
+            info->controllers.push_back( value );
+        } else if (key.find("Forwarding(") == 0) {
+            info->natRules.push_back( value );
+        } else if (key == "CurrentSnapshotName") {
+            info->snapshot = value;
+        } else if ((std::count( key.begin(), key.end(), '-' ) == 2) && (value != "none") && (value != "emptydrive")) {
+            /* Attached medium, ex. "SATA-0-0"="/path/to/disk.vdi" */
+            info->media[ key ] = value;
+        }
     }
     
-    /* Tokenize response */
-    return tokenize( &lines, ':' );
+    /* The first port of the (possibly comma-separated) VRDE port list */
+    if (info->vrdeEnabled && !vrdePorts.empty())
+        info->vrdePort = ston<int>( vrdePorts.substr( 0, vrdePorts.find(',') ) );
+    
+    return HVE_OK;
     CRASH_REPORT_END;
 };
 
@@ -1822,36 +2175,13 @@ map<string, string> Virtualbox::getMachineInfo( std::string uuid, int timeout )
 map<string, string> Virtualbox::getAllProperties( string uuid ) {
     CRASH_REPORT_BEGIN;
     map<string, string> ans;
-    vector<string> lines;
+    OutputParser output;
     string errOut;
 
     /* Get guest properties */
-    NAMED_MUTEX_LOCK( uuid );
-    if (this->exec( "guestproperty enumerate "+uuid, &lines, &errOut, 4, 2000 ) == 0) {
-        for (vector<string>::iterator it = lines.begin(); it < lines.end(); it++) {
-            string line = *it;
-
-            /* Find the anchor locations */
-            size_t kBegin = line.find("Name: ");
-            if (kBegin == string::npos) continue;
-            size_t kEnd = line.find(", value:");
-            if (kEnd == string::npos) continue;
-            size_t vEnd = line.find(", timestamp:");
-            if (vEnd == string::npos) continue;
-
-            /* Get key */
-            kBegin += 6;
-            string vKey = line.substr( kBegin, kEnd - kBegin );
-
-            /* Get value */
-            size_t vBegin = kEnd + 9;
-            string vValue = line.substr( vBegin, vEnd - vBegin );
-
-            /* Store values */
-            ans[vKey] = vValue;
-
-        }
-    }
+    NAMED_MUTEX_LOCK_SHARED( uuid );
+    if (this->execParsed( "guestproperty enumerate "+uuid, &output, &errOut, 4, 2000 ) == 0)
+        ans = __parseGuestProperties( output );
     NAMED_MUTEX_UNLOCK;
 
     return ans;
@@ -1902,7 +2232,7 @@ std::string Virtualbox::getProperty( std::string uuid, std::string name ) {
     
     /* Invoke property query */
     int ans;
-    NAMED_MUTEX_LOCK( uuid );
+    NAMED_MUTEX_LOCK_SHARED( uuid );
     ans = this->exec("guestproperty get "+uuid+" \""+name+"\"", &lines, &err, 2, 2000);
     NAMED_MUTEX_UNLOCK;
     if (ans != 0) return "";
@@ -1919,6 +2249,17 @@ std::string Virtualbox::getProperty( std::string uuid, std::string name ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Wait for the pool refill thread to finish its current VM
+ */
+Virtualbox::~Virtualbox() {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->poolMutex );
+    this->poolStop = true;
+    while (this->poolBusy) this->poolCond.wait( lock );
+    CRASH_REPORT_END;
+}
+
 /**
  * Return Virtualbox sessions instead of classic
  */
@@ -1934,6 +2275,11 @@ HVSession * Virtualbox::allocateSession( std::string name, std::string key ) {
     sess->properties.clear();
     sess->unsyncedProperties.clear();
     sess->updateLock = false;
+    sess->updateCache.valid = false;
+    sess->updateCache.properties = false;
+    sess->updateCache.diskSize = 0;
+    sess->updateCache.pidLogTime = 0;
+    sess->updateCache.pid = 0;
     return sess;
     CRASH_REPORT_END;
 }
@@ -1945,14 +2291,11 @@ int Virtualbox::getCapabilities ( HVINFO_CAPS * caps ) {
     CRASH_REPORT_BEGIN;
     map<string, string> data;
     vector<string> lines, parts;
-    string err;
     int v;
     
     /* List the CPUID information */
     int ans;
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list hostcpuids", &lines, &err, 2);
-    NAMED_MUTEX_UNLOCK;
+    ans = this->listCached("hostcpuids", &lines);
     if (ans != 0) return HVE_QUERY_ERROR;
     if (lines.empty()) return HVE_EXTERNAL_ERROR;
     
@@ -2005,9 +2348,7 @@ int Virtualbox::getCapabilities ( HVINFO_CAPS * caps ) {
         ( (caps->cpu.featuresC & 0x20000000) != 0 ); // Long mode 'lm'
         
     /* List the system properties */
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list systemproperties", &lines, &err, 2);
-    NAMED_MUTEX_UNLOCK;
+    ans = this->listCached("systemproperties", &lines);
     if (ans != 0) return HVE_QUERY_ERROR;
     if (lines.empty()) return HVE_EXTERNAL_ERROR;
 
@@ -2025,6 +2366,19 @@ int Virtualbox::getCapabilities ( HVINFO_CAPS * caps ) {
     if (data.find("Maximum guest CPU count") != data.end()) 
         caps->max.cpus = ston<int>(data["Maximum guest CPU count"]);
     
+    /* The physical resources of the host (optional) */
+    caps->host.cpus = 0;
+    caps->host.memory = 0;
+    caps->host.disk = 0;
+    data.clear();
+    if ((this->listCached("hostinfo", &lines) == 0) && !lines.empty()) {
+        parseLines( &lines, &data, ":", " \t", 0, 1 );
+        if (data.find("Processor count") != data.end()) 
+            caps->host.cpus = ston<int>(data["Processor count"]);
+        if (data.find("Memory size") != data.end()) 
+            caps->host.memory = ston<int>(data["Memory size"]); // ex. "16384 MByte"
+    }
+    
     /* Ok! */
     return HVE_OK;
     CRASH_REPORT_END;
@@ -2037,13 +2391,10 @@ std::vector< std::map< std::string, std::string > > Virtualbox::getDiskList() {
     CRASH_REPORT_BEGIN;
     vector<string> lines;
     std::vector< std::map< std::string, std::string > > resMap;
-    string err;
 
     /* List the running VMs in the system */
     int ans;
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list hdds", &lines, &err, 2, 2000);
-    NAMED_MUTEX_UNLOCK;
+    ans = this->listCached("hdds", &lines, 2000);
     if (ans != 0) return resMap;
     if (lines.empty()) return resMap;
 
@@ -2054,45 +2405,1300 @@ std::vector< std::map< std::string, std::string > > Virtualbox::getDiskList() {
 }
 
 /**
- * Parse VirtualBox Log file in order to get the launched process PID
+ * Return the output of 'VBoxManage list <listing>', re-using the
+ * previous output if it's not older than VBOX_LIST_CACHE_TTL
  */
-int __getPIDFromFile( std::string logPath ) {
-    int pid = 0;
-
-    /* Locate Logfile */
-    string logFile = logPath + "/VBox.log";
-    CVMWA_LOG("Debug", "Looking for PID in " << logFile );
-    if (!file_exists(logFile)) return 0;
-
-    /* Open input stream */
-    ifstream fIn(logFile.c_str(), ifstream::in);
+int Virtualbox::listCached( std::string listing, std::vector<std::string> * lines, int timeout, int ttl ) {
+    CRASH_REPORT_BEGIN;
+    long generation;
     
-    /* Read as few bytes as possible */
-    string inBufferLine;
-    size_t iStart, iEnd, i1, i2;
-    char inBuffer[1024];
-    while (!fIn.eof()) {
-
-        // Read line
-        fIn.getline( inBuffer, 1024 );
-
-        // Handle it via higher-level API
-        inBufferLine.assign( inBuffer );
-        if ((iStart = inBufferLine.find("Process ID:")) != string::npos) {
-
-            // Pick the appropriate ending
-            iEnd = inBufferLine.length();
-            i1 = inBufferLine.find("\r");
-            i2 = inBufferLine.find("\n");
-            if (i1 < iEnd) iEnd=i1;
-            if (i2 < iEnd) iEnd=i2;
-
-            // Extract string
-            inBufferLine = inBufferLine.substr( iStart+12, iEnd-iStart );
-
-            // Convert to integer
-            pid = ston<int>( inBufferLine );
-            break;
+    /* Check the cache */
+    {
+        boost::unique_lock<boost::mutex> lock( this->listCacheMutex );
+        std::map< std::string, VBOX_LIST_CACHE >::iterator it = this->listCache.find( listing );
+        if ((it != this->listCache.end()) && ((getMillis() - (*it).second.timestamp) < ttl)) {
+            *lines = (*it).second.lines;
+            return HVE_OK;
+        }
+        generation = this->listCacheGeneration;
+    }
+    
+    /* Fetch the listing */
+    VBOX_LIST_CACHE entry;
+    string err;
+    int ans;
+    entry.timestamp = getMillis();
+    NAMED_MUTEX_LOCK_SHARED("generic");
+    ans = this->exec("list " + listing, &entry.lines, &err, 2, timeout);
+    NAMED_MUTEX_UNLOCK;
+    *lines = entry.lines;
+    if (ans != 0) return ans;
+    
+    /* Store it, unless something was invalidated while we were fetching it */
+    {
+        boost::unique_lock<boost::mutex> lock( this->listCacheMutex );
+        if (generation == this->listCacheGeneration)
+            this->listCache[listing] = entry;
+    }
+    
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Drop the cached output of the given listing
+ */
+void Virtualbox::listInvalidate( std::string listing ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->listCacheMutex );
+    this->listCache.erase( listing );
+    this->listCacheGeneration++;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Drop the cached listings that can be affected by the given command
+ */
+void Virtualbox::listInvalidateBy( std::string cmd ) {
+    CRASH_REPORT_BEGIN;
+    string name = hypervisorCommand( cmd );
+    if (name == "hostonlyif create") {
+        this->listInvalidate( "hostonlyifs" );
+        this->listInvalidate( "dhcpservers" );
+    } else if ((name == "dhcpserver add") || (name == "dhcpserver modify")) {
+        this->listInvalidate( "dhcpservers" );
+    } else if ((name == "storageattach") || (name == "closemedium")) {
+        this->listInvalidate( "hdds" );
+    } else if (name == "unregistervm") {
+        this->listInvalidate( "hdds" );
+        this->listInvalidate( "runningvms" );
+    } else if ((name == "startvm") || (name == "controlvm") || (name == "discardstate")) {
+        this->listInvalidate( "runningvms" );
+    } else if (name.substr(0,8) == "extpack ") {
+        this->listInvalidate( "extpacks" );
+    } else if ((name == "registervm") || (name == "clonevm")) {
+        this->registryInvalidate();
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create a new VM with the given name as a linked clone of the template VM for the given
+ * CernVM version, scratch disk size and flags, building the template first if needed.
+ * The clone has its scratch disk and CernVM CD-ROM attached, but the rest of the session
+ * parameters must still be applied to it. On error nothing is registered under the given name.
+ */
+int Virtualbox::templateClone( std::string name, std::string cvmVersion, int disk, int flags, std::string * uuid, callbackProgress progress ) {
+    CRASH_REPORT_BEGIN;
+    ostringstream args;
+    string tmplUUID, vmIso, err;
+    int ans;
+    
+    /* The template is identified by everything that goes in it */
+    string tmplName = VBOX_TEMPLATE_PREFIX + this->templateKey( cvmVersion, disk, flags );
+    
+    /* Find the verified template, or the lock that serializes its build */
+    boost::shared_ptr<boost::mutex> buildMutex;
+    {
+        boost::unique_lock<boost::mutex> lock( this->templateMutex );
+        map<string, string>::iterator it = this->templates.find( tmplName );
+        if (it != this->templates.end()) {
+            tmplUUID = (*it).second;
+        } else {
+            boost::shared_ptr<boost::mutex> & m = this->templateLocks[tmplName];
+            if (!m) m = boost::make_shared<boost::mutex>();
+            buildMutex = m;
+        }
+    }
+    
+    /* Check the template, or build it (concurrent opens of the same template wait for the same build) */
+    if (tmplUUID.empty()) {
+        boost::unique_lock<boost::mutex> buildLock( *buildMutex );
+        ans = this->templateCheck( tmplName, &tmplUUID );
+        if (ans == HVE_NOT_FOUND) {
+            
+            /* Download CernVM without holding the build lock (the image is shared by all the templates of this version) */
+            buildLock.unlock();
+            ProgressFeedback feedback;
+            feedback.total = 110;
+            feedback.min = 5;
+            feedback.max = 85;
+            feedback.callback = progress;
+            feedback.message = "Downloading CernVM";
+            if (progress) (progress)(5, 110, "Downloading CernVM");
+            NAMED_MUTEX_LOCK( "cernvm-" + cvmVersion );
+            ans = this->cernVMDownload( cvmVersion, &vmIso, &feedback );
+            NAMED_MUTEX_UNLOCK;
+            if (ans != HVE_OK) return ans;
+            
+            /* It might have been built in the meantime */
+            buildLock.lock();
+            ans = this->templateCheck( tmplName, &tmplUUID );
+            if (ans == HVE_NOT_FOUND)
+                ans = this->templateBuild( tmplName, vmIso, disk, flags, &tmplUUID, progress );
+            
+        }
+        if (ans != HVE_OK) return ans;
+        
+        boost::unique_lock<boost::mutex> lock( this->templateMutex );
+        this->templates[tmplName] = tmplUUID;
+    }
+    
+    /* Create a linked clone of its snapshot (clones of the same template are serialized) */
+    if (progress) (progress)(9, 110, "Cloning VM template");
+    args.str("");
+    args << "clonevm " << tmplUUID
+        << " --snapshot "   << VBOX_TEMPLATE_SNAPSHOT
+        << " --options "    << "link"
+        << " --name "       << "\"" << name << "\""
+        << " --register";
+    NAMED_MUTEX_LOCK( tmplUUID );
+    ans = this->exec( args.str(), NULL, &err, 1 );
+    this->listInvalidateBy( args.str() );
+    NAMED_MUTEX_UNLOCK;
+    if (ans != 0) {
+        /* Check the template again the next time */
+        boost::unique_lock<boost::mutex> lock( this->templateMutex );
+        this->templates.erase( tmplName );
+        return HVE_CREATE_ERROR;
+    }
+    
+    /* Get the UUID of the clone */
+    if (this->registryLookup( name, uuid ) != HVE_OK) return HVE_QUERY_ERROR;
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the part of the template VM name that identifies what goes in it
+ */
+std::string Virtualbox::templateKey( std::string cvmVersion, int disk, int flags ) {
+    CRASH_REPORT_BEGIN;
+    ostringstream args;
+    args << cvmVersion << "-" << (flags & VBOX_TEMPLATE_FLAGS) << "-" << disk;
+    string key = args.str();
+    for (size_t i = 0; i < key.length(); i++)
+        if (!isalnum( key[i] ) && (key[i] != '.') && (key[i] != '-')) key[i] = '_';
+    return key;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Look up the template VM with the given name. A template without its snapshot was not
+ * completely built: It is deleted if its settings were last modified more than
+ * VBOX_TEMPLATE_BUILD_TIME seconds ago, otherwise another process is probably still building
+ * it and HVE_STILL_WORKING is returned. Returns HVE_NOT_FOUND if it has to be built
+ * (the caller must hold the build lock of the template)
+ */
+int Virtualbox::templateCheck( std::string name, std::string * uuid ) {
+    CRASH_REPORT_BEGIN;
+    VBOX_VMINFO info;
+    string err;
+    int ans;
+    
+    ans = this->registryLookup( name, uuid );
+    if (ans != HVE_OK) return ans;
+    if (this->getMachineInfo( *uuid, &info, 2000 ) != HVE_OK) return HVE_QUERY_ERROR;
+    if (info.snapshot == VBOX_TEMPLATE_SNAPSHOT) return HVE_OK;
+    
+    /* Don't pull it from under whoever is building it */
+    time_t modified = info.configFile.empty() ? 0 : getFileModified( info.configFile );
+    if (time( NULL ) - modified < VBOX_TEMPLATE_BUILD_TIME) {
+        CVMWA_LOG( "Info", "Template " << name << " is incomplete, but it is still being built" );
+        return HVE_STILL_WORKING;
+    }
+    
+    CVMWA_LOG( "Info", "Template " << name << " is incomplete, re-building it" );
+    time_t registryTime = this->registryModified();
+    this->exec( "unregistervm " + *uuid + " --delete", NULL, &err, 2 );
+    this->listInvalidateBy( "unregistervm" );
+    this->registryRemove( *uuid, registryTime );
+    *uuid = "";
+    return HVE_NOT_FOUND;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Build a template VM: A VM with the storage controllers, a blank scratch disk and the
+ * given CernVM CD-ROM attached and a snapshot of this state (the caller must hold the
+ * build lock of the template)
+ */
+int Virtualbox::templateBuild( std::string name, std::string vmIso, int disk, int flags, std::string * uuid, callbackProgress progress ) {
+    CRASH_REPORT_BEGIN;
+    ostringstream args;
+    string vmDisk;
+    int ans;
+    CVMWA_LOG( "Info", "Building template " << name );
+    
+    /* Use a session object for building it, since it's just another VM */
+    VBoxSession * tmpl = (VBoxSession *)this->allocateSession( name, "" );
+    
+    /* (1) Create the VM with its storage controllers */
+    ans = tmpl->getMachineUUID( name, uuid, flags & VBOX_TEMPLATE_FLAGS );
+    if (ans != 0) {
+        this->freeSession( tmpl );
+        return ans;
+    }
+    tmpl->uuid = *uuid;
+    
+    /* (2) Create and attach the blank scratch disk */
+    vmDisk = getTmpFile(".vdi", tmpl->getDataFolder());
+    args << "createhd"
+        << " --filename "   << "\"" << vmDisk << "\""
+        << " --size "       << disk;
+    ans = tmpl->wrapExec(args.str(), NULL);
+    if (ans == 0) {
+        args.str("");
+        args << "storageattach "
+            << *uuid
+            << " --storagectl " << SCRATCH_CONTROLLER
+            << " --port "       << SCRATCH_PORT
+            << " --device "     << SCRATCH_DEVICE
+            << " --type "       << "hdd"
+            << " --setuuid "    << "\"\""
+            << " --medium "     << "\"" << vmDisk << "\"";
+        ans = tmpl->wrapExec(args.str(), NULL);
+    }
+    
+    /* (3) Attach CernVM */
+    if (ans == 0) {
+        args.str("");
+        args << "storageattach "
+            << *uuid
+            << " --storagectl " << BOOT_CONTROLLER
+            << " --port "       << BOOT_PORT
+            << " --device "     << BOOT_DEVICE
+            << " --type "       << "dvddrive"
+            << " --medium "     << "\"" << vmIso << "\"";
+        ans = tmpl->wrapExec(args.str(), NULL);
+    }
+    
+    /* (4) Attach the guest additions */
+    #ifdef GUESTADD_USE
+    if ((ans == 0) && ((flags & HVF_GUEST_ADDITIONS) != 0) && !this->hvGuestAdditions.empty()) {
+        args.str("");
+        args << "storageattach "
+            << *uuid
+            << " --storagectl " << GUESTADD_CONTROLLER
+            << " --port "       << GUESTADD_PORT
+            << " --device "     << GUESTADD_DEVICE
+            << " --type "       << "dvddrive"
+            << " --medium "     << "\"" << this->hvGuestAdditions << "\"";
+        ans = tmpl->wrapExec(args.str(), NULL);
+    }
+    #endif
+    
+    /* (5) Take the snapshot the clones are linked to */
+    if (ans == 0) {
+        if (progress) (progress)(85, 110, "Creating VM template");
+        ans = tmpl->wrapExec("snapshot " + *uuid + " take " VBOX_TEMPLATE_SNAPSHOT, NULL);
+    }
+    
+    /* Don't leave an incomplete template behind */
+    if (ans != 0) {
+        CVMWA_LOG( "Error", "Unable to build template " << name << " (" << ans << ")" );
+        time_t registryTime = this->registryModified();
+        tmpl->wrapExec("unregistervm " + *uuid + " --delete", NULL, NULL, 2);
+        this->registryRemove( *uuid, registryTime );
+        this->freeSession( tmpl );
+        return HVE_CREATE_ERROR;
+    }
+    
+    this->freeSession( tmpl );
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Claim a pre-created VM of the pool for a new session by renaming it to the given name.
+ * Its configuration is remembered, so that the next poolRefill() keeps the pool filled
+ * for it. Like templateClone(), the rest of the session parameters must still be applied
+ * to the VM. Returns HVE_NOT_FOUND if none was available.
+ */
+int Virtualbox::poolClaim( std::string name, std::string cvmVersion, int disk, int flags, int memory, std::string * uuid ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string> vms;
+    string err;
+    int ans;
+    if (this->poolSize <= 0) return HVE_NOT_FOUND;
+    
+    /* Keep the pool filled for this configuration */
+    string key = this->templateKey( cvmVersion, disk, flags );
+    {
+        boost::unique_lock<boost::mutex> lock( this->poolMutex );
+        VBOX_POOL_CONFIG * config = &this->poolConfigs[key];
+        config->cvmVersion = cvmVersion;
+        config->disk = disk;
+        config->flags = flags & VBOX_TEMPLATE_FLAGS;
+        config->memory = memory;
+        config->lastUsed = getMillis();
+    }
+    
+    /* Rename the first pool VM of this configuration. The VM is addressed by its pool
+       name, so if another process has claimed it meanwhile, this fails instead of
+       taking it over. */
+    ans = HVE_NOT_FOUND;
+    string prefix = VBOX_POOL_PREFIX + key + "-";
+    if (this->registryList( &vms ) == HVE_OK) {
+        for (map<string, string>::iterator it = vms.begin(); it != vms.end(); ++it) {
+            if ((*it).first.compare( 0, prefix.length(), prefix ) != 0) continue;
+            string vmUUID = (*it).second;
+            string cmd = "modifyvm \"" + (*it).first + "\" --name \"" + name + "\"";
+            time_t registryTime = this->registryModified();
+            NAMED_MUTEX_LOCK( vmUUID );
+            ans = this->exec( cmd, NULL, &err, 1 );
+            this->listInvalidateBy( cmd );
+            NAMED_MUTEX_UNLOCK;
+            if (ans == 0) {
+                CVMWA_LOG( "Info", "Claimed pool VM " << (*it).first << " for " << name );
+                this->registryAdd( name, vmUUID, registryTime );
+                *uuid = vmUUID;
+                ans = HVE_OK;
+            } else {
+                this->registryInvalidate();
+                ans = HVE_NOT_FOUND;
+            }
+            break;
+        }
+    }
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the number of pool VMs kept for each configuration, creating or deleting
+ * them in the background. The first call also deletes the pool VMs left behind,
+ * even if the pool is disabled.
+ */
+void Virtualbox::setPoolSize( int size ) {
+    CRASH_REPORT_BEGIN;
+    int previous = this->poolSize;
+    Hypervisor::setPoolSize( size );
+    {
+        boost::unique_lock<boost::mutex> lock( this->poolMutex );
+        if ((this->poolSize <= 0) && (this->poolSize >= previous) && this->poolChecked) return;
+        this->poolChecked = true;
+    }
+    this->poolSchedule();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fill the pool up, and delete the pool VMs that are not needed anymore, in the
+ * background (if the pool is enabled)
+ */
+void Virtualbox::poolRefill( ) {
+    CRASH_REPORT_BEGIN;
+    if (this->poolSize <= 0) return;
+    this->poolSchedule();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start the pool refill thread. If it's already running, it checks the pool
+ * once more when done.
+ */
+void Virtualbox::poolSchedule( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->poolMutex );
+    if (this->poolStop) return;
+    if (this->poolBusy) {
+        this->poolPending = true;
+        return;
+    }
+    this->poolBusy = true;
+    this->poolPending = false;
+    boost::thread t( boost::bind( &Virtualbox::poolRefillThread, this ) );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return how many pool VMs to keep for the given configuration: Up to poolSize, but
+ * no more than the VMs of its memory size the host could still run next to the sessions.
+ * Returns -1 if the host resources could not be queried.
+ */
+int Virtualbox::poolTarget( const VBOX_POOL_CONFIG & config ) {
+    CRASH_REPORT_BEGIN;
+    HVINFO_CAPS caps;
+    HVINFO_RES usage;
+    if ((this->poolSize <= 0) || (config.memory <= 0)) return 0;
+    if (this->getCapabilities( &caps ) != HVE_OK) return -1;
+    if (this->getUsage( &usage ) != HVE_OK) return -1;
+    
+    int slots = (caps.host.memory - VBOX_POOL_RESERVE - usage.memory) / config.memory;
+    if (slots > this->poolSize) slots = this->poolSize;
+    if (slots < 0) slots = 0;
+    return slots;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Delete the pool VMs beyond the number given for their configuration (a negative number
+ * keeps them all). The pool VMs of the other configurations are deleted if the pool is
+ * disabled, or else if they were created more than VBOX_POOL_IDLE_TIME seconds ago (until
+ * then another process might be keeping them). A pool VM is addressed by its pool name,
+ * so if a session claims it meanwhile, the deletion fails instead.
+ */
+void Virtualbox::poolTrim( const std::map<std::string, int> & targets ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string> vms;
+    map<string, int> kept;
+    string prefix = VBOX_POOL_PREFIX;
+    string err;
+    int ans;
+    if (this->registryList( &vms ) != HVE_OK) return;
+    
+    for (map<string, string>::iterator it = vms.begin(); it != vms.end(); ++it) {
+        string name = (*it).first, vmUUID = (*it).second;
+        if (name.compare( 0, prefix.length(), prefix ) != 0) continue;
+        size_t sep = name.rfind( '-' );
+        if ((sep == string::npos) || (sep <= prefix.length())) continue;
+        {
+            boost::unique_lock<boost::mutex> lock( this->poolMutex );
+            if (this->poolStop) break;
+        }
+        
+        /* Keep the first ones of the configurations in use */
+        string key = name.substr( prefix.length(), sep - prefix.length() );
+        map<string, int>::const_iterator target = targets.find( key );
+        if (target != targets.end()) {
+            if (((*target).second < 0) || (kept[key] < (*target).second)) {
+                kept[key]++;
+                continue;
+            }
+        } else if (this->poolSize > 0) {
+            VBOX_VMINFO info;
+            if (this->getMachineInfo( vmUUID, &info, 2000 ) != HVE_OK) continue;
+            time_t modified = info.configFile.empty() ? 0 : getFileModified( info.configFile );
+            if (time( NULL ) - modified < VBOX_POOL_IDLE_TIME) continue;
+        }
+        
+        CVMWA_LOG( "Info", "Deleting pool VM " << name );
+        string cmd = "unregistervm \"" + name + "\" --delete";
+        time_t registryTime = this->registryModified();
+        NAMED_MUTEX_LOCK( vmUUID );
+        ans = this->exec( cmd, NULL, &err, 1 );
+        this->listInvalidateBy( cmd );
+        NAMED_MUTEX_UNLOCK;
+        if (ans == 0) {
+            this->registryRemove( vmUUID, registryTime );
+        } else {
+            this->registryInvalidate();
+        }
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * The pool refill thread: Delete the pool VMs that are not needed anymore and create
+ * the missing ones of every configuration in use
+ */
+void Virtualbox::poolRefillThread( ) {
+    CRASH_REPORT_BEGIN;
+    HVExecPriority priority( HVP_BACKGROUND );
+    for (;;) {
+        
+        /* Pick the configurations to check, forgetting the ones no session was opened with lately */
+        map<string, VBOX_POOL_CONFIG> configs;
+        {
+            boost::unique_lock<boost::mutex> lock( this->poolMutex );
+            long now = getMillis();
+            for (map<string, VBOX_POOL_CONFIG>::iterator it = this->poolConfigs.begin(); it != this->poolConfigs.end(); ) {
+                if (now - (*it).second.lastUsed > VBOX_POOL_IDLE_TIME * 1000L) {
+                    this->poolConfigs.erase( it++ );
+                } else {
+                    ++it;
+                }
+            }
+            configs = this->poolConfigs;
+        }
+        
+        /* Delete the surplus pool VMs */
+        map<string, int> targets;
+        for (map<string, VBOX_POOL_CONFIG>::iterator it = configs.begin(); it != configs.end(); ++it)
+            targets[(*it).first] = this->poolTarget( (*it).second );
+        this->poolTrim( targets );
+        
+        /* Create the missing ones */
+        for (map<string, VBOX_POOL_CONFIG>::iterator it = configs.begin(); it != configs.end(); ++it) {
+            string prefix = VBOX_POOL_PREFIX + (*it).first + "-";
+            int target = targets[(*it).first];
+            
+            for (;;) {
+                {
+                    boost::unique_lock<boost::mutex> lock( this->poolMutex );
+                    if (this->poolStop) break;
+                }
+                
+                /* Count the pool VMs of this configuration */
+                map<string, string> vms;
+                if (this->registryList( &vms ) != HVE_OK) break;
+                int count = 0;
+                for (map<string, string>::iterator vm = vms.begin(); vm != vms.end(); ++vm)
+                    if ((*vm).first.compare( 0, prefix.length(), prefix ) == 0) count++;
+                if (count >= target) break;
+                
+                /* Create the next one under a free name */
+                string name, uuid;
+                for (int i = 0; ; i++) {
+                    name = prefix + ntos<int>( i );
+                    if (vms.find( name ) == vms.end()) break;
+                }
+                CVMWA_LOG( "Info", "Pre-creating pool VM " << name << " (" << count + 1 << "/" << target << ")" );
+                if (this->templateClone( name, (*it).second.cvmVersion, (*it).second.disk, (*it).second.flags, &uuid ) != HVE_OK) {
+                    CVMWA_LOG( "Error", "Unable to pre-create pool VM " << name );
+                    break;
+                }
+            }
+        }
+        
+        /* Check again if more VMs were claimed meanwhile */
+        boost::unique_lock<boost::mutex> lock( this->poolMutex );
+        if (this->poolPending && !this->poolStop) {
+            this->poolPending = false;
+            continue;
+        }
+        this->poolBusy = false;
+        this->poolCond.notify_all();
+        return;
+        
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the name of the host-only adapter shared by all the VMs, provisioning it (and
+ * its DHCP server) on the first call. The result is cached until hostOnlyInvalidate() is
+ * called, and concurrent callers share the result of the same provisioning attempt.
+ * Returns an empty string on error.
+ */
+std::string Virtualbox::hostOnlyAdapter( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->hostOnlyMutex );
+    if (this->hostOnlyValid) return this->hostOnlyName;
+    
+    /* Another thread is provisioning, wait for its result */
+    if (this->hostOnlyBusy) {
+        while (this->hostOnlyBusy) this->hostOnlyCond.wait( lock );
+        return this->hostOnlyName;
+    }
+    
+    /* Provision it ourselves */
+    this->hostOnlyBusy = true;
+    lock.unlock();
+    string name = this->hostOnlyProvision();
+    lock.lock();
+    this->hostOnlyName = name;
+    this->hostOnlyValid = !name.empty();
+    this->hostOnlyBusy = false;
+    this->hostOnlyCond.notify_all();
+    
+    CVMWA_LOG( "Info", "Host-only adapter: '" << name << "'" );
+    return name;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Forget the cached host-only adapter (ex. because a VM using it failed), so
+ * that the next hostOnlyAdapter() checks the host network configuration again
+ */
+void Virtualbox::hostOnlyInvalidate( ) {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::unique_lock<boost::mutex> lock( this->hostOnlyMutex );
+        this->hostOnlyValid = false;
+    }
+    this->listInvalidate( "hostonlyifs" );
+    this->listInvalidate( "dhcpservers" );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Execute a host network configuration command
+ */
+int Virtualbox::hostOnlyExec( const std::string & cmd ) {
+    CRASH_REPORT_BEGIN;
+    string err;
+    int ans;
+    CVMWA_LOG( "Debug", "Executing '" << cmd << "'" );
+    NAMED_MUTEX_LOCK_MODE( "generic", NMUTEX_MUTATION );
+    ans = this->exec( cmd, NULL, &err, 2 );
+    this->listInvalidateBy( cmd );
+    NAMED_MUTEX_UNLOCK;
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Ensure the existance and return the name of the host-only adapter in the system,
+ * with a DHCP server enabled on it (called by a single thread at a time)
+ */
+std::string Virtualbox::hostOnlyProvision() {
+    CRASH_REPORT_BEGIN;
+
+    vector<string> lines;
+    vector< map<string, string> > ifs;
+    vector< map<string, string> > dhcps;
+    string ifName = "", vboxName, ipServer, ipMin, ipMax;
+    
+    /* Check if we already have host-only interfaces */
+    int ans = this->listCached("hostonlyifs", &lines);
+    if (ans != 0) return "";
+    
+    /* Check if there is really nothing */
+    if (lines.size() == 0) {
+        ans = this->hostOnlyExec("hostonlyif create");
+        if (ans != 0) return "";
+    
+        /* Repeat check */
+        ans = this->listCached("hostonlyifs", &lines);
+        if (ans != 0) return "";
+        
+        /* Still couldn't pick anything? Error! */
+        if (lines.size() == 0) return "";
+    }
+    ifs = tokenizeList( &lines, ':' );
+    
+    /* Dump the DHCP server states */
+    ans = this->listCached("dhcpservers", &lines);
+    if (ans != 0) return "";
+    dhcps = tokenizeList( &lines, ':' );
+    
+    /* The name of the first network found and a flag
+       to check if we were able to find a DHCP server */
+    bool    foundDHCPServer = false;
+    string  foundIface      = "",
+            foundBaseIP     = "",
+            foundVBoxName   = "",
+            foundMask       = "";
+
+    /* Process interfaces */
+    for (vector< map<string, string> >::iterator i = ifs.begin(); i != ifs.end(); i++) {
+        map<string, string> iface = *i;
+
+        CVMWA_LOG("log", "Checking interface");
+        mapDump(iface);
+
+        /* Ensure proper environment */
+        if (iface.find("Name") == iface.end()) continue;
+        if (iface.find("VBoxNetworkName") == iface.end()) continue;
+        if (iface.find("IPAddress") == iface.end()) continue;
+        if (iface.find("NetworkMask") == iface.end()) continue;
+        
+        /* Fetch interface info */
+        ifName = iface["Name"];
+        vboxName = iface["VBoxNetworkName"];
+        
+        /* Check if we have DHCP enabled on this interface */
+        bool hasDHCP = false;
+        for (vector< map<string, string> >::iterator i = dhcps.begin(); i != dhcps.end(); i++) {
+            map<string, string> dhcp = *i;
+            if (dhcp.find("NetworkName") == dhcp.end()) continue;
+            if (dhcp.find("Enabled") == dhcp.end()) continue;
+
+            CVMWA_LOG("log", "Checking dhcp");
+            mapDump(dhcp);
+            
+            /* The network has a DHCP server, check if it's running */
+            if (vboxName.compare(dhcp["NetworkName"]) == 0) {
+                if (dhcp["Enabled"].compare("Yes") == 0) {
+                    hasDHCP = true;
+                    break;
+                    
+                } else {
+                    
+                    /* Make sure the server does not have an invalid IP address */
+                    bool updateIPInfo = false;
+                    if (dhcp["IP"].compare("0.0.0.0") == 0) updateIPInfo=true;
+                    if (dhcp["lowerIPAddress"].compare("0.0.0.0") == 0) updateIPInfo=true;
+                    if (dhcp["upperIPAddress"].compare("0.0.0.0") == 0) updateIPInfo=true;
+                    if (dhcp["NetworkMask"].compare("0.0.0.0") == 0) updateIPInfo=true;
+                    if (updateIPInfo) {
+                        
+                        /* Prepare IP addresses */
+                        ipServer = changeUpperIP( iface["IPAddress"], 100 );
+                        ipMin = changeUpperIP( iface["IPAddress"], 101 );
+                        ipMax = changeUpperIP( iface["IPAddress"], 254 );
+                    
+                        /* Modify server */
+                        ans = this->hostOnlyExec(
+                            "dhcpserver modify --ifname \"" + ifName + "\"" +
+                            " --ip " + ipServer +
+                            " --netmask " + iface["NetworkMask"] +
+                            " --lowerip " + ipMin +
+                            " --upperip " + ipMax
+                            );
+                        if (ans != 0) continue;
+                    
+                    }
+                    
+                    /* Check if we can enable the server */
+                    ans = this->hostOnlyExec("dhcpserver modify --ifname \"" + ifName + "\" --enable");
+                    if (ans == 0) {
+                        hasDHCP = true;
+                        break;
+                    }
+                    
+                }
+            }
+        }
+        
+        /* Keep the information of the first interface found */
+        if (foundIface.empty()) {
+            foundIface = ifName;
+            foundVBoxName = vboxName;
+            foundBaseIP = iface["IPAddress"];
+            foundMask = iface["NetworkMask"];
+        }
+        
+        /* If we found DHCP we are done */
+        if (hasDHCP) {
+            foundDHCPServer = true;
+            break;
+        }
+        
+    }
+    
+    /* If there was no DHCP server, create one */
+    if (!foundDHCPServer) {
+        
+        /* Prepare IP addresses */
+        ipServer = changeUpperIP( foundBaseIP, 100 );
+        ipMin = changeUpperIP( foundBaseIP, 101 );
+        ipMax = changeUpperIP( foundBaseIP, 254 );
+        
+        /* Add and start server */
+        ans = this->hostOnlyExec(
+            "dhcpserver add --ifname \"" + foundIface + "\"" +
+            " --ip " + ipServer +
+            " --netmask " + foundMask +
+            " --lowerip " + ipMin +
+            " --upperip " + ipMax +
+            " --enable"
+            );
+        if (ans != 0) return "";
+                
+    }
+    
+    /* Got my interface */
+    return foundIface;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the cached VM registry is still valid: it's not older than VBOX_REGISTRY_MAX_AGE
+ * and VirtualBox.xml was not modified since the VMs were listed (the caller must hold registryMutex)
+ */
+bool Virtualbox::registryFresh( ) {
+    CRASH_REPORT_BEGIN;
+    if (!this->registryValid) return false;
+    if (getMillis() - this->registryTimestamp >= VBOX_REGISTRY_MAX_AGE) return false;
+    if (!this->registryFile.empty() && (getFileModified( this->registryFile ) != this->registryTime)) return false;
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * List the registered VMs into the cached VM registry (the caller must hold registryMutex)
+ */
+int Virtualbox::registryRefresh( ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
+    map<string, string> vms;
+    string err;
+    
+    /* Note the modification time before listing, so changes made meanwhile are caught next time */
+    if (this->registryFile.empty()) this->registryFile = __virtualboxConfigFile();
+    time_t modified = this->registryFile.empty() ? 0 : getFileModified( this->registryFile );
+    long timestamp = getMillis();
+    
+    /* List the VMs in the system */
+    int ans;
+    NAMED_MUTEX_LOCK_SHARED("generic");
+    ans = this->exec("list vms", &lines, &err, 2, 2000);
+    NAMED_MUTEX_UNLOCK;
+    if (ans != 0) return HVE_QUERY_ERROR;
+    
+    /* Tokenize */
+    this->registry.clear();
+    vms = tokenize( &lines, '{' );
+    for (std::map<string, string>::iterator it=vms.begin(); it!=vms.end(); ++it) {
+        string name = (*it).first;
+        string uuid = (*it).second;
+        name = name.substr(1, name.length()-3);
+        uuid = uuid.substr(0, uuid.length()-1);
+        this->registry[name] = "{" + uuid + "}";
+    }
+    
+    this->registryValid = true;
+    this->registryTimestamp = timestamp;
+    this->registryTime = modified;
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the UUID of the VM with the given name. Returns HVE_NOT_FOUND if there is no such VM.
+ */
+int Virtualbox::registryLookup( std::string name, std::string * uuid ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->registryMutex );
+    if (!this->registryFresh() && (this->registryRefresh() != HVE_OK))
+        return HVE_QUERY_ERROR;
+    map<string, string>::iterator it = this->registry.find( name );
+    if (it == this->registry.end()) return HVE_NOT_FOUND;
+    *uuid = (*it).second;
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get all the registered VMs, as a VM name to UUID map
+ */
+int Virtualbox::registryList( std::map<std::string, std::string> * vms ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->registryMutex );
+    if (!this->registryFresh() && (this->registryRefresh() != HVE_OK))
+        return HVE_QUERY_ERROR;
+    *vms = this->registry;
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the modification time of VirtualBox.xml, to be passed to registryAdd() and
+ * registryRemove() after the command that registers or unregisters a VM
+ */
+time_t Virtualbox::registryModified( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->registryMutex );
+    if (this->registryFile.empty()) this->registryFile = __virtualboxConfigFile();
+    if (this->registryFile.empty()) return 0;
+    return getFileModified( this->registryFile );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Record a VM we have just registered or renamed. The registry remains valid without
+ * listing the VMs again only if VirtualBox.xml was not modified by anybody else since
+ * they were listed, that is, if before (its registryModified() before our command)
+ * matches the listing. Otherwise we don't know what else has changed.
+ */
+void Virtualbox::registryAdd( std::string name, std::string uuid, time_t before ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->registryMutex );
+    if (!this->registryValid) return;
+    if (!this->registryFile.empty() && (before != this->registryTime)) {
+        this->registryValid = false;
+        return;
+    }
+    for (map<string, string>::iterator it = this->registry.begin(); it != this->registry.end(); ) {
+        if ((*it).second == uuid) {
+            this->registry.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+    this->registry[name] = uuid;
+    if (!this->registryFile.empty()) this->registryTime = getFileModified( this->registryFile );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Forget a VM we have just unregistered (see registryAdd)
+ */
+void Virtualbox::registryRemove( std::string uuid, time_t before ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->registryMutex );
+    if (!this->registryValid) return;
+    if (!this->registryFile.empty() && (before != this->registryTime)) {
+        this->registryValid = false;
+        return;
+    }
+    for (map<string, string>::iterator it = this->registry.begin(); it != this->registry.end(); ) {
+        if ((*it).second == uuid) {
+            this->registry.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+    if (!this->registryFile.empty()) this->registryTime = getFileModified( this->registryFile );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Drop the cached VM registry, forcing the VMs to be listed again on the next use
+ */
+void Virtualbox::registryInvalidate( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->registryMutex );
+    this->registryValid = false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Reserve the VRDE and NAT forwarding ports of all the registered VMs, not only of the
+ * sessions we know, so that we don't hand them out again. They are read from the settings
+ * files of the VMs listed in VirtualBox.xml; only the ones modified since the last call
+ * are read again.
+ */
+void Virtualbox::reserveRegisteredPorts( ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->portsMutex );
+    string registryFile = __virtualboxConfigFile();
+    if (registryFile.empty()) return;
+    string registryDir = registryFile.substr( 0, registryFile.find_last_of( "/\\" ) );
+    
+    /* Read the VM registry */
+    ostringstream xml;
+    ifstream ifs( registryFile.c_str() );
+    if (ifs.fail()) return;
+    xml << ifs.rdbuf();
+    ifs.close();
+    string registry = xml.str();
+    
+    /* Visit the settings file of every VM */
+    size_t pos = 0;
+    while ((pos = registry.find( "<MachineEntry ", pos )) != string::npos) {
+        string file = __xmlAttribute( registry, pos, "src" );
+        pos++;
+        if (file.empty()) continue;
+        if ((file[0] != '/') && (file[0] != '\\') && ((file.length() < 2) || (file[1] != ':')))
+            file = registryDir + "/" + file;
+        
+        /* Skip the unchanged ones */
+        time_t modified = getFileModified( file );
+        map<string, time_t>::iterator scanned = this->portsScanned.find( file );
+        if ((scanned != this->portsScanned.end()) && ((*scanned).second == modified)) continue;
+        this->portsScanned[file] = modified;
+        
+        ostringstream vm;
+        ifs.open( file.c_str() );
+        if (ifs.fail()) {
+            ifs.clear();
+            continue;
+        }
+        vm << ifs.rdbuf();
+        ifs.close();
+        string settings = vm.str();
+        
+        /* VRDE ports */
+        size_t vrde = settings.find( "<Property name=\"TCP/Ports\"" );
+        if (vrde != string::npos) __reservePortList( __xmlAttribute( settings, vrde, "value" ) );
+        
+        /* NAT port forwarding rules */
+        size_t rule = 0;
+        while ((rule = settings.find( "<Forwarding ", rule )) != string::npos) {
+            __reservePortList( __xmlAttribute( settings, rule, "hostport" ) );
+            rule++;
+        }
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Scoped lock of the session index file, serializing its read-modify-write updates
+ * with the other processes using it (the plugin instances and the daemon). The threads
+ * of this process are serialized by indexMutex, which must be acquired first.
+ */
+class VBoxIndexLock {
+public:
+    VBoxIndexLock( const std::string & file ) : lock( NULL ) {
+        try {
+            std::ofstream touch( file.c_str(), std::ofstream::out | std::ofstream::app );
+            touch.close();
+            lock = new boost::interprocess::file_lock( file.c_str() );
+            lock->lock();
+        } catch (boost::interprocess::interprocess_exception & e) {
+            CVMWA_LOG( "Warning", "Unable to lock the session index: " << e.what() );
+            delete lock;
+            lock = NULL;
+        }
+    };
+    ~VBoxIndexLock() {
+        if (lock == NULL) return;
+        lock->unlock();
+        delete lock;
+    };
+private:
+    boost::interprocess::file_lock * lock;
+};
+
+/**
+ * Read the session index file (the caller must hold indexMutex). Returns false if there
+ * is no index, or if it's empty or unreadable, in which case it should be rebuilt.
+ */
+bool Virtualbox::indexRead( std::map<std::string, VBOX_INDEX_ENTRY> * index ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string> data;
+    index->clear();
+    if (!this->indexConfig.loadMap( VBOX_SESSION_INDEX, &data )) return false;
+    
+    /* Each line is '<uuid>/<field>=<value>' */
+    for (map<string, string>::iterator it = data.begin(); it != data.end(); ++it) {
+        size_t sep = (*it).first.find('/');
+        if ((sep == string::npos) || ((*it).first[0] != '{')) continue;
+        string uuid = (*it).first.substr(0, sep);
+        string field = (*it).first.substr(sep+1);
+        
+        /* Initialize new entries */
+        if (index->find(uuid) == index->end()) {
+            VBOX_INDEX_ENTRY entry;
+            entry.flags = 0;
+            entry.state = STATE_CLOSED;
+            (*index)[uuid] = entry;
+        }
+        
+        VBOX_INDEX_ENTRY * entry = &(*index)[uuid];
+        if (field == "name") {
+            entry->name = (*it).second;
+        } else if (field == "key") {
+            entry->key = (*it).second;
+        } else if (field == "flags") {
+            entry->flags = ston<int>( (*it).second );
+        } else if (field == "state") {
+            entry->state = ston<int>( (*it).second );
+        } else if (field == "scratchDisk") {
+            entry->scratchDisk = (*it).second;
+        } else if (field == "contextISO") {
+            entry->contextISO = (*it).second;
+        }
+    }
+    
+    return !index->empty();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the session index file (the caller must hold indexMutex)
+ */
+void Virtualbox::indexSave( std::map<std::string, VBOX_INDEX_ENTRY> * index ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string> data;
+    for (map<string, VBOX_INDEX_ENTRY>::iterator it = index->begin(); it != index->end(); ++it) {
+        string uuid = (*it).first;
+        VBOX_INDEX_ENTRY * entry = &(*it).second;
+        data[uuid + "/name"] = entry->name;
+        data[uuid + "/key"] = entry->key;
+        data[uuid + "/flags"] = ntos<int>( entry->flags );
+        data[uuid + "/state"] = ntos<int>( entry->state );
+        if (!entry->scratchDisk.empty()) data[uuid + "/scratchDisk"] = entry->scratchDisk;
+        if (!entry->contextISO.empty()) data[uuid + "/contextISO"] = entry->contextISO;
+    }
+    if (!this->indexConfig.saveMap( VBOX_SESSION_INDEX, &data ))
+        CVMWA_LOG( "Warning", "Unable to save the session index" );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Load the session index. Returns HVE_NOT_FOUND if there is no index yet.
+ */
+int Virtualbox::indexLoad( std::map<std::string, VBOX_INDEX_ENTRY> * index ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->indexMutex );
+    if (!this->indexRead( index )) return HVE_NOT_FOUND;
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Add or update a session in the session index. The disk paths are taken
+ * from the machine info if specified, otherwise the indexed ones are kept.
+ */
+void Virtualbox::indexStore( VBoxSession * session, VBOX_VMINFO * info ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->indexMutex );
+    VBoxIndexLock fileLock( this->indexConfig.getPath( VBOX_SESSION_INDEX_LOCK ) );
+    
+    /* Re-read the index, since other processes might have changed it */
+    map<string, VBOX_INDEX_ENTRY> index;
+    this->indexRead( &index );
+    
+    VBOX_INDEX_ENTRY * entry = &index[session->uuid];
+    entry->name = session->name;
+    entry->key = session->key;
+    entry->flags = session->flags;
+    entry->state = session->state;
+    if (info != NULL) {
+        entry->scratchDisk = "";
+        entry->contextISO = "";
+        if (info->media.find( SCRATCH_DSK ) != info->media.end())
+            entry->scratchDisk = info->media[ SCRATCH_DSK ];
+        if (info->media.find( CONTEXT_DSK ) != info->media.end())
+            entry->contextISO = info->media[ CONTEXT_DSK ];
+    } else if (!session->updateCache.diskPath.empty()) {
+        entry->scratchDisk = session->updateCache.diskPath;
+    }
+    
+    this->indexSave( &index );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remove a session from the session index
+ */
+void Virtualbox::indexRemove( std::string uuid ) {
+    CRASH_REPORT_BEGIN;
+    boost::unique_lock<boost::mutex> lock( this->indexMutex );
+    VBoxIndexLock fileLock( this->indexConfig.getPath( VBOX_SESSION_INDEX_LOCK ) );
+    map<string, VBOX_INDEX_ENTRY> index;
+    if (!this->indexRead( &index )) return;
+    if (index.erase( uuid ) == 0) return;
+    this->indexSave( &index );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Clean-up after an indexed VM that was deleted without us knowing: Release
+ * and remove the media it has left behind. Returns false if the VM turns out
+ * to be still registered, in which case nothing is touched.
+ */
+bool Virtualbox::indexRecover( std::string uuid, const VBOX_INDEX_ENTRY & entry ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
+    string err;
+    
+    /* Confirm with VirtualBox itself that the VM is gone (the listing might
+       be older than the index). Any other failure is not a proof. */
+    int ans;
+    NAMED_MUTEX_LOCK_SHARED( uuid );
+    ans = this->exec( "showvminfo " + uuid + " --machinereadable", &lines, &err, 2, 2000 );
+    NAMED_MUTEX_UNLOCK;
+    if ((ans == 0) || (err.find( "Could not find a registered machine" ) == string::npos))
+        return false;
+    CVMWA_LOG( "Info", "Session " << entry.name << " (" << uuid << ") was deleted externally, cleaning-up" );
+    
+    /* Remove only the media VirtualBox has released. If closing fails, they are
+       still attached to something (or being attached right now), so keep them. */
+    if (!entry.scratchDisk.empty() && file_exists( entry.scratchDisk )) {
+        NAMED_MUTEX_LOCK( entry.scratchDisk );
+        ans = this->exec( "closemedium disk \"" + entry.scratchDisk + "\"", NULL, &err, 2, 2000 );
+        NAMED_MUTEX_UNLOCK;
+        if (ans == 0) remove( entry.scratchDisk.c_str() );
+    }
+    if (!entry.contextISO.empty() && file_exists( entry.contextISO )) {
+        NAMED_MUTEX_LOCK( entry.contextISO );
+        ans = this->exec( "closemedium dvd \"" + entry.contextISO + "\"", NULL, &err, 2, 2000 );
+        NAMED_MUTEX_UNLOCK;
+        if (ans == 0) remove( entry.contextISO.c_str() );
+    }
+    
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the given VM is running, using the (shortly) cached list of running VMs
+ */
+bool Virtualbox::isRunning( std::string uuid ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
+    if (this->listCached( "runningvms", &lines, 2000, VBOX_RUNNING_CACHE_TTL ) != HVE_OK)
+        return false;
+    string tag = "{" + uuid + "}";
+    for (vector<string>::iterator it = lines.begin(); it != lines.end(); ++it)
+        if ((*it).find( tag ) != string::npos) return true;
+    return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check the cheap change signals of the session (the modification time of its
+ * settings file and VBox.log, and if it's running) against the ones of the last
+ * complete update. Returns true if the session needs to be updated again.
+ */
+bool Virtualbox::sessionChanged( VBoxSession * session, bool * running ) {
+    CRASH_REPORT_BEGIN;
+    VBOX_UPDATE_CACHE * cache = &session->updateCache;
+    *running = this->isRunning( session->uuid );
+    
+    /* Never checked, or checked too long ago */
+    if (!cache->valid) return true;
+    if ((getMillis() - cache->timestamp) > VBOX_UPDATE_MAX_AGE) return true;
+    
+    /* Started or stopped */
+    if (*running != cache->running) return true;
+    
+    /* The files were modified (mtime has 1 sec resolution, so also
+       consider anything modified since the last update started) */
+    time_t configTime = getFileModified( cache->configFile );
+    if ((configTime != cache->configTime) || (configTime >= cache->checkTime)) return true;
+    time_t logTime = getFileModified( cache->logFolder + "/VBox.log" );
+    if ((logTime != cache->logTime) || (logTime >= cache->checkTime)) return true;
+    
+    return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Take a snapshot of the session fields updateSession() can change
+ */
+map<string, string> __sessionSnapshot( VBoxSession * session ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string> ans;
+    ostringstream oss;
+    
+    oss.str(""); oss << session->state;             ans["state"] = oss.str();
+    oss.str(""); oss << session->editable;          ans["editable"] = oss.str();
+    oss.str(""); oss << session->cpus;              ans["cpus"] = oss.str();
+    oss.str(""); oss << session->memory;            ans["memory"] = oss.str();
+    oss.str(""); oss << session->disk;              ans["disk"] = oss.str();
+    oss.str(""); oss << session->executionCap;      ans["executionCap"] = oss.str();
+    oss.str(""); oss << session->flags;             ans["flags"] = oss.str();
+    oss.str(""); oss << session->pid;               ans["pid"] = oss.str();
+    oss.str(""); oss << session->rdpPort;           ans["rdpPort"] = oss.str();
+    oss.str(""); oss << session->localApiPort;      ans["localApiPort"] = oss.str();
+    oss.str(""); oss << session->daemonControlled;  ans["daemonControlled"] = oss.str();
+    oss.str(""); oss << session->daemonMinCap;      ans["daemonMinCap"] = oss.str();
+    oss.str(""); oss << session->daemonMaxCap;      ans["daemonMaxCap"] = oss.str();
+    oss.str(""); oss << session->daemonFlags;       ans["daemonFlags"] = oss.str();
+    ans["version"] = session->version;
+    ans["userData"] = session->userData;
+    
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Parse VirtualBox Log file in order to get the launched process PID
+ */
+int __getPIDFromFile( std::string logPath ) {
+    int pid = 0;
+
+    /* Locate Logfile */
+    string logFile = logPath + "/VBox.log";
+    CVMWA_LOG("Debug", "Looking for PID in " << logFile );
+    if (!file_exists(logFile)) return 0;
+
+    /* Open input stream */
+    ifstream fIn(logFile.c_str(), ifstream::in);
+    
+    /* Read as few bytes as possible */
+    string inBufferLine;
+    size_t iStart, iEnd, i1, i2;
+    char inBuffer[1024];
+    while (!fIn.eof()) {
+
+        // Read line
+        fIn.getline( inBuffer, 1024 );
+
+        // Handle it via higher-level API
+        inBufferLine.assign( inBuffer );
+        if ((iStart = inBufferLine.find("Process ID:")) != string::npos) {
+
+            // Pick the appropriate ending
+            iEnd = inBufferLine.length();
+            i1 = inBufferLine.find("\r");
+            i2 = inBufferLine.find("\n");
+            if (i1 < iEnd) iEnd=i1;
+            if (i2 < iEnd) iEnd=i2;
+
+            // Extract string
+            inBufferLine = inBufferLine.substr( iStart+12, iEnd-iStart );
+
+            // Convert to integer
+            pid = ston<int>( inBufferLine );
+            break;
         }
     }
 
@@ -2123,12 +3729,31 @@ int Virtualbox::updateSession( HVSession * session, bool fast ) {
     string uuid = session->uuid;
     if (uuid.empty()) return HVE_USAGE_ERROR;
     
+    /* Check the cheap change signals first, and skip the update if nothing changed */
+    VBoxSession * vbSession = (VBoxSession*)session;
+    VBOX_UPDATE_CACHE * cache = &vbSession->updateCache;
+    time_t checkTime = time(NULL);
+    bool running;
+    if (!this->sessionChanged( vbSession, &running ) && (fast || cache->properties)) {
+        CVMWA_LOG("Debug", "Nothing changed on " << uuid << ", skipping update");
+        return HVE_OK;
+    }
+    map<string, string> previous = __sessionSnapshot( vbSession );
+    
+    /* The guest properties don't depend on the machine info, so fetch them in parallel
+       (unless the property watcher keeps them up to date) */
+    bool watched = vbSession->isWatching();
+    HVExecFuturePtr propsFuture;
+    if (!fast && !watched) propsFuture = this->execAsync( "guestproperty enumerate "+uuid, uuid, 4, 2000 );
+    
     /* Collect details */
-    map<string, string> info = this->getMachineInfo( uuid, 2000 );
-    if (info.empty()) 
-        return HVE_NOT_FOUND;
-    if (info.find(":ERROR:") != info.end())
-        return HVE_IO_ERROR;
+    VBOX_VMINFO info;
+    int infoAns = this->getMachineInfo( uuid, &info, 2000 );
+    if (infoAns != HVE_OK) {
+        cache->valid = false;
+        if (propsFuture) propsFuture->wait();
+        return infoAns;
+    }
     
     /* Reset flags */
     prevEditable = session->editable;
@@ -2137,119 +3762,71 @@ int Virtualbox::updateSession( HVSession * session, bool fast ) {
     
     /* Check state */
     session->state = STATE_OPEN;
-    if (info.find("State") != info.end()) {
-        string state = info["State"];
-        if (state.find("running") != string::npos) {
-            session->state = STATE_STARTED;
-        } else if (state.find("paused") != string::npos) {
-            session->state = STATE_PAUSED;
-            session->editable = false;
-        } else if (state.find("saved") != string::npos) {
-            session->state = STATE_OPEN;
-            session->editable = false;
-        } else if (state.find("aborted") != string::npos) {
-            session->state = STATE_OPEN;
-        }
+    if ((info.state == "running") || (info.state == "starting") || (info.state == "restoring")) {
+        session->state = STATE_STARTED;
+    } else if (info.state == "paused") {
+        session->state = STATE_PAUSED;
+        session->editable = false;
+    } else if (info.state == "saved") {
+        session->state = STATE_OPEN;
+        session->editable = false;
+    } else if (info.state == "aborted") {
+        session->state = STATE_OPEN;
     }
     
     /* If session switched to editable state, commit pending property changes */
-    if (session->editable && !prevEditable && !((VBoxSession*)session)->unsyncedProperties.empty()) {
-        for (std::map<string, string>::iterator it=((VBoxSession*)session)->unsyncedProperties.begin(); 
-                it!=((VBoxSession*)session)->unsyncedProperties.end(); ++it) {
-            string name = (*it).first;
-            string value = (*it).second;
-            
-            // Session is now editable
-            session->setProperty(name, value);
-        }
-    }
-    
-    /* Reset property maps */
-    ((VBoxSession*)session)->unsyncedProperties.clear();
-    ((VBoxSession*)session)->properties.clear();
+    if (session->editable && !prevEditable)
+        vbSession->flushProperties();
     
-    /* Get CPU */
-    if (info.find("Number of CPUs") != info.end()) {
-        session->cpus = ston<int>( info["Number of CPUs"] );
+    /* Reset property map */
+    if (!watched) {
+        boost::unique_lock<boost::mutex> lock( vbSession->propertiesMutex );
+        vbSession->properties.clear();
     }
     
+    /* Get CPU, memory and execution cap */
+    session->cpus = info.cpus;
+    session->memory = info.memory;
+    session->executionCap = info.executionCap;
+    
     /* Check flags */
-    if (info.find("Guest OS") != info.end()) {
-        string guestOS = info["Guest OS"];
-        if (guestOS.find("64 bit") != string::npos) {
-            session->flags |= HVF_SYSTEM_64BIT;
-        }
+    if ((info.osType.find("64 bit") != string::npos) || (info.osType.find("64-bit") != string::npos)) {
+        session->flags |= HVF_SYSTEM_64BIT;
     }
 
     /* Find configuration folder */
-    if (info.find("Guest OS") != info.end()) {
-        string settingsFolder = info["Settings file"];
+    if (!info.configFile.empty()) {
 
-        // Skip empty files
-        if (!settingsFolder.empty()) {
-
-            // Strip quotation marks
-            if ((settingsFolder[0] == '"') || (settingsFolder[0] == '\''))
-                settingsFolder = settingsFolder.substr( 1, settingsFolder.length() - 2);
-
-            // Strip the settings file (leave path) and store it on dataPath
-            ((VBoxSession*)session)->dataPath = stripComponent( settingsFolder );
-
-        } else {
+        // Strip the settings file (leave path) and store it on dataPath
+        ((VBoxSession*)session)->dataPath = stripComponent( info.configFile );
 
-            // No data path found? Use system's temp directory
-            ((VBoxSession*)session)->dataPath = getTmpDir();
+    } else {
 
-        }
+        // No data path found? Use system's temp directory
+        ((VBoxSession*)session)->dataPath = getTmpDir();
 
     }
 
-    /* Parse RDP info */
-    if (info.find("VRDE") != info.end()) {
-        string rdpInfo = info["VRDE"];
-
-        // Example line: 'enabled (Address 127.0.0.1, Ports 39211, MultiConn: off, ReuseSingleConn: off, Authentication type: null)'
-        if (rdpInfo.find("enabled") != string::npos) {
-            size_t pStart = rdpInfo.find("Ports ");
-            if (pStart == string::npos) {
-                ((VBoxSession *)session)->rdpPort = 0;
-                CVMWA_LOG("Debug", "VRDE 'Ports' anchor not found");
-
-            } else {
-                pStart += 6;
-                size_t pEnd = rdpInfo.find(",", pStart);
-                string rdpPort = rdpInfo.substr( pStart, pEnd-pStart );
-
-                // Apply the rdp port
-                ((VBoxSession *)session)->rdpPort = ston<int>(rdpPort);
-                CVMWA_LOG("Debug", "VRDE Port is " << rdpPort);
-            }
-        } else {
-            ((VBoxSession *)session)->rdpPort = 0;
-            CVMWA_LOG("Debug", "VRDE not enabled");
-        }
-    } else {
-        CVMWA_LOG("Debug", "VRDE config not found");
-    }
+    /* Get RDP port */
+    ((VBoxSession *)session)->rdpPort = info.vrdePort;
+    CVMWA_LOG("Debug", "VRDE Port is " << info.vrdePort);
     
-    /* Parse memory */
-    if (info.find("Memory size") != info.end()) {
-        session->cpus = ston<int>( info["Number of CPUs"] );
-
-        /* Parse memory */
-        string mem = info["Memory size"];
-        mem = mem.substr(0, mem.length()-2);
-        session->memory = ston<int>(mem);
-
+    /* Don't hand out the ports the VM is configured to use */
+    reserveLocalPort( info.vrdePort );
+    for (vector<string>::iterator it = info.natRules.begin(); it != info.natRules.end(); ++it) {
+        /* The host port is the 4th field of "name,proto,hostip,hostport,guestip,guestport" */
+        size_t iField = 0;
+        for (int i = 0; (i < 3) && (iField != string::npos); i++)
+            iField = (*it).find( ',', (i == 0) ? 0 : iField + 1 );
+        if (iField != string::npos) reserveLocalPort( atoi( (*it).c_str() + iField + 1 ) );
     }
     
     /* Parse CernVM Version from the ISO */
     session->version = DEFAULT_CERNVM_VERSION;
-    if (info.find( BOOT_DSK ) != info.end()) {
+    if (info.media.find( BOOT_DSK ) != info.media.end()) {
 
         /* Get the filename of the iso */
-        getKV( info[ BOOT_DSK ], &kk, &kv, '(', 0 );
-        kk = kk.substr(0, kk.length()-1);
+        kk = info.media[ BOOT_DSK ];
         
         /* Extract CernVM Version from file */
         session->version = this->cernVMVersion( kk );
@@ -2261,11 +3838,10 @@ int Virtualbox::updateSession( HVSession * session, bool fast ) {
     }
     
     /* Check if there are guest additions mounted and update flags */
-    if (info.find( GUESTADD_DSK ) != info.end()) {
+    if (info.media.find( GUESTADD_DSK ) != info.media.end()) {
         
         /* Get the filename of the iso */
-        getKV( info[ GUESTADD_DSK ], &kk, &kv, '(', 0 );
-        kk = kk.substr(0, kk.length()-1);
+        kk = info.media[ GUESTADD_DSK ];
         
         /* Check if we have the guest additions disk */
         if ( kk.compare(this->hvGuestAdditions) == 0 ) 
@@ -2274,54 +3850,54 @@ int Virtualbox::updateSession( HVSession * session, bool fast ) {
     }
     
     /* Check if we have floppy adapter. If we do, it means we are using floppyIO -> updateFlags */
-    if (info.find( FLOPPYIO_ENUM_NAME ) != info.end()) {
+    if (std::find( info.controllers.begin(), info.controllers.end(), FLOPPYIO_CONTROLLER ) != info.controllers.end()) {
         session->flags |= HVF_FLOPPY_IO;
     }
     
     /* Parse disk size */
     session->disk = 1024;
-    if (info.find( SCRATCH_DSK ) != info.end()) {
+    if (info.media.find( SCRATCH_DSK ) != info.media.end()) {
 
         /* Get the filename of the iso */
-        getKV( info[ SCRATCH_DSK ], &kk, &kv, '(', 0 );
-        kk = kk.substr(0, kk.length()-1);
+        kk = info.media[ SCRATCH_DSK ];
         
-        /* Collect disk info */
-        int ans;
-        NAMED_MUTEX_LOCK(kk);
-        ans = this->exec("showhdinfo \""+kk+"\"", &lines, &err, 2, 2000);
-        NAMED_MUTEX_UNLOCK;
-        if (ans == 0) {
+        /* Use the cached size if it's the same disk */
+        if (kk == cache->diskPath) {
+            session->disk = cache->diskSize;
+            
+        } else {
         
-            /* Tokenize data */
-            diskinfo = tokenize( &lines, ':' );
-            if (diskinfo.find("Logical size") != diskinfo.end()) {
-                kk = diskinfo["Logical size"];
-                kk = kk.substr(0, kk.length()-7); // Strip " MBytes"
-                session->disk = ston<int>(kk);
-            }
+            /* Collect disk info */
+            int ans;
+            NAMED_MUTEX_LOCK_SHARED(kk);
+            ans = this->exec("showhdinfo \""+kk+"\"", &lines, &err, 2, 2000);
+            NAMED_MUTEX_UNLOCK;
+            if (ans == 0) {
             
+                /* Tokenize data */
+                diskinfo = tokenize( &lines, ':' );
+                if (diskinfo.find("Logical size") != diskinfo.end()) {
+                    string size = diskinfo["Logical size"];
+                    size = size.substr(0, size.length()-7); // Strip " MBytes"
+                    session->disk = ston<int>(size);
+                    cache->diskPath = kk;
+                    cache->diskSize = session->disk;
+                }
+                
+            }
         }
     }
     
-    /* Parse execution cap */
-    session->executionCap = 100;
-    if (info.find( "CPU exec cap" ) != info.end()) {
-        
-        /* Get execution cap */
-        kk = info["CPU exec cap"];
-        kk = kk.substr(0, kk.length()-1); // Strip %
-        
-        /* Convert to number */
-        session->executionCap = ston<int>( kk );
-        
-    }
-    
     /* If we want to be fast, skip time-consuming operations */
     if (!fast) {
 
-        /* Parse all properties concurrently */
-        map<string, string> allProps = this->getAllProperties( uuid );
+        /* Collect the properties requested in parallel */
+        map<string, string> allProps;
+        if (watched) {
+            allProps = vbSession->getProperties();
+        } else if (propsFuture->wait() == 0) {
+            allProps = __parseGuestProperties( propsFuture->output );
+        }
 
         if (allProps.find("/CVMWeb/daemon/controlled") == allProps.end()) {
             session->daemonControlled = false;
@@ -2360,14 +3936,52 @@ int Virtualbox::updateSession( HVSession * session, bool fast ) {
         }
         CVMWA_LOG("Debug", "LocalAPI Port = " << ((VBoxSession *)session)->localApiPort);
 
-        /* Get hypervisor pid from file */
-        if (info.find("Log folder") != info.end())
-            session->pid = __getPIDFromFile( info["Log folder"] );
+        /* Get hypervisor pid from file (unless VBox.log is the same as the last time) */
+        if (!info.logFolder.empty()) {
+            time_t logTime = getFileModified( info.logFolder + "/VBox.log" );
+            if ((cache->pid != 0) && (logTime == cache->pidLogTime) && (logTime < checkTime)) {
+                session->pid = cache->pid;
+            } else {
+                session->pid = __getPIDFromFile( info.logFolder );
+                cache->pid = session->pid;
+                cache->pidLogTime = logTime;
+            }
+        }
         
         /* Store allProps to properties */
-        ((VBoxSession*)session)->properties = allProps;
+        if (!watched) {
+            boost::unique_lock<boost::mutex> lock( vbSession->propertiesMutex );
+            vbSession->properties = allProps;
+        }
 
     }
+    
+    /* Remember the change signals of this update */
+    cache->valid = true;
+    cache->properties = !fast;
+    cache->timestamp = getMillis();
+    cache->checkTime = checkTime;
+    cache->running = running;
+    cache->configFile = info.configFile;
+    cache->logFolder = info.logFolder;
+    cache->configTime = getFileModified( info.configFile );
+    cache->logTime = getFileModified( info.logFolder + "/VBox.log" );
+    
+    /* Watch the guest properties while the VM is running (only for the registered
+       sessions, not the temporary ones of loadSessions and the templates) */
+    if ((session->state == STATE_STARTED) && (this->sessions.getByID( session->internalID ) == session))
+        vbSession->watchStart();
+    
+    /* Notify about the fields that changed */
+    if (session->onChange) {
+        map<string, string> current = __sessionSnapshot( vbSession );
+        vector<string> changes;
+        for (map<string, string>::iterator it = current.begin(); it != current.end(); ++it) {
+            if (previous[ (*it).first ] != (*it).second)
+                changes.push_back( (*it).first );
+        }
+        if (!changes.empty()) (session->onChange)( changes );
+    }
 
     /* Updated successfuly */
     return HVE_OK;
@@ -2375,48 +3989,310 @@ int Virtualbox::updateSession( HVSession * session, bool fast ) {
 }
 
 /**
- * Load session state from VirtualBox
+ * Refresh the state of the given sessions with a single 'list runningvms'. Only
+ * the sessions that started or stopped since their last update are updated.
  */
-int Virtualbox::loadSessions() {
+int Virtualbox::updateStates( const std::vector<HVSession*> & sessions ) {
     CRASH_REPORT_BEGIN;
     vector<string> lines;
-    map<string, string> vms, diskinfo;
-    string secret, kk, kv;
-    string err;
     
-    /* List the running VMs in the system */
-    int ans;
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list vms", &lines, &err, 2, 2000);
-    NAMED_MUTEX_UNLOCK;
-    if (ans != 0) return HVE_QUERY_ERROR;
+    /* Sample the running VMs now */
+    this->listInvalidate( "runningvms" );
+    if (this->listCached( "runningvms", &lines, 2000, VBOX_RUNNING_CACHE_TTL ) != HVE_OK)
+        return HVE_QUERY_ERROR;
+    
+    /* Collect their UUIDs */
+    set<string> running;
+    for (vector<string>::iterator it = lines.begin(); it != lines.end(); ++it) {
+        size_t iStart = (*it).rfind( '{' );
+        if (iStart == string::npos) continue;
+        running.insert( (*it).substr( iStart ) );
+    }
+    
+    /* Update only the sessions whose running state doesn't match */
+    int ans = HVE_OK;
+    for (vector<HVSession*>::const_iterator i = sessions.begin(); i != sessions.end(); i++) {
+        HVSession * session = *i;
+        if (session->uuid.empty()) continue;
+        bool isRunning = (running.find( session->uuid ) != running.end());
+        bool wasRunning = (session->state == STATE_STARTED) || (session->state == STATE_PAUSED);
+        if ((isRunning == wasRunning) && ((VBoxSession*)session)->updateCache.valid) continue;
+        
+        CVMWA_LOG( "Debug", "Session " << session->uuid << " " << (isRunning ? "started" : "stopped") << ", updating" );
+        int res = this->updateSession( session, true );
+        if (res != HVE_OK) ans = res;
+    }
+    return ans;
+    
+    CRASH_REPORT_END;
+}
 
-    /* Tokenize */
-    vms = tokenize( &lines, '{' );
-    this->sessions.clear();
-    for (std::map<string, string>::iterator it=vms.begin(); it!=vms.end(); ++it) {
-        string name = (*it).first;
-        string uuid = (*it).second;
-        name = name.substr(1, name.length()-3);
-        uuid = uuid.substr(0, uuid.length()-1);
+/**
+ * Collect the resource usage of the host and of all the running sessions with a single
+ * 'metrics query'. The collector is set-up on the first call and again whenever a running
+ * session has no metrics (they exist only while the VM process is running). VirtualBox
+ * produces one sample per VBOX_METRICS_PERIOD, so more frequent calls are no-ops.
+ */
+int Virtualbox::updateMetrics( ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
+    ostringstream args;
+    boost::mutex::scoped_lock lock( this->metricsMutex );
+    
+    /* Don't query more often than the collector samples */
+    long now = getMillis();
+    if ((this->metricsTimestamp != 0) && (now - this->metricsTimestamp < VBOX_METRICS_PERIOD * 1000))
+        return HVE_OK;
+    this->metricsTimestamp = now;
+    
+    /* Setup the collector for all the objects */
+    if (!this->metricsSetup) {
+        args << "metrics setup --period " << VBOX_METRICS_PERIOD << " --samples 1 \"*\" " << VBOX_METRICS_LIST;
+        if (this->exec( args.str(), &lines, NULL, 2, 2000 ) != 0)
+            return HVE_QUERY_ERROR;
+        this->metricsSetup = true;
+        args.str("");
+    }
+    
+    /* Query the last sample of all the objects at once */
+    args << "metrics query \"*\" " << VBOX_METRICS_LIST;
+    if (this->exec( args.str(), &lines, NULL, 2, 2000 ) != 0)
+        return HVE_QUERY_ERROR;
+    map<string, HVINFO_METRIC> samples = __parseMetrics( lines, now );
+    
+    /* Store the host sample */
+    map<string, HVINFO_METRIC>::iterator it = samples.find( "host" );
+    if (it != samples.end()) this->hostMetrics.push( it->second );
+    
+    /* Store the samples of the sessions */
+    vector<HVSession*> sessions = this->sessions.list();
+    for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
+        HVSession * session = *i;
+        it = samples.find( session->name );
+        if (it != samples.end()) {
+            session->metrics.push( it->second );
+        } else if (session->state == STATE_STARTED) {
+            CVMWA_LOG( "Debug", "No metrics for running session " << session->uuid << ", setting-up the collector again" );
+            this->metricsSetup = false;
+        }
+    }
+    
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * The VMs to be probed by the loadSessions() workers and the sessions they found
+ */
+typedef struct {
+    boost::mutex                                    mutex;
+    std::vector< std::pair<std::string, std::string> > vms;
+    std::vector<std::string>                        keys;       // The indexed secret of each VM, empty if unknown
+    size_t                                          next;
+    std::vector<HVSession*>                         found;      // One slot per VM, NULL if not managed
+    std::vector<char>                               unmanaged;  // ..and non-zero if it's known not to be
+} VBOX_LOAD_STATE;
+
+/**
+ * Worker thread of loadSessions(): pick the next VM and check if it's managed by the WebAPI
+ */
+void __loadSessionsWorker( Virtualbox * hv, VBOX_LOAD_STATE * state ) {
+    CRASH_REPORT_BEGIN;
+    for (;;) {
         
-        /* Check if this VM has a secret web key. If yes, it's managed by the WebAPI */
-        secret = this->getProperty( uuid, "/CVMWeb/secret" );
-        if (!secret.empty()) {
-            
-            /* Create a populate session object */
-            HVSession * session = this->allocateSession( name, secret );
+        /* Pick the next VM */
+        string name, uuid, secret;
+        size_t index;
+        {
+            boost::unique_lock<boost::mutex> lock( state->mutex );
+            if (state->next >= state->vms.size()) return;
+            name = state->vms[state->next].first;
+            uuid = state->vms[state->next].second;
+            secret = state->keys[state->next];
+            index = state->next++;
+        }
+        
+        /* Unless the index knows it, check if this VM has a secret web key. If yes, it's managed by the WebAPI */
+        bool indexed = !secret.empty();
+        if (!indexed) {
+            vector<string> lines;
+            string err;
+            int ans;
+            NAMED_MUTEX_LOCK_SHARED( uuid );
+            ans = hv->exec( "guestproperty get " + uuid + " \"/CVMWeb/secret\"", &lines, &err, 2, 2000 );
+            NAMED_MUTEX_UNLOCK;
+            if (ans != 0) continue; // Unknown, it will be probed again next time
+            if (!lines.empty() && (lines[0].substr(0,7) == "Value: "))
+                secret = lines[0].substr(7);
+            if (secret.empty()) {
+                state->unmanaged[index] = 1;
+                continue;
+            }
+        }
+        
+        /* Update the session already registered for this VM in-place, or create a new one.
+           (New sessions are not registered yet, so they don't start a property watcher) */
+        HVSession * session = hv->sessions.getByUUID( "{" + uuid + "}" );
+        bool registered = (session != NULL) && (session->key == secret);
+        if (!registered) {
+            session = hv->allocateSession( name, secret );
             session->uuid = "{" + uuid + "}";
             session->key = secret;
+        }
 
-            /* Update session info */
-            updateSession( session, false );
+        /* Update session info */
+        hv->updateSession( session, false );
+        
+        /* Make sure the indexed VM still carries the same secret */
+        if (indexed) {
+            map<string, string> props = ((VBoxSession*)session)->getProperties();
+            map<string, string>::iterator it = props.find( "/CVMWeb/secret" );
+            if ((it != props.end()) && ((*it).second != secret)) {
+                CVMWA_LOG( "Warning", "Indexed session " << name << " has a different secret, ignoring" );
+                if (!registered) hv->freeSession( session );
+                continue;
+            }
+        }
+        
+        /* Keep it for registration (in the order VirtualBox listed it) */
+        state->found[index] = session;
+        
+    }
+    CRASH_REPORT_END;
+}
 
-            /* Register this session */
-            CVMWA_LOG( "Info", "Registering session name=" << session->name << ", key=" << session->key << ", uuid=" << session->uuid << ", state=" << session->state  );
-            this->registerSession(session);
+/**
+ * Load session state from VirtualBox
+ *
+ * The session index remembers which VMs are managed by the WebAPI (and which
+ * are not), so only the indexed sessions and the VMs the index doesn't know
+ * yet are probed. If there is no usable index, all the registered VMs are
+ * probed for their secret key and the index is rebuilt.
+ */
+int Virtualbox::loadSessions() {
+    CRASH_REPORT_BEGIN;
+    map<string, string> vms;
+    map<string, VBOX_INDEX_ENTRY> index;
+    
+    /* Load the session index before listing the VMs, so a VM indexed
+       meanwhile by another process is not mistaken for a deleted one */
+    this->indexLoad( &index );
+    
+    /* Get the registered VMs. If an indexed VM is missing from the cached listing,
+       list them again, since the listing might just be older than the index. */
+    if (this->registryList( &vms ) != HVE_OK) return HVE_QUERY_ERROR;
+    set<string> listed;
+    for (map<string, string>::iterator it = vms.begin(); it != vms.end(); ++it)
+        listed.insert( (*it).second );
+    for (map<string, VBOX_INDEX_ENTRY>::iterator it = index.begin(); it != index.end(); ++it) {
+        if (listed.find( (*it).first ) != listed.end()) continue;
+        this->registryInvalidate();
+        if (this->registryList( &vms ) != HVE_OK) return HVE_QUERY_ERROR;
+        break;
+    }
 
+    /* Pick the VMs to probe */
+    VBOX_LOAD_STATE state;
+    state.next = 0;
+    set<string> registered;
+    for (std::map<string, string>::iterator it=vms.begin(); it!=vms.end(); ++it) {
+        string name = (*it).first;
+        string uuid = (*it).second;
+        registered.insert( uuid );
+        uuid = uuid.substr(1, uuid.length()-2);
+        
+        /* Skip the VMs the index knows they are not ours */
+        string key;
+        map<string, VBOX_INDEX_ENTRY>::iterator entry = index.find( "{" + uuid + "}" );
+        if (entry != index.end()) {
+            key = (*entry).second.key;
+            if (key.empty()) continue;
+        }
+        
+        state.vms.push_back( std::pair<string, string>( name, uuid ) );
+        state.keys.push_back( key );
+    }
+    state.found.resize( state.vms.size(), NULL );
+    state.unmanaged.resize( state.vms.size(), 0 );
+    
+    /* Probe the VMs in parallel. The hypervisor commands they issue are still
+       throttled by the exec queue, so this only bounds the number of threads. */
+    boost::thread_group workers;
+    size_t numWorkers = state.vms.size();
+    if (numWorkers > VBOX_LOAD_WORKERS) numWorkers = VBOX_LOAD_WORKERS;
+    for (size_t i = 1; i < numWorkers; i++)
+        workers.create_thread( boost::bind( &__loadSessionsWorker, this, &state ) );
+    __loadSessionsWorker( this, &state );
+    workers.join_all();
+    
+    /* Clean-up after the indexed VMs that are no longer registered */
+    vector<string> stale;
+    for (map<string, VBOX_INDEX_ENTRY>::iterator it = index.begin(); it != index.end(); ++it) {
+        if (registered.find( (*it).first ) != registered.end()) continue;
+        if (this->indexRecover( (*it).first, (*it).second ))
+            stale.push_back( (*it).first );
+    }
+    
+    /* Update the index with what we found (re-reading it, since the other
+       processes using it might have opened new sessions meanwhile) */
+    {
+        boost::unique_lock<boost::mutex> lock( this->indexMutex );
+        VBoxIndexLock fileLock( this->indexConfig.getPath( VBOX_SESSION_INDEX_LOCK ) );
+        this->indexRead( &index );
+        for (vector<string>::iterator it = stale.begin(); it != stale.end(); ++it)
+            index.erase( *it );
+        for (size_t i = 0; i < state.vms.size(); i++) {
+            string uuid = "{" + state.vms[i].second + "}";
+            VBoxSession * session = (VBoxSession*)state.found[i];
+            map<string, VBOX_INDEX_ENTRY>::iterator known = index.find( uuid );
+            if (session == NULL) {
+                
+                /* Indexed, but no longer carrying the indexed secret */
+                if (!state.keys[i].empty()) {
+                    if ((known != index.end()) && ((*known).second.key == state.keys[i])) index.erase( known );
+                    continue;
+                }
+                
+                /* Not ours, unless somebody indexed it after we probed it */
+                if (!state.unmanaged[i] || (known != index.end())) continue;
+                VBOX_INDEX_ENTRY * entry = &index[uuid];
+                entry->name = state.vms[i].first;
+                entry->key = "";
+                entry->flags = 0;
+                entry->state = STATE_CLOSED;
+                entry->scratchDisk = "";
+                entry->contextISO = "";
+                continue;
+                
+            }
+            VBOX_INDEX_ENTRY * entry = &index[uuid];
+            entry->name = session->name;
+            entry->key = session->key;
+            entry->flags = session->flags;
+            entry->state = session->state;
+            if (!session->updateCache.diskPath.empty())
+                entry->scratchDisk = session->updateCache.diskPath;
         }
+        this->indexSave( &index );
+    }
+    
+    /* Replace the registered sessions with the ones found, in one go */
+    vector<HVSession*> found, dropped;
+    for (vector<HVSession*>::iterator it = state.found.begin(); it != state.found.end(); ++it) {
+        HVSession * session = *it;
+        if (session == NULL) continue;
+        CVMWA_LOG( "Info", "Registering session name=" << session->name << ", key=" << session->key << ", uuid=" << session->uuid << ", state=" << session->state  );
+        found.push_back( session );
+    }
+    this->sessions.replace( found, &dropped );
+    
+    /* Watch the running ones, and stop watching the sessions that are gone
+       (they are not released, since their users might still refer to them) */
+    for (vector<HVSession*>::iterator it = found.begin(); it != found.end(); ++it) {
+        if ((*it)->state == STATE_STARTED) ((VBoxSession*)*it)->watchStart();
+    }
+    for (vector<HVSession*>::iterator it = dropped.begin(); it != dropped.end(); ++it) {
+        ((VBoxSession*)*it)->watchStop();
     }
 
     return 0;
@@ -2433,10 +4309,7 @@ bool Virtualbox::hasExtPack() {
      * Check for extension pack
      */
     vector<string> lines;
-    string err;
-    NAMED_MUTEX_LOCK("generic");
-    this->exec("list extpacks", &lines, &err, 2, 2000);
-    NAMED_MUTEX_UNLOCK;
+    this->listCached("extpacks", &lines, 2000);
     for (std::vector<std::string>::iterator l = lines.begin(); l != lines.end(); l++) {
         if (l->find("Oracle VM VirtualBox Extension Pack") != string::npos) {
             return true;
@@ -2530,6 +4403,7 @@ int Virtualbox::installExtPack( string versionID, DownloadProviderPtr downloadPr
     if (cbProgress) (cbProgress)(currProgress, progressTotal, "Installing extension pack");
     NAMED_MUTEX_LOCK("generic");
     res = this->exec("extpack install \"" + tmpExtpackFile + "\"", NULL, &err, 2);
+    this->listInvalidateBy( "extpack install" );
     NAMED_MUTEX_UNLOCK;
     if (res != HVE_OK) return HVE_EXTERNAL_ERROR;
 
@@ -23,18 +23,174 @@
 
 #include "Hypervisor.h"
 #include "CrashReport.h"
+#include "LocalConfig.h"
 #include <map>
 #include <boost/regex.hpp>
 
+/* How long (in ms) the output of a slow-changing listing is reused */
+#define VBOX_LIST_CACHE_TTL     60000
+
+/* How long (in ms) the list of running VMs is reused by the session updates */
+#define VBOX_RUNNING_CACHE_TTL  2000
+
+/* Maximum time (in ms) a session update can be skipped because nothing changed */
+#define VBOX_UPDATE_MAX_AGE     60000
+
+/* Maximum number of VMs probed in parallel by loadSessions() */
+#define VBOX_LOAD_WORKERS       4
+
+/* How long (in ms) a single 'guestproperty wait' of the property watcher lasts */
+#define VBOX_WATCH_TIMEOUT      30000
+
+/* Consecutive failures after which the property watcher gives up (ex. the VM is stopped) */
+#define VBOX_WATCH_FAILURES     3
+
+/* What 'guestproperty wait' reports when no property changed within its timeout */
+#define VBOX_WATCH_TIMEDOUT     "Time out or interruption while waiting for a notification"
+
+/* How long (in ms) guest property writes are buffered before they are flushed */
+#define VBOX_PROPERTY_FLUSH_DELAY   500
+
+/* Collection period (in seconds) of the VirtualBox metrics. They are not queried more often. */
+#define VBOX_METRICS_PERIOD     5
+
+/* The metrics collected for the host and the VMs */
+#define VBOX_METRICS_LIST       "CPU/Load/User,CPU/Load/Kernel,RAM/Usage/Used"
+
+/* Maximum time (in ms) the cached VM registry is trusted without listing the VMs again */
+#define VBOX_REGISTRY_MAX_AGE   60000
+
+/* Name prefix of the template VMs the CernVM-Micro sessions are cloned from */
+#define VBOX_TEMPLATE_PREFIX    "CVMWeb-Template-"
+
+/* Snapshot of the template VMs the linked clones are based on */
+#define VBOX_TEMPLATE_SNAPSHOT  "base"
+
+/* Time (in seconds) after which an incomplete template VM is considered abandoned by whoever was building it */
+#define VBOX_TEMPLATE_BUILD_TIME 600
+
+/* Session flags that shape the template VM (the rest are applied on each clone) */
+#define VBOX_TEMPLATE_FLAGS     (HVF_SYSTEM_64BIT | HVF_GUEST_ADDITIONS)
+
+/* Name prefix of the pre-created VMs waiting to be claimed by new sessions */
+#define VBOX_POOL_PREFIX        "CVMWeb-Pool-"
+
+/* Host memory (MB) left out when deciding how many pool VMs the host could run */
+#define VBOX_POOL_RESERVE       1024
+
+/* Time (in seconds) after which a configuration no session was opened with is not kept in the pool anymore */
+#define VBOX_POOL_IDLE_TIME     3600
+
+/* Name of the session index file (under the LocalConfig directory) */
+#define VBOX_SESSION_INDEX      "sessions"
+
+/* Lock file serializing the session index updates of the plugin and the daemon */
+#define VBOX_SESSION_INDEX_LOCK "sessions.lock"
+
 /* Forward decleration */
 class Virtualbox;
 
+/**
+ * Cached output of a 'VBoxManage list' command
+ */
+typedef struct {
+    
+    long                        timestamp;  // When the listing was fetched (getMillis)
+    std::vector<std::string>    lines;      // The STDOUT lines of the listing
+    
+} VBOX_LIST_CACHE;
+
+/**
+ * Virtual machine information, parsed from 'showvminfo --machinereadable'
+ */
+typedef struct {
+    
+    std::string                         name;
+    std::string                         osType;         // Guest OS description
+    std::string                         configFile;     // The .vbox settings file
+    std::string                         logFolder;
+    std::string                         state;          // ex. "running", "paused", "saved", "poweroff"
+    int                                 memory;         // Memory size (MB)
+    int                                 cpus;
+    int                                 executionCap;   // CPU execution cap (%)
+    bool                                vrdeEnabled;
+    int                                 vrdePort;
+    std::string                         videoMode;      // ex. "1024x768x32"
+    std::vector<std::string>            controllers;    // Names of the storage controllers
+    std::map<std::string, std::string>  media;          // Attached media by "<controller>-<port>-<device>"
+    std::vector<std::string>            natRules;       // Port forwarding rules ("name,proto,hostip,hostport,guestip,guestport")
+    std::string                         snapshot;       // Name of the current snapshot (empty if none)
+    
+} VBOX_VMINFO;
+
+/**
+ * The change signals and the results of the last complete session update
+ */
+typedef struct {
+    
+    bool                        valid;          // A complete update was performed
+    bool                        properties;     // ..and it also collected the guest properties
+    long                        timestamp;      // When it was performed (getMillis)
+    time_t                      checkTime;      // When it started (files modified since then are re-checked)
+    std::string                 configFile;     // The .vbox settings file
+    std::string                 logFolder;
+    time_t                      configTime;     // Modification time of the settings file
+    time_t                      logTime;        // Modification time of VBox.log
+    bool                        running;        // The VM was listed in 'list runningvms'
+    std::string                 diskPath;       // The scratch disk of the cached size
+    int                         diskSize;
+    time_t                      pidLogTime;     // Modification time of VBox.log when the PID was extracted
+    int                         pid;
+    
+} VBOX_UPDATE_CACHE;
+
+/**
+ * A CVMWeb-owned VM, as remembered by the session index
+ */
+typedef struct {
+    
+    std::string                 name;
+    std::string                 key;            // The web secret of the session
+    int                         flags;
+    int                         state;          // Last known session state
+    std::string                 scratchDisk;    // Path of the scratch disk
+    std::string                 contextISO;     // Path of the contextualization CD-ROM
+    
+} VBOX_INDEX_ENTRY;
+
+/**
+ * A session configuration the VM pool is kept filled for
+ */
+typedef struct {
+    
+    std::string                 cvmVersion;
+    int                         disk;           // Scratch disk size (MB)
+    int                         flags;
+    int                         memory;         // RAM of the sessions using it (MB)
+    long                        lastUsed;       // When a session was last opened with it (getMillis)
+    
+} VBOX_POOL_CONFIG;
+
 /**
  * VirtualBox Session
  */
 class VBoxSession : public HVSession {
 public:
     
+    VBoxSession() : HVSession() {
+        this->watchThread = NULL;
+        this->watchActive = false;
+        this->watchStopped = false;
+        this->flushThread = NULL;
+        this->flushActive = false;
+    };
+    
+    virtual ~VBoxSession() {
+        this->watchStop();
+        this->flushProperties();
+        this->discardProperties();
+    };
+    
     Virtualbox *            host;
     int                     rdpPort;
     int                     localApiPort;
@@ -62,22 +218,45 @@ public:
     int                     wrapExec            ( std::string cmd, std::vector<std::string> * stdoutList, std::string * stderrMsg = NULL, int retries = 4, int timeout = SYSEXEC_TIMEOUT );
     int                     getMachineUUID      ( std::string mname, std::string * ans_uuid,  int flags );
     std::string             getDataFolder       ();
-    std::string             getHostOnlyAdapter  ();
-    std::map<std::string, 
-        std::string>        getMachineInfo      ( int timeout = SYSEXEC_TIMEOUT );
+    int                     getMachineInfo      ( VBOX_VMINFO * info, int timeout = SYSEXEC_TIMEOUT );
     int                     startVM             ();
     int                     controlVM           ( std::string how, int timeout = SYSEXEC_TIMEOUT );
+    
+    /* Guest property watcher */
+    void                    watchStart          ();
+    void                    watchStop           ();
+    bool                    isWatching          ();
+    std::map<std::string, std::string> getProperties ();
+    void                    applyProperties     ( const std::map<std::string, std::string> & props, bool complete );
+    
+    /* Write-behind buffer of the guest properties */
+    int                     flushProperties     ();
+    void                    discardProperties   ();
 
     std::string             dataPath;
     bool                    updateLock;
+    VBOX_UPDATE_CACHE       updateCache;
     
     /* Offline properties map (for optimizing performance) */
+    boost::mutex            propertiesMutex;
     std::map<
         std::string,
         std::string >       properties;
     std::map<
         std::string,
-        std::string >       unsyncedProperties;
+        std::string >       unsyncedProperties; // Pending writes (see setProperty)
+
+private:
+    void                    watchLoop           ();
+    boost::mutex            watchMutex;
+    boost::thread *         watchThread;
+    bool                    watchActive;
+    bool                    watchStopped;
+    SysExecAbort            watchAbort;         // Kills the pending 'guestproperty wait' on stop
+    void                    flushLoop           ();
+    boost::mutex            flushMutex;
+    boost::thread *         flushThread;
+    bool                    flushActive;
     
 };
 
@@ -89,7 +268,20 @@ public:
 
     Virtualbox() : Hypervisor() {
         this->sessionLoaded = false;
+        this->listCacheGeneration = 0;
+        this->metricsSetup = false;
+        this->metricsTimestamp = 0;
+        this->registryValid = false;
+        this->registryTimestamp = 0;
+        this->registryTime = 0;
+        this->hostOnlyValid = false;
+        this->hostOnlyBusy = false;
+        this->poolBusy = false;
+        this->poolPending = false;
+        this->poolStop = false;
+        this->poolChecked = false;
     };
+    virtual ~Virtualbox();
 
     std::string             hvGuestAdditions;
 
@@ -98,22 +290,111 @@ public:
 
     /* Internal parameters */
     int                     prepareSession      ( VBoxSession * session );
-    std::map<std::string, 
-        std::string>        getMachineInfo      ( std::string uuid, int timeout = SYSEXEC_TIMEOUT );
+    bool                    isRunning           ( std::string uuid );
+    bool                    sessionChanged      ( VBoxSession * session, bool * running );
+    int                     getMachineInfo      ( std::string uuid, VBOX_VMINFO * info, int timeout = SYSEXEC_TIMEOUT );
     std::string             getProperty         ( std::string uuid, std::string name );
     std::vector< std::map< std::string, std::string > > getDiskList();
     std::map<std::string, std::string> getAllProperties  ( std::string uuid );
+    
+    /* Cached listings */
+    int                     listCached          ( std::string listing, std::vector<std::string> * lines, int timeout = SYSEXEC_TIMEOUT, int ttl = VBOX_LIST_CACHE_TTL );
+    void                    listInvalidate      ( std::string listing );
+    void                    listInvalidateBy    ( std::string cmd );
+    
+    /* Cached VM registry (VM name to UUID) */
+    int                     registryLookup      ( std::string name, std::string * uuid );
+    int                     registryList        ( std::map<std::string, std::string> * vms );
+    time_t                  registryModified    ( );
+    void                    registryAdd         ( std::string name, std::string uuid, time_t before );
+    void                    registryRemove      ( std::string uuid, time_t before );
+    void                    registryInvalidate  ( );
+    
+    /* Local ports used by all the registered VMs */
+    void                    reserveRegisteredPorts ( );
+    
+    /* Template VMs (for the CernVM-Micro sessions) */
+    int                     templateClone       ( std::string name, std::string cvmVersion, int disk, int flags, std::string * uuid, callbackProgress progress = 0 );
+    
+    /* Pool of pre-created VMs (for the CernVM-Micro sessions) */
+    int                     poolClaim           ( std::string name, std::string cvmVersion, int disk, int flags, int memory, std::string * uuid );
+    void                    poolRefill          ( );
+    
+    /* Host-only network (shared by all the VMs) */
+    std::string             hostOnlyAdapter     ( );
+    void                    hostOnlyInvalidate  ( );
+    
+    /* Session index */
+    int                     indexLoad           ( std::map<std::string, VBOX_INDEX_ENTRY> * index );
+    void                    indexStore          ( VBoxSession * session, VBOX_VMINFO * info = NULL );
+    void                    indexRemove         ( std::string uuid );
+    bool                    indexRecover        ( std::string uuid, const VBOX_INDEX_ENTRY & entry );
 
     /* Overloads */
     virtual int             loadSessions        ( );
     virtual int             updateSession       ( HVSession * session, bool fast );
+    virtual int             updateStates        ( const std::vector<HVSession*> & sessions );
+    virtual int             updateMetrics       ( );
     virtual HVSession *     allocateSession     ( std::string name, std::string key );
     virtual int             getCapabilities     ( HVINFO_CAPS * caps );
     virtual bool            waitTillReady       ( std::string pluginVersion, callbackProgress progress = 0, int progressMin = 0, int progressMax = 100, int progressTotal = 100 );
+    virtual void            setPoolSize         ( int size );
 
 private:
     bool                    sessionLoaded;
     
+    boost::mutex                                listCacheMutex;
+    std::map< std::string, VBOX_LIST_CACHE >    listCache;
+    long                                        listCacheGeneration;
+    
+    boost::mutex                                registryMutex;
+    std::map< std::string, std::string >        registry;           // VM name to UUID
+    bool                                        registryValid;
+    long                                        registryTimestamp;  // When the VMs were listed (getMillis)
+    std::string                                 registryFile;       // The global VirtualBox.xml settings file
+    time_t                                      registryTime;       // ..and its modification time when they were listed
+    bool                                        registryFresh       ( );
+    int                                         registryRefresh     ( );
+    
+    boost::mutex                                portsMutex;
+    std::map< std::string, time_t >             portsScanned;       // Settings files already scanned for ports, and their modification time
+    
+    boost::mutex                                templateMutex;
+    std::map< std::string, std::string >        templates;          // UUIDs of the verified template VMs, by name
+    std::map< std::string, boost::shared_ptr<boost::mutex> > templateLocks; // Serialize the check and build of each template, by name
+    std::string                                 templateKey         ( std::string cvmVersion, int disk, int flags );
+    int                                         templateCheck       ( std::string name, std::string * uuid );
+    int                                         templateBuild       ( std::string name, std::string vmIso, int disk, int flags, std::string * uuid, callbackProgress progress );
+    
+    boost::mutex                                poolMutex;
+    boost::condition_variable                   poolCond;
+    std::map< std::string, VBOX_POOL_CONFIG >   poolConfigs;        // The configurations in use, by template key
+    bool                                        poolBusy;           // The refill thread is running
+    bool                                        poolPending;        // ..and it has to check again when done
+    bool                                        poolStop;
+    bool                                        poolChecked;        // The pool VMs left behind were checked
+    int                                         poolTarget          ( const VBOX_POOL_CONFIG & config );
+    void                                        poolTrim            ( const std::map<std::string, int> & targets );
+    void                                        poolSchedule        ( );
+    void                                        poolRefillThread    ( );
+    
+    boost::mutex                                hostOnlyMutex;
+    boost::condition_variable                   hostOnlyCond;
+    bool                                        hostOnlyValid;
+    bool                                        hostOnlyBusy;       // A thread is provisioning it
+    std::string                                 hostOnlyName;
+    std::string                                 hostOnlyProvision   ( );
+    int                                         hostOnlyExec        ( const std::string & cmd );
+    
+    boost::mutex                                metricsMutex;
+    bool                                        metricsSetup;
+    long                                        metricsTimestamp;
+    
+    boost::mutex                                indexMutex;
+    LocalConfig                                 indexConfig;
+    bool                                        indexRead           ( std::map<std::string, VBOX_INDEX_ENTRY> * index );
+    void                                        indexSave           ( std::map<std::string, VBOX_INDEX_ENTRY> * index );
+    
 };
 
 #endif /* end of include guard: VIRTUALBOX_H */
@@ -45,11 +45,15 @@ using namespace std;
 // Delay between time-critical operations
 #define             FAST_TIMER       5
 
+// Time window (in seconds) over which the CPU load is averaged
+#define             LOAD_WINDOW     30
+
 ThinIPCEndpoint     * ipc;
 Hypervisor          * hv;
 time_t                reloadTimer;
 time_t                probeTimer;
 int                   idleTime;
+int                   idleLoad;
 bool                  isIdle = false;
 bool                  isAlive = true;
 LocalConfig         * config;
@@ -58,8 +62,6 @@ boost::mutex          sessionsMutex;
 boost::thread         reloadThread;
 bool                  reloadTriggered = false;
 
-vector<int>           monitoredPids;
-
 /**
  * Switch the idle states of the VMs
  */
@@ -73,7 +75,8 @@ void switchIdleStates( bool idle ) {
     /* Pause all the VMs if we are not idle */
     if (!idle) {
         
-        for (vector<HVSession*>::iterator i = hv->sessions.begin(); i != hv->sessions.end(); i++) {
+        vector<HVSession*> sessions = hv->sessions.list();
+        for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
             HVSession* sess = *i;
             if (sess->daemonControlled) {
                 cout << "INFO: Switching to idle VM " << sess->uuid << " (" << sess->name << ")" << endl;
@@ -109,7 +112,8 @@ void switchIdleStates( bool idle ) {
         
     } else {
         
-        for (vector<HVSession*>::iterator i = hv->sessions.begin(); i != hv->sessions.end(); i++) {
+        vector<HVSession*> sessions = hv->sessions.list();
+        for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
             HVSession* sess = *i;
             if (sess->daemonControlled) {
                 cout << "INFO: Switching to active VM " << sess->uuid << " (" << sess->name << ")" << endl;
@@ -163,6 +167,7 @@ void switchIdleStates( bool idle ) {
  */
 void reloadSessions_thread() {
     if (!isAlive) return;
+    setExecPriority( HVP_BACKGROUND );
 
     /* Acquire mutex between switchIdleStates & reloadSessions */
     sessionsMutex.lock();
@@ -172,7 +177,8 @@ void reloadSessions_thread() {
     
     // Check if we don't need the daemon any more
     bool needsDaemon = false;
-    for (vector<HVSession*>::iterator i = hv->sessions.begin(); i != hv->sessions.end(); i++) {
+    vector<HVSession*> sessions = hv->sessions.list();
+    for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
         HVSession* sess = *i;
         if (sess->daemonControlled) {
             needsDaemon = true;
@@ -212,19 +218,26 @@ void reapDead() {
     cout << "[INFO] reapDead";
     sessionsMutex.lock();
     cout << " started" << endl;
-    for (vector<HVSession*>::iterator i = hv->sessions.begin(); i != hv->sessions.end(); i++) {
+    vector<HVSession*> sessions = hv->sessions.list();
+    vector<HVSession*> reapable;
+    for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
         HVSession* sess = *i;
-        if (sess->daemonControlled && ((sess->daemonFlags & DF_AUTODESTROY) != 0) ) {
-            
-            // Update sesion status
-            sess->updateFast();
-
-            // If it's closed, destroy
-            if (sess->state == STATE_OPEN) {
-                needsUpdate = true;
-                sess->close();
-            }
-
+        if (sess->daemonControlled && ((sess->daemonFlags & DF_AUTODESTROY) != 0) )
+            reapable.push_back( sess );
+    }
+    
+    // Update the status of all of them at once
+    if (!reapable.empty()) {
+        HVExecPriority priority( HVP_BACKGROUND );
+        hv->updateStates( reapable );
+    }
+    
+    // If it's closed, destroy
+    for (vector<HVSession*>::iterator i = reapable.begin(); i != reapable.end(); i++) {
+        HVSession* sess = *i;
+        if (sess->state == STATE_OPEN) {
+            needsUpdate = true;
+            sess->close();
         }
     }
     sessionsMutex.unlock();
@@ -283,6 +296,45 @@ void serverThread() {
                 reloadTimer = time(NULL);
                 reloadSessions();
                 
+            } else if (iAction == DIPC_GET_EXECSTATS) { // Return the telemetry of the n-th hypervisor command
+                unsigned short index = msg.readShort();
+                std::map<std::string, HVINFO_EXEC> stats;
+                hv->getExecStats( &stats );
+                ans.writeShort(DIPC_ANS_OK);
+                ans.writeShort( stats.size() );
+                if (index < stats.size()) {
+                    std::map<std::string, HVINFO_EXEC>::iterator it = stats.begin();
+                    std::advance( it, index );
+                    HVINFO_EXEC * info = &(*it).second;
+                    ans.writeString( (*it).first );
+                    ans.writeLong( info->calls );
+                    ans.writeLong( info->failures );
+                    ans.writeLong( info->retries );
+                    ans.writeLong( info->timeouts );
+                    ans.writeLong( info->bytes );
+                    ans.writeLong( info->totalTime );
+                    ans.writeLong( info->maxTime );
+                    for (int i = 0; i < HV_EXEC_BUCKETS; i++)
+                        ans.writeLong( info->latency[i] );
+                    ans.writeLong( info->coalesced );
+                }
+                
+            } else if (iAction == DIPC_GET_QUEUESTATS) { // Return the metrics of the hypervisor command queue
+                HVINFO_QUEUE stats;
+                hv->getQueueStats( &stats );
+                ans.writeShort(DIPC_ANS_OK);
+                ans.writeInt( stats.running );
+                for (int i = 0; i < HVP_CLASSES; i++) {
+                    ans.writeInt( stats.depth[i] );
+                    ans.writeInt( stats.maxDepth[i] );
+                    ans.writeLong( stats.executed[i] );
+                    ans.writeLong( stats.waitTime[i] );
+                    ans.writeLong( stats.maxWaitTime[i] );
+                }
+                ans.writeLong( stats.locks );
+                ans.writeLong( stats.lockWaitTime );
+                ans.writeLong( stats.spacingWaitTime );
+                
             } else {
                 ans.writeShort(DIPC_ANS_ERROR);
             }
@@ -296,73 +348,28 @@ void serverThread() {
 }
 
 /**
- * Check if system is idle
+ * Check if the resources of the system are idle, that's when the CPU load of the
+ * host, excluding the load of our VMs, is under idleLoad. If the hypervisor cannot
+ * measure it, only the input idle time is taken into account.
  */
 bool isSystemIdle() {
-    /* Acquire mutex between switchIdleStates & reloadSessions */
-    sessionsMutex.lock();
-
-    /* Use resource detection when available */
-    bool enableResourceDetection = true;
-
-    /* Check what PIDs were found in the sessions */
-    vector<int> usedPids;
-
-    /* Calculate the CPU usage of each PID */
-    platformBeginMeasurement();
-    for (vector<HVSession*>::iterator i = hv->sessions.begin(); i != hv->sessions.end(); i++) {
+    HVINFO_METRIC host, vm;
+    
+    /* Use the host load only if it's fresh */
+    if (!hv->hostMetrics.average( LOAD_WINDOW * 1000, &host )) return true;
+    if (getMillis() - host.timestamp > LOAD_WINDOW * 1000) return true;
+    float load = host.cpuUser + host.cpuKernel;
+    
+    /* Exclude the load of the VMs sampled at the same time */
+    vector<HVSession*> sessions = hv->sessions.list();
+    for (vector<HVSession*>::iterator i = sessions.begin(); i != sessions.end(); i++) {
         HVSession * sess = *i;
-        if (sess->daemonControlled) {
-
-            /* If we don't have a PID it means that at least one hypervisor
-             * process won't be calculated on the resources calculation mechanism
-             * which also means that we cannot trust the CPU usage of the system
-             * (again: because there might be a hypervisor running that WE instantiated,
-             *  but the system does not grant as access).
-             *
-             * This means we should disable the more advanced Resource-based idle
-             * detection, and keep only the last input time. */
-            if (sess->pid == 0) {
-                enableResourceDetection = false;
-                break;
-            }
-
-            /* If this PID is not monitored, start monitoring */
-            if (std::find( monitoredPids.begin(), monitoredPids.end(), sess->pid) == monitoredPids.end() ) {
-                monitoredPids.push_back( sess->pid );
-                platformStartMonitorPID( sess->pid );
-            }
-
-            /* Mark this PID as used */
-            usedPids.push_back( sess->pid );
-
-            /* Get CPU Usage */
-            cout << "[INFO] Checking session " << sess->uuid << " (Pid " << sess->pid << ")" << endl;
-            platformCPUProcessUsage( sess->pid );
-        }
-    }
-    platformEndMeasurement();
-
-    /* Check which PIDs were not used any more and stop monitoring them */
-    vector<int>::iterator it = monitoredPids.begin();
-    for ( ; it != monitoredPids.end(); ) {
-        int pid = *it;
-        if (std::find( usedPids.begin(), usedPids.end(), pid) == usedPids.end() ) {
-
-            /* PID Not used any more */
-            platformStopMonitorPID( pid );
-
-            /* Delete PID from monitoredPids */
-            monitoredPids.erase( it );
-
-        } else {
-            ++it;
-        }
+        if (!sess->metrics.average( LOAD_WINDOW * 1000, &vm )) continue;
+        if (vm.timestamp != host.timestamp) continue;
+        load -= vm.cpuUser + vm.cpuKernel;
     }
-
-    /* Release mutex */
-    sessionsMutex.unlock();
-    return false;
+    
+    return load < idleLoad;
 }
 
 /**
@@ -409,6 +416,14 @@ int main( int argc, char ** argv ) {
     idleTime = config->getNumDef<int>( "idle-time", 30 );
     config->setNum("idle-time", idleTime);
     cout << "[INFO] Using idle-time: " << idleTime << endl;
+    idleLoad = config->getNumDef<int>( "idle-load", 25 );
+    config->setNum("idle-load", idleLoad);
+    cout << "[INFO] Using idle-load: " << idleLoad << endl;
+    setNamedMutexSpacing( config->getNumDef<int>( "command-spacing", NAMED_MUTEX_SPACING ) );
+    hv->setExecConcurrency( config->getNumDef<int>( "exec-concurrency", HV_EXEC_CONCURRENCY ) );
+    
+    /* The daemon manages the VM lifecycle (unless it's just polling) */
+    setExecPriority( HVP_LIFECYCLE );
     
     /* Reset state */
     reloadTimer = time( NULL );
@@ -441,18 +456,21 @@ int main( int argc, char ** argv ) {
             // Reap dead sessions
             reapDead();
 
+            // Sample the resource usage
+            HVExecPriority priority( HVP_BACKGROUND );
+            hv->updateMetrics();
+
         }
         
         /* Check for idle state switch */
-        //isSystemIdle();
         if (isIdle) {
-            if ( platformIdleTime() < idleTime ) {
+            if ( (platformIdleTime() < idleTime) || !isSystemIdle() ) {
                 isIdle = false;
                 cout << "INFO: Switching to ACTIVE state" << endl;
                 switchIdleStates( false );
             }
         } else {
-            if ( platformIdleTime() >= idleTime ) {
+            if ( (platformIdleTime() >= idleTime) && isSystemIdle() ) {
                 isIdle = true;
                 cout << "INFO: Reloading sessions" << endl;
                 reloadSessions();
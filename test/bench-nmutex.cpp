@@ -0,0 +1,117 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+/**
+ * Stress benchmark of the named mutex registry: Many threads lock and unlock
+ * distinct names (like the disk paths of 'showhdinfo') and a few shared names
+ * (like the VM UUIDs), in shared and exclusive mode. It is compared against a
+ * single map behind one global lock, that never forgets a name.
+ *
+ * Usage: bench-nmutex [threads] [locks per thread] 2>/dev/null
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <iostream>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "Utilities.h"
+
+using namespace std;
+
+/* Names shared by all the threads */
+#define SHARED_NAMES    8
+
+/**
+ * The naive registry: One global lock and no eviction
+ */
+boost::mutex                                        globalMutex;
+map< string, boost::shared_ptr<boost::mutex> >      globalNames;
+
+/**
+ * The name the given thread locks on its i-th iteration
+ */
+string lockName( int thread, int i ) {
+    int shared = i % SHARED_NAMES;
+    if ((i % 2) == 0) return "vm-" + ntos<int>( shared );
+    return "hd-" + ntos<int>( thread ) + "-" + ntos<int>( i );
+}
+
+/**
+ * Worker hammering the named mutex registry
+ */
+void registryWorker( int thread, int iterations ) {
+    for (int i = 0; i < iterations; i++) {
+        NAMED_MUTEX_LOCK_MODE( lockName( thread, i ), ((i % 4) < 2) ? NMUTEX_SHARED : NMUTEX_EXCLUSIVE );
+        NAMED_MUTEX_UNLOCK;
+    }
+}
+
+/**
+ * Worker hammering the naive registry
+ */
+void globalWorker( int thread, int iterations ) {
+    for (int i = 0; i < iterations; i++) {
+        boost::shared_ptr<boost::mutex> m;
+        {
+            boost::unique_lock<boost::mutex> lock( globalMutex );
+            boost::shared_ptr<boost::mutex> & entry = globalNames[ lockName( thread, i ) ];
+            if (!entry) entry.reset( new boost::mutex() );
+            m = entry;
+        }
+        boost::unique_lock<boost::mutex> lock( *m );
+    }
+}
+
+/**
+ * Run the given worker on the given number of threads and return the time it took (ms)
+ */
+long run( void (*worker)(int, int), int threads, int iterations ) {
+    boost::thread_group group;
+    long t = getMillis();
+    for (int i = 0; i < threads; i++)
+        group.create_thread( boost::bind( worker, i, iterations ) );
+    group.join_all();
+    return getMillis() - t;
+}
+
+int main( int argc, char ** argv ) {
+    int threads = (argc > 1) ? atoi(argv[1]) : 16;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 100000;
+    double locks = (double)threads * iterations;
+    long t;
+    
+    setNamedMutexSpacing( 0 );
+    cout << threads << " threads, " << iterations << " locks per thread, half of them on " << SHARED_NAMES << " shared names" << endl;
+    
+    t = run( &registryWorker, threads, iterations );
+    cout << "Named mutex registry: " << t << " ms, " << (long)(locks * 1000 / (t ? t : 1)) << " locks/s, "
+         << getNamedMutexCount() << " names left" << endl;
+    
+    t = run( &globalWorker, threads, iterations );
+    cout << "Global lock, no eviction: " << t << " ms, " << (long)(locks * 1000 / (t ? t : 1)) << " locks/s, "
+         << globalNames.size() << " names left" << endl;
+    
+    return 0;
+}
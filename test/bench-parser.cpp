@@ -0,0 +1,160 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+/**
+ * Microbenchmark of the VBoxManage output parsing: The incremental OutputParser,
+ * fed in chunks the way sysExecParsed() delivers the pipe data, against the
+ * previous splitLines() + tokenize() / per-line string search path.
+ *
+ * The sample files in data/ follow the format of 'showvminfo --machinereadable'
+ * and 'guestproperty enumerate' of VirtualBox 4.3.
+ *
+ * Usage: bench-parser [iterations] [showvminfo file] [guestproperty file] 2>/dev/null
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "Utilities.h"
+
+#ifndef TEST_DATA_DIR
+#define TEST_DATA_DIR "data"
+#endif
+
+/* The size of the chunks fed to the parser (the pipe buffer of sysExec) */
+#define CHUNK_SIZE 4096
+
+using namespace std;
+
+/* Defined in Virtualbox.cpp */
+map<string, string> __parseGuestProperties( const OutputParser & output );
+
+/**
+ * Load the contents of the given file
+ */
+string readFile( const string & path ) {
+    ifstream f( path.c_str(), ios::in | ios::binary );
+    ostringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+/**
+ * Feed the raw output to the parser in pipe-sized chunks
+ */
+void feedChunks( OutputParser & output, const string & raw ) {
+    for (size_t i = 0; i < raw.length(); i += CHUNK_SIZE) {
+        output.feed( raw.data() + i, (raw.length() - i < CHUNK_SIZE) ? raw.length() - i : CHUNK_SIZE );
+    }
+    output.finish();
+}
+
+/**
+ * The guest property parsing of getAllProperties() before the OutputParser
+ */
+map<string, string> legacyGuestProperties( const string & raw ) {
+    map<string, string> ans;
+    vector<string> lines;
+    splitLines( raw, &lines );
+    for (vector<string>::iterator it = lines.begin(); it < lines.end(); it++) {
+        string line = *it;
+        size_t kBegin = line.find("Name: ");
+        if (kBegin == string::npos) continue;
+        size_t kEnd = line.find(", value:");
+        if (kEnd == string::npos) continue;
+        size_t vEnd = line.find(", timestamp:");
+        if (vEnd == string::npos) continue;
+        kBegin += 6;
+        string vKey = line.substr( kBegin, kEnd - kBegin );
+        size_t vBegin = kEnd + 9;
+        ans[vKey] = line.substr( vBegin, vEnd - vBegin );
+    }
+    return ans;
+}
+
+/**
+ * Run the given parser over the sample and print the throughput
+ */
+template <typename F> void run( const string & title, int iterations, const string & raw, F parse ) {
+    size_t count = 0;
+    long t = getMillis();
+    for (int i = 0; i < iterations; i++) {
+        count += parse( raw );
+    }
+    t = getMillis() - t;
+    if (t == 0) t = 1;
+    cout << title << ": " << iterations << " runs, " << ((double)t / iterations * 1000.0) << " us/run, "
+         << ((double)raw.length() * iterations / 1048576.0 / t * 1000.0) << " MB/s ("
+         << (count / iterations) << " entries)" << endl;
+}
+
+size_t vminfoLegacy( const string & raw ) {
+    vector<string> lines;
+    splitLines( raw, &lines );
+    map<string, string> info = tokenize( &lines, '=' );
+    return info.size();
+}
+
+size_t vminfoParser( const string & raw ) {
+    OutputParser output( '=' );
+    feedChunks( output, raw );
+    size_t found = 0;
+    for (size_t i = 0; i < output.size(); i++) {
+        if (!output.key(i).empty()) found++;
+        output.value(i);
+    }
+    return found;
+}
+
+size_t propsLegacy( const string & raw ) {
+    return legacyGuestProperties( raw ).size();
+}
+
+size_t propsParser( const string & raw ) {
+    OutputParser output;
+    feedChunks( output, raw );
+    return __parseGuestProperties( output ).size();
+}
+
+int main( int argc, char ** argv ) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+    string vminfo = readFile( (argc > 2) ? argv[2] : TEST_DATA_DIR "/showvminfo.txt" );
+    string props = readFile( (argc > 3) ? argv[3] : TEST_DATA_DIR "/guestproperty-enumerate.txt" );
+    if (vminfo.empty() || props.empty()) {
+        cerr << "Could not read the sample output files" << endl;
+        return 1;
+    }
+    
+    cout << "showvminfo (" << vminfo.length() << " bytes)" << endl;
+    run( "  splitLines + tokenize", iterations, vminfo, vminfoLegacy );
+    run( "  OutputParser         ", iterations, vminfo, vminfoParser );
+    
+    cout << "guestproperty enumerate (" << props.length() << " bytes)" << endl;
+    run( "  splitLines + find    ", iterations, props, propsLegacy );
+    run( "  OutputParser         ", iterations, props, propsParser );
+    
+    return 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+/**
+ * Benchmark of the process launch: The latency of sysExec() (posix_spawn) against
+ * fork() + execv(), while the process holds a large resident heap, like the
+ * browser process the plugin lives in.
+ *
+ * Usage: bench-spawn [heap MB] [iterations] 2>/dev/null
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "Utilities.h"
+
+using namespace std;
+
+/**
+ * Launch the given command with fork() + execv() and wait for it
+ */
+int forkExec( const char * app ) {
+    pid_t pidChild = fork();
+    if (pidChild == -1) return -1;
+    if (pidChild == 0) {
+        execl(app, app, (char *)NULL);
+        _exit(254);
+    }
+    int ret;
+    waitpid(pidChild, &ret, 0);
+    return ret;
+}
+
+int main( int argc, char ** argv ) {
+    int heapMB = (argc > 1) ? atoi(argv[1]) : 1024;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 100;
+    vector<string> lines;
+    string err;
+    long t;
+    
+    /* Make the heap resident, so fork() has page tables to copy */
+    vector<char *> heap;
+    for (int i = 0; i < heapMB; i++) {
+        char * block = (char *)malloc( 1024 * 1024 );
+        memset( block, i, 1024 * 1024 );
+        heap.push_back( block );
+    }
+    cout << "Resident heap: " << heapMB << " MB" << endl;
+    
+    initSysExec();
+    t = getMillis();
+    for (int i = 0; i < iterations; i++)
+        sysExec( "/bin/true", "", &lines, &err );
+    cout << "sysExec (posix_spawn): " << ((double)(getMillis() - t) / iterations) << " ms per launch" << endl;
+    
+    t = getMillis();
+    for (int i = 0; i < iterations; i++)
+        forkExec( "/bin/true" );
+    cout << "fork + execv:          " << ((double)(getMillis() - t) / iterations) << " ms per launch" << endl;
+    
+    for (size_t i = 0; i < heap.size(); i++) free( heap[i] );
+    return 0;
+}
@@ -0,0 +1,135 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+/**
+ * Benchmark of the session state refresh of the daemon against a fake VBoxManage
+ * (fake-vboxmanage.sh), at a number of sessions. It compares:
+ *
+ *  - One 'showvminfo' per session (the refresh before the bulk sampler)
+ *  - Hypervisor::updateStates(), which updates every session but skips the
+ *    'showvminfo' of the sessions whose change signals didn't change
+ *  - Virtualbox::updateStates(), a single 'list runningvms' for all the sessions
+ *
+ * Usage: bench-states [sessions ...] 2>/dev/null
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include "Virtualbox.h"
+
+#ifndef FAKE_VBOXMANAGE
+#define FAKE_VBOXMANAGE "./fake-vboxmanage.sh"
+#endif
+
+/* Refreshes measured per method */
+#define ROUNDS  5
+
+using namespace std;
+
+/* The calls of the fake VBoxManage are logged here */
+string callLog;
+
+/**
+ * Return the number of commands the fake VBoxManage ran since the last call
+ */
+int countCalls() {
+    ifstream f( callLog.c_str() );
+    string line;
+    int count = 0;
+    while (getline( f, line )) count++;
+    f.close();
+    remove( callLog.c_str() );
+    return count;
+}
+
+/**
+ * Print the average time and number of commands per refresh
+ */
+void report( const string & title, long time, int calls ) {
+    cout << "  " << title << ": " << ((double)time / ROUNDS) << " ms, " 
+         << ((double)calls / ROUNDS) << " commands per refresh" << endl;
+}
+
+int main( int argc, char ** argv ) {
+    vector<int> counts;
+    for (int i = 1; i < argc; i++) counts.push_back( atoi(argv[i]) );
+    if (counts.empty()) {
+        counts.push_back( 1 ); counts.push_back( 10 ); counts.push_back( 50 );
+    }
+    
+    callLog = getTmpFile( ".log" );
+    setenv( "FAKE_VBOX_LOG", callLog.c_str(), 1 );
+    initSysExec();
+    
+    for (vector<int>::iterator n = counts.begin(); n != counts.end(); ++n) {
+        setenv( "FAKE_VBOX_VMS", ntos<int>( *n ).c_str(), 1 );
+        
+        /* Allocate the sessions (unregistered, so no property watchers are started) */
+        Virtualbox * hv = new Virtualbox();
+        hv->hvBinary = FAKE_VBOXMANAGE;
+        vector<HVSession*> sessions;
+        for (int i = 0; i < *n; i++) {
+            int id = i;
+            HVSession * session = hv->allocateSession( "vm" + ntos<int>( id ), "k" );
+            session->uuid = "{u" + ntos<int>( id ) + "}";
+            sessions.push_back( session );
+        }
+        
+        /* Warm-up: the first update of every session is a complete one */
+        hv->Hypervisor::updateStates( sessions );
+        countCalls();
+        cout << *n << " session(s)" << endl;
+        
+        /* One showvminfo per session */
+        long t = getMillis();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (vector<HVSession*>::iterator it = sessions.begin(); it != sessions.end(); ++it)
+                ((VBoxSession*)*it)->updateCache.valid = false;
+            hv->listInvalidate( "runningvms" );
+            hv->Hypervisor::updateStates( sessions );
+        }
+        report( "showvminfo per session ", getMillis() - t, countCalls() );
+        
+        /* Per session, skipping the unchanged ones */
+        t = getMillis();
+        for (int r = 0; r < ROUNDS; r++) {
+            hv->listInvalidate( "runningvms" );
+            hv->Hypervisor::updateStates( sessions );
+        }
+        report( "per session, if changed", getMillis() - t, countCalls() );
+        
+        /* Bulk */
+        t = getMillis();
+        for (int r = 0; r < ROUNDS; r++)
+            hv->updateStates( sessions );
+        report( "bulk 'list runningvms' ", getMillis() - t, countCalls() );
+        
+        for (vector<HVSession*>::iterator it = sessions.begin(); it != sessions.end(); ++it)
+            hv->freeSession( *it );
+        delete hv;
+    }
+    
+    return 0;
+}
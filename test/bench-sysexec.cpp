@@ -0,0 +1,129 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+/**
+ * Microbenchmark of sysExec(): The latency of running a trivial command with
+ * the event-driven exec engine, against the previous poll(50ms) + sleep loop.
+ *
+ * Usage: bench-sysexec [iterations] [command] 2>/dev/null
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "Utilities.h"
+
+using namespace std;
+
+/**
+ * The sysExec() loop before the event-driven engine: fork, then poll the
+ * pipes for 50ms and sleep for another SYSEXEC_SLEEP_DELAY - 50 ms per round
+ */
+int legacyExec( string app ) {
+    int outfd[2]; if (pipe(outfd) < 0) return -1;
+    int errfd[2]; if (pipe(errfd) < 0) return -1;
+    
+    pid_t pidChild = fork();
+    if (pidChild == -1) return -1;
+    if (pidChild == 0) {
+        close(outfd[0]); close(errfd[0]);
+        dup2(outfd[1], 1); dup2(errfd[1], 2);
+        close(outfd[1]); close(errfd[1]);
+        execl(app.c_str(), app.c_str(), (char *)NULL);
+        _exit(254);
+    }
+    close(outfd[1]); close(errfd[1]);
+    
+    struct pollfd fds[2];
+    fds[0].fd = outfd[0]; fds[0].events = POLLIN;
+    fds[1].fd = errfd[0]; fds[1].events = POLLIN;
+    bool pipeHUP[2];
+    char data[1024];
+    int ret;
+    for (;;) {
+        ret = poll(fds, 2, 50);
+        if (ret > 0) {
+            for (int i=0; i<2; i++) {
+                pipeHUP[i] = false;
+                if (fds[i].revents & POLLIN) {
+                    if (read(fds[i].fd, data, sizeof(data)) <= 0) pipeHUP[i] = true;
+                } else if (fds[i].revents & POLLHUP) {
+                    pipeHUP[i] = true;
+                }
+            }
+            if (pipeHUP[0] && pipeHUP[1]) ret = -1;
+        }
+        if (ret < 0) break;
+        sleepMs( SYSEXEC_SLEEP_DELAY - 50 );
+    }
+    close(outfd[0]); close(errfd[0]);
+    waitpid(pidChild, &ret, 0);
+    return ret;
+}
+
+/**
+ * Print the latency statistics of the given samples
+ */
+void report( const string & title, const vector<long> & samples ) {
+    long total = 0, minTime = samples[0], maxTime = samples[0];
+    for (size_t i = 0; i < samples.size(); i++) {
+        total += samples[i];
+        if (samples[i] < minTime) minTime = samples[i];
+        if (samples[i] > maxTime) maxTime = samples[i];
+    }
+    cout << title << ": " << samples.size() << " runs, avg " << ((double)total / samples.size()) 
+         << " ms, min " << minTime << " ms, max " << maxTime << " ms" << endl;
+}
+
+int main( int argc, char ** argv ) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+    string app = (argc > 2) ? argv[2] : "/bin/true";
+    vector<string> lines;
+    string err;
+    vector<long> samples;
+    long t;
+    
+    initSysExec();
+    
+    for (int i = 0; i < iterations; i++) {
+        t = getMillis();
+        sysExec( app, "", &lines, &err );
+        samples.push_back( getMillis() - t );
+    }
+    report( "sysExec (event-driven)", samples );
+    
+    samples.clear();
+    for (int i = 0; i < iterations; i++) {
+        t = getMillis();
+        legacyExec( app );
+        samples.push_back( getMillis() - t );
+    }
+    report( "poll(50) + sleep loop ", samples );
+    
+    return 0;
+}
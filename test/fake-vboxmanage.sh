@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Minimal stand-in for VBoxManage, used by the benchmarks. It knows $FAKE_VBOX_VMS
+# VMs named vm<i> with UUID {u<i>}, of which the even ones are running, and it
+# appends the name of every command it runs to $FAKE_VBOX_LOG (if set). Their
+# guest properties never change.
+#
+[ -n "$FAKE_VBOX_LOG" ] && echo "$1 $2" >> "$FAKE_VBOX_LOG"
+VMS=${FAKE_VBOX_VMS:-1}
+
+case "$1 $2" in
+"list vms")
+    i=0; while [ $i -lt $VMS ]; do echo "\"vm$i\" {u$i}"; i=$((i+1)); done;;
+"list runningvms")
+    i=0; while [ $i -lt $VMS ]; do echo "\"vm$i\" {u$i}"; i=$((i+2)); done;;
+showvminfo*)
+    i=${2#\{u}; i=${i%\}}
+    if [ $((i % 2)) -eq 0 ]; then STATE=running; else STATE=poweroff; fi
+    cat <<X
+name="vm$i"
+ostype="Linux 2.6 / 3.x (64 bit)"
+UUID="u$i"
+CfgFile="/tmp/fake-vbox/vm$i/vm$i.vbox"
+LogFldr="/tmp/fake-vbox/vm$i/Logs"
+memory=512
+cpus=1
+cpuexecutioncap=100
+VMState="$STATE"
+storagecontrollername0="IDE"
+storagecontrollername1="SATA"
+"IDE-0-0"="/tmp/fake-vbox/ucernvm-1.17-8.iso"
+"SATA-0-0"="/tmp/fake-vbox/vm$i/disk.vdi"
+Forwarding(0)="guestapi,tcp,127.0.0.1,$((31000 + i)),,80"
+vrde="on"
+vrdeports="$((39000 + i))"
+VideoMode="1024,768,32"@0,0 1
+X
+    ;;
+"guestproperty enumerate")
+    echo "Name: /CVMWeb/secret, value: k, timestamp: 1395138175000000000, flags: ";;
+"guestproperty wait")
+    # Nothing changes on the running VMs, so the wait times out after $FAKE_VBOX_WAIT seconds
+    i=${3#\{u}; i=${i%\}}
+    if [ $((i % 2)) -eq 0 ]; then
+        sleep ${FAKE_VBOX_WAIT:-0}
+        echo "VBoxManage: error: Time out or interruption while waiting for a notification." >&2
+    else
+        echo "VBoxManage: error: Machine \"vm$i\" is not running" >&2
+    fi
+    exit 1;;
+"showhdinfo"*)
+    echo "Logical size: 10240 MBytes";;
+esac
+exit 0
@@ -0,0 +1,107 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+/**
+ * Tests of the tool functions in Utilities.cpp
+ */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "Utilities.h"
+
+using namespace std;
+
+int failures = 0;
+
+/**
+ * Check that splitArguments() splits the given command-line into the expected arguments
+ */
+void checkArguments( const string & cmdline, const char ** expected, size_t count ) {
+    vector<string> args;
+    splitArguments( cmdline, &args );
+    bool ok = (args.size() == count);
+    for (size_t i = 0; ok && (i < count); i++)
+        ok = (args[i] == expected[i]);
+    if (ok) return;
+    
+    failures++;
+    cout << "FAIL: splitArguments(" << cmdline << ") = ";
+    for (size_t i = 0; i < args.size(); i++)
+        cout << "[" << args[i] << "]";
+    cout << endl;
+}
+
+/**
+ * Check that OutputParser::find() locates the needle in the given line of the output
+ */
+void checkFind( const string & raw, size_t lineIndex, const char * needle, size_t offset, size_t expected ) {
+    OutputParser output;
+    output.feed( raw.data(), raw.length() );
+    output.finish();
+    size_t ans = output.find( output.lineSpan( lineIndex ), needle, offset );
+    if (ans == expected) return;
+    
+    failures++;
+    cout << "FAIL: find(" << lineIndex << ", " << needle << ", " << offset << ") = " << ans << endl;
+}
+
+int main( int argc, char ** argv ) {
+    
+    /* Plain and quoted arguments */
+    const char * plain[] = { "list", "vms" };
+    checkArguments( "list vms", plain, 2 );
+    const char * doubleQuoted[] = { "createvm", "--name", "My VM", "--register" };
+    checkArguments( "createvm --name \"My VM\" --register", doubleQuoted, 4 );
+    const char * singleQuoted[] = { "guestproperty", "set", "a b", "c" };
+    checkArguments( "guestproperty set 'a b' c", singleQuoted, 4 );
+    const char * emptyQuoted[] = { "storageattach", "--setuuid", "", "--medium", "x" };
+    checkArguments( "storageattach --setuuid \"\" --medium x", emptyQuoted, 5 );
+    const char * innerQuote[] = { "--name", "My \"VM\"" };
+    checkArguments( "--name 'My \"VM\"'", innerQuote, 2 );
+    
+    /* Unbalanced quotes extend to the end of the string */
+    const char * apostrophe[] = { "foobar c" };
+    checkArguments( "foo'bar c", apostrophe, 1 );
+    const char * openDouble[] = { "modifyvm", "--name", "My VM" };
+    checkArguments( "modifyvm --name \"My VM", openDouble, 3 );
+    const char * openSingle[] = { "a", "b" };
+    checkArguments( "a 'b", openSingle, 2 );
+    
+    /* Searches stay within the line they were given */
+    string props = "Name: a, value: 1, timestamp: 5\nName: bb, value: , flags: x\n";
+    checkFind( props, 0, "Name: ", 0, 0 );
+    checkFind( props, 0, ", value:", 6, 7 );
+    checkFind( props, 1, ", timestamp:", 0, string::npos );
+    checkFind( props, 1, ", flags:", 8, 17 );
+    checkFind( props, 1, "x", 0, 26 );
+    checkFind( props, 0, "Name: bb", 0, string::npos );
+    checkFind( props, 0, "", 3, 3 );
+    checkFind( props, 0, "5", 40, string::npos );
+    
+    if (failures > 0) {
+        cout << failures << " test(s) failed" << endl;
+        return 1;
+    }
+    cout << "All tests passed" << endl;
+    return 0;
+}